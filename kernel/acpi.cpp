@@ -1,5 +1,6 @@
 #include "acpi.hpp"
 
+#include <algorithm>
 #include <cstring>
 #include <cstdlib>
 #include "asmfunc.h"
@@ -65,7 +66,31 @@ namespace acpi {
         return (this->header.length - sizeof(DescriptionHeader)) / sizeof(uint64_t);
     }
 
+    const MADTEntryHeader* MADT::Entry(size_t i) const {
+        auto p = reinterpret_cast<const uint8_t*>(this + 1);
+        for (; i > 0; --i) {
+            p += reinterpret_cast<const MADTEntryHeader*>(p)->length;
+        }
+        return reinterpret_cast<const MADTEntryHeader*>(p);
+    }
+
+    size_t MADT::Count() const {
+        auto p = reinterpret_cast<const uint8_t*>(this + 1);
+        const auto end = reinterpret_cast<const uint8_t*>(this) + this->header.length;
+        size_t count = 0;
+        while (p < end) {
+            const auto length = reinterpret_cast<const MADTEntryHeader*>(p)->length;
+            if (length == 0) {
+                break;
+            }
+            p += length;
+            ++count;
+        }
+        return count;
+    }
+
     const FADT* fadt;
+    const MADT* madt;
 
     void WaitMilliseconds(unsigned long msec){
         const bool pm_timer_32 = (fadt->flags >> 8) & 1;
@@ -81,6 +106,47 @@ namespace acpi {
         while (IoIn32(fadt->pm_tmr_blk) < end);
     }
 
+    uint32_t ReadPMTimer(){
+        return IoIn32(fadt->pm_tmr_blk);
+    }
+
+    uint32_t PMTimerDelta(uint32_t start, uint32_t end){
+        const bool pm_timer_32 = (fadt->flags >> 8) & 1;
+        return pm_timer_32 ? end - start : (end - start) & 0x00ffffffu;
+    }
+
+    Calibration CalibrateWithPMTimer(uint64_t (*read_counter)(),
+                                     int num_windows, unsigned long window_usec){
+        const uint32_t window = kPMTimerFreq * window_usec / 1000000;
+        uint64_t total_counts = 0, total_pm = 0;
+        uint64_t min_freq = ~0ul, max_freq = 0;
+
+        for (int i = 0; i < num_windows; ++i){
+            // PM タイマの値が変わった直後に測り始め，変わった直後に測り終える
+            uint32_t pm_start = ReadPMTimer();
+            uint32_t pm;
+            while ((pm = ReadPMTimer()) == pm_start);
+            pm_start = pm;
+            const uint64_t counter_start = read_counter();
+
+            while (PMTimerDelta(pm_start, pm = ReadPMTimer()) < window);
+            const uint64_t counts = read_counter() - counter_start;
+            const uint32_t pm_delta = PMTimerDelta(pm_start, pm);
+
+            const uint64_t freq = counts * kPMTimerFreq / pm_delta;
+            min_freq = std::min(min_freq, freq);
+            max_freq = std::max(max_freq, freq);
+            total_counts += counts;
+            total_pm += pm_delta;
+        }
+
+        const uint64_t freq = total_counts * kPMTimerFreq / total_pm;
+        // 各区間の両端で PM タイマ 1 カウント分ずつずれうる
+        const uint64_t quantization_ppm = 2 * num_windows * 1000000 / total_pm;
+        const uint64_t spread_ppm = (max_freq - min_freq) / 2 * 1000000 / freq;
+        return {freq, std::max(quantization_ppm, spread_ppm)};
+    }
+
     void Initialize(const RSDP& rsdp){
         if (!rsdp.IsValid()){
             Log(kError, "RSDP is not valid\n");
@@ -94,11 +160,13 @@ namespace acpi {
         }
 
         fadt = nullptr;
+        madt = nullptr;
         for (int i=0; i < xsdt.Count(); i++){
             const auto& entry = xsdt[i];
-            if (entry.IsValid("FACP")){
+            if (fadt == nullptr && entry.IsValid("FACP")){
                 fadt = reinterpret_cast<const FADT*>(&entry);
-                break;
+            } else if (madt == nullptr && entry.IsValid("APIC")){
+                madt = reinterpret_cast<const MADT*>(&entry);
             }
         }
 
@@ -106,5 +174,8 @@ namespace acpi {
             Log(kError, "FADT is not found\n");
             exit(1);
         }
+        if (madt == nullptr){
+            Log(kWarn, "MADT is not found; running on the BSP only\n");
+        }
     }
 }
@@ -54,9 +54,65 @@ namespace acpi {
         char reserved3[276 - 116];
     } __attribute__((packed));
 
+    /** @brief MADT（Multiple APIC Description Table）のエントリの共通部分 */
+    struct MADTEntryHeader {
+        uint8_t type;
+        uint8_t length;
+    } __attribute__((packed));
+
+    /** @brief MADT の Processor Local APIC エントリ（type 0） */
+    struct MADTLocalAPIC {
+        static const uint8_t kType = 0;
+
+        MADTEntryHeader header;
+        uint8_t processor_id;
+        uint8_t apic_id;
+        uint32_t flags;
+
+        bool IsEnabled() const { return flags & 1; }
+    } __attribute__((packed));
+
+    struct MADT {
+        DescriptionHeader header;
+
+        uint32_t lapic_address;
+        uint32_t flags;
+
+        /** @brief i 番目のエントリを返す．エントリは可変長なので先頭から辿る． */
+        const MADTEntryHeader* Entry(size_t i) const;
+        size_t Count() const;
+    } __attribute__((packed));
+
     extern const FADT* fadt;
+    /** @brief MADT が見つからなければ nullptr */
+    extern const MADT* madt;
     const int kPMTimerFreq = 3579545;
 
     void WaitMilliseconds(unsigned long msec);
+    /** @brief PM タイマの現在のカウント値を返す． */
+    uint32_t ReadPMTimer();
+    /** @brief PM タイマのカウント値 start から end までの経過カウント数．
+     *
+     * 24 ビット幅のタイマでも 1 回までの桁あふれなら正しく求まる．
+     */
+    uint32_t PMTimerDelta(uint32_t start, uint32_t end);
+
+    /** @brief CalibrateWithPMTimer の結果 */
+    struct Calibration {
+        /** @brief 推定した周波数（Hz） */
+        uint64_t freq;
+        /** @brief 推定誤差（ppm） */
+        uint64_t error_ppm;
+    };
+
+    /** @brief 単調増加するカウンタの周波数を PM タイマと比べて求める．
+     *
+     * window_usec マイクロ秒の短い区間を num_windows 回測り，合計から周波数を，
+     * 区間ごとのばらつきと PM タイマの分解能から誤差を見積もる．
+     *
+     * @param read_counter  計測対象のカウンタを読む関数．
+     */
+    Calibration CalibrateWithPMTimer(uint64_t (*read_counter)(),
+                                     int num_windows, unsigned long window_usec);
     void Initialize(const RSDP& rsdp);
 }
@@ -76,6 +76,221 @@ SetCR3:
     mov cr3, rdi
     ret
 
+global GetCR3  ; uint64_t GetCR3(void);
+GetCR3:
+    mov rax, cr3
+    ret
+
+global GetCR0  ; uint64_t GetCR0(void);
+GetCR0:
+    mov rax, cr0
+    ret
+
+global SetCR0  ; void SetCR0(uint64_t value);
+SetCR0:
+    mov cr0, rdi
+    ret
+
+global GetCR4  ; uint64_t GetCR4(void);
+GetCR4:
+    mov rax, cr4
+    ret
+
+global SetCR4  ; void SetCR4(uint64_t value);
+SetCR4:
+    mov cr4, rdi
+    ret
+
+global SetXCR0  ; void SetXCR0(uint64_t value);
+SetXCR0:
+    mov eax, edi
+    mov rdx, rdi
+    shr rdx, 32
+    xor ecx, ecx
+    xsetbv
+    ret
+
+global ReadTSC  ; uint64_t ReadTSC(void);
+ReadTSC:
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global ReadMSR  ; uint64_t ReadMSR(uint32_t msr);
+ReadMSR:
+    mov ecx, edi
+    rdmsr
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global WriteMSR  ; void WriteMSR(uint32_t msr, uint64_t value);
+WriteMSR:
+    mov ecx, edi
+    mov eax, esi
+    mov rdx, rsi
+    shr rdx, 32
+    wrmsr
+    ret
+
+global ReadCPUID  ; void ReadCPUID(uint32_t leaf, uint32_t subleaf, uint32_t* regs);
+ReadCPUID:
+    push rbx
+    mov r8, rdx   ; r8 = regs
+    mov eax, edi
+    mov ecx, esi
+    cpuid
+    mov [r8], eax
+    mov [r8 + 4], ebx
+    mov [r8 + 8], ecx
+    mov [r8 + 12], edx
+    pop rbx
+    ret
+
+global SwitchContext
+SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
+    mov [rsi + 0x40], rax
+    mov [rsi + 0x48], rbx
+    mov [rsi + 0x50], rcx
+    mov [rsi + 0x58], rdx
+    mov [rsi + 0x60], rdi
+    mov [rsi + 0x68], rsi
+
+    lea rax, [rsp + 8]
+    mov [rsi + 0x70], rax  ; RSP
+    mov [rsi + 0x78], rbp
+
+    mov [rsi + 0x80], r8
+    mov [rsi + 0x88], r9
+    mov [rsi + 0x90], r10
+    mov [rsi + 0x98], r11
+    mov [rsi + 0xa0], r12
+    mov [rsi + 0xa8], r13
+    mov [rsi + 0xb0], r14
+    mov [rsi + 0xb8], r15
+
+    mov rax, cr3
+    mov [rsi + 0x00], rax  ; CR3
+    mov rax, [rsp]
+    mov [rsi + 0x08], rax  ; RIP
+    pushfq
+    pop qword [rsi + 0x10] ; RFLAGS
+
+    mov ax, cs
+    mov [rsi + 0x20], rax
+    mov bx, ss
+    mov [rsi + 0x28], rbx
+    mov cx, fs
+    mov [rsi + 0x30], rcx
+    mov dx, gs
+    mov [rsi + 0x38], rdx
+
+    ; 拡張状態はここでは保存・復帰しない．次のタスクがレジスタ上の状態の
+    ; 持ち主でなければ CR0.TS を立て，最初に拡張命令を使ったときの #NM に任せる
+    mov rax, [rdi + 0x18]  ; 拡張状態の保存領域
+    mov [rel fpu_current_area], rax
+    mov rbx, cr0
+    mov rcx, rbx
+    and rcx, ~(1 << 3)  ; TS
+    cmp rax, [rel fpu_owner_area]
+    je .set_ts
+    or rcx, 1 << 3
+.set_ts:
+    cmp rcx, rbx
+    je .ts_done  ; CR0 への書き込みは遅いので，変わらなければ書かない
+    mov cr0, rcx
+.ts_done:
+
+    ; iret 用のスタックフレーム
+    push qword [rdi + 0x28] ; SS
+    push qword [rdi + 0x70] ; RSP
+    push qword [rdi + 0x10] ; RFLAGS
+    push qword [rdi + 0x20] ; CS
+    push qword [rdi + 0x08] ; RIP
+
+    ; コンテキストの復帰
+
+    mov rax, [rdi + 0x00]
+    mov cr3, rax
+    mov rax, [rdi + 0x30]
+    mov fs, ax
+    mov rax, [rdi + 0x38]
+    mov gs, ax
+
+    mov rax, [rdi + 0x40]
+    mov rbx, [rdi + 0x48]
+    mov rcx, [rdi + 0x50]
+    mov rdx, [rdi + 0x58]
+    mov rsi, [rdi + 0x68]
+    mov rbp, [rdi + 0x78]
+    mov r8,  [rdi + 0x80]
+    mov r9,  [rdi + 0x88]
+    mov r10, [rdi + 0x90]
+    mov r11, [rdi + 0x98]
+    mov r12, [rdi + 0xa0]
+    mov r13, [rdi + 0xa8]
+    mov r14, [rdi + 0xb0]
+    mov r15, [rdi + 0xb8]
+
+    mov rdi, [rdi + 0x60]
+
+    o64 iret
+
+extern fpu_owner_area
+extern fpu_current_area
+extern fpu_save_mode
+extern fpu_restore_count
+
+; #NM（デバイス使用不可）例外のハンドラ．CR0.TS が立った状態で拡張命令を使うと呼ばれる．
+; レジスタ上の拡張状態を持ち主の領域に保存し，実行中のタスクの状態を復帰する．
+; 拡張命令を使うとハンドラの中で状態を壊すので，C++ ではなくここに書く．
+global IntHandlerDeviceNotAvailable
+IntHandlerDeviceNotAvailable:
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    clts
+
+    mov rsi, [rel fpu_owner_area]
+    mov rcx, [rel fpu_current_area]
+    cmp rsi, rcx
+    je .done
+    mov [rel fpu_owner_area], rcx
+    inc qword [rel fpu_restore_count]
+
+    mov eax, 0xffffffff  ; EDX:EAX = 保存・復帰する状態．XCR0 で有効なものすべて
+    mov edx, eax
+    cmp byte [rel fpu_save_mode], 0
+    jne .xsave
+
+    test rsi, rsi
+    jz .fxrstor
+    fxsave [rsi]
+.fxrstor:
+    fxrstor [rcx]
+    jmp .done
+
+.xsave:
+    test rsi, rsi
+    jz .xrstor
+    cmp byte [rel fpu_save_mode], 2
+    jne .xsave_plain
+    xsaveopt [rsi]  ; 直前の XRSTOR から変わっていない状態は書かない
+    jmp .xrstor
+.xsave_plain:
+    xsave [rsi]
+.xrstor:
+    xrstor [rcx]
+
+.done:
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rax
+    o64 iret
+
 extern kernel_main_stack
 extern KernelMainNewStack
 
@@ -86,3 +301,100 @@ KernelMain:
 .fin:
     hlt
     jmp .fin
+
+; AP（アプリケーションプロセッサ）の起動コード．
+; BSP がこのコードを 1 MiB 未満のページへコピーし，SIPI でそこから実行させる．
+; AP は CS:IP = (ページ番号 << 8):0 のリアルモードで動き出し，
+; プロテクトモードを経てロングモードに入ってから
+; ApTrampolineData の entry(arg) を stack のスタックで呼び出す．
+; コピー先で動くので，アドレスはすべて ApTrampoline からの差で表す．
+align 16
+bits 16
+global ApTrampoline
+ApTrampoline:
+    cli
+    mov ax, cs
+    mov ds, ax
+    xor ebx, ebx
+    mov bx, ax
+    shl ebx, 4  ; ebx = コピー先の物理アドレス
+
+    ; 物理アドレスが必要な箇所を埋める．リアルモードではスタックを使えない
+    lea eax, [ebx + (ApTrampolineGDT - ApTrampoline)]
+    mov [ApTrampolineGDTR - ApTrampoline + 2], eax
+    lea eax, [ebx + (ApTrampoline32 - ApTrampoline)]
+    mov [ApTrampolineFar32 - ApTrampoline], eax
+    lea eax, [ebx + (ApTrampoline64 - ApTrampoline)]
+    mov [ApTrampolineFar64 - ApTrampoline], eax
+
+    o32 lgdt [ApTrampolineGDTR - ApTrampoline]
+    mov eax, cr0
+    or eax, 1  ; PE
+    mov cr0, eax
+    o32 jmp far [ApTrampolineFar32 - ApTrampoline]
+
+bits 32
+ApTrampoline32:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    mov eax, cr4
+    or eax, (1 << 5) | (1 << 9) | (1 << 10)  ; PAE, OSFXSR, OSXMMEXCPT
+    mov cr4, eax
+    mov eax, [ebx + (ApTrampolineData - ApTrampoline)]  ; CR3
+    mov cr3, eax
+
+    mov ecx, 0xc0000080  ; IA32_EFER
+    rdmsr
+    or eax, 1 << 8  ; LME
+    wrmsr
+
+    mov eax, cr0
+    and eax, ~(1 << 2)  ; EM
+    or eax, (1 << 31) | (1 << 1)  ; PG, MP
+    mov cr0, eax
+    jmp far [ebx + (ApTrampolineFar64 - ApTrampoline)]
+
+bits 64
+ApTrampoline64:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    mov ebx, ebx  ; 32 ビットモードから引き継いだ上位 32 ビットを消す
+
+    mov rsp, [rbx + (ApTrampolineData - ApTrampoline) + 8]
+    mov rdi, [rbx + (ApTrampolineData - ApTrampoline) + 24]
+    mov rax, [rbx + (ApTrampolineData - ApTrampoline) + 16]
+    call rax
+.fin:
+    hlt
+    jmp .fin
+
+align 8
+ApTrampolineGDT:
+    dq 0
+    dq 0x00cf9a000000ffff  ; 0x08: 32 ビットコード
+    dq 0x00cf92000000ffff  ; 0x10: データ
+    dq 0x00af9a000000ffff  ; 0x18: 64 ビットコード
+ApTrampolineGDTR:
+    dw 4 * 8 - 1
+    dd 0
+ApTrampolineFar32:
+    dd 0
+    dw 0x08
+ApTrampolineFar64:
+    dd 0
+    dw 0x18
+
+align 8
+global ApTrampolineData
+ApTrampolineData:
+    dq 0  ; CR3
+    dq 0  ; スタックの末尾
+    dq 0  ; エントリ関数
+    dq 0  ; エントリ関数に渡す引数
+global ApTrampolineEnd
+ApTrampolineEnd:
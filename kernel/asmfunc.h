@@ -11,4 +11,18 @@ extern "C" {
   void SetCSSS(uint16_t cs, uint16_t ss);
   void SetDSAll(uint16_t value);
   void SetCR3(uint64_t value);
+  uint64_t GetCR3(void);
+  uint64_t GetCR0(void);
+  void SetCR0(uint64_t value);
+  uint64_t GetCR4(void);
+  void SetCR4(uint64_t value);
+  void SetXCR0(uint64_t value);
+  uint64_t ReadTSC(void);
+  uint64_t ReadMSR(uint32_t msr);
+  void WriteMSR(uint32_t msr, uint64_t value);
+  /** regs[0..3] に EAX, EBX, ECX, EDX の順で結果を書き込む */
+  void ReadCPUID(uint32_t leaf, uint32_t subleaf, uint32_t* regs);
+  void SwitchContext(void* next_ctx, void* current_ctx);
+  /** #NM のハンドラ．InterruptFrame を受け取る割り込みゲートとして登録する */
+  void IntHandlerDeviceNotAvailable(void);
 }
@@ -0,0 +1,451 @@
+#include "benchmark.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "asmfunc.h"
+#include "clock.hpp"
+#include "fpu.hpp"
+#include "graphics.hpp"
+#include "idle.hpp"
+#include "job.hpp"
+#include "layer.hpp"
+#include "memory_manager.hpp"
+#include "message.hpp"
+#include "smp.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+#include "usb/classdriver/msc.hpp"
+#include "usb/xhci/xhci.hpp"
+
+int printk(const char* format, ...);
+
+namespace {
+  /** @brief 再現性のある擬似乱数（xorshift32） */
+  class Random {
+   public:
+    explicit Random(uint32_t seed) : state_{seed} {}
+    uint32_t Next() {
+      state_ ^= state_ << 13;
+      state_ ^= state_ >> 17;
+      state_ ^= state_ << 5;
+      return state_;
+    }
+
+   private:
+    uint32_t state_;
+  };
+
+  /** @brief ジョブの中身．数百回の乱数生成で 1 µs 程度かかる． */
+  void SpinJob(void* arg) {
+    auto result = static_cast<uint32_t*>(arg);
+    Random rand{*result | 1};
+    for (int i = 0; i < 500; ++i) {
+      rand.Next();
+    }
+    *result = rand.Next();
+  }
+
+  /** @brief 画面に表示されている内容の FNV-1a ハッシュ */
+  uint32_t HashScreen() {
+    uint32_t hash = 2166136261u;
+    for (unsigned int y = 0; y < screen_config.vertical_resolution; ++y) {
+      auto line = reinterpret_cast<const uint32_t*>(screen_config.frame_buffer)
+        + y * screen_config.pixels_per_scan_line;
+      for (unsigned int x = 0; x < screen_config.horizontal_resolution; ++x) {
+        hash = (hash ^ line[x]) * 16777619u;
+      }
+    }
+    return hash;
+  }
+
+  /** @brief 画面全体を kNumFrames 回描画し，1 回あたりの時間（ナノ秒）を返す． */
+  uint64_t DrawFullScreen(bool tiled) {
+    const int kNumFrames = 20;
+    const Rectangle<int> area{{0, 0}, ScreenSize()};
+
+    layer_manager->SetTiledDraw(tiled);
+    const auto start = Clock::Now();
+    for (int i = 0; i < kNumFrames; ++i) {
+      layer_manager->Draw(area);
+    }
+    return (Clock::Now() - start) / kNumFrames;
+  }
+
+  /** @brief ジョブを始めた時刻（TSC）を記録するだけのジョブ */
+  void RecordStartJob(void* arg) {
+    static_cast<std::atomic<uint64_t>*>(arg)->store(ReadTSC(), std::memory_order_release);
+  }
+
+  /** @brief 投入したジョブを AP 1 が始めるまでの TSC のカウント数を返す． */
+  uint64_t MeasureWakeup() {
+    // AP 1 が IdleWait に入り，実際に眠るまで待つ
+    while (!IsCPUIdle(1)) {
+      __builtin_ia32_pause();
+    }
+    const auto sleep_until = Clock::Now() + 10000;
+    while (Clock::Now() < sleep_until);
+
+    std::atomic<uint64_t> started{0};
+    JobGroup group;
+    Job job{RecordStartJob, &started, &group};
+    const auto submitted = ReadTSC();
+    SubmitJob(job);
+    // WaitJobs は自分でもジョブを実行してしまうので，AP が始めるまで待ってから呼ぶ
+    uint64_t start;
+    while ((start = started.load(std::memory_order_acquire)) == 0) {
+      __builtin_ia32_pause();
+    }
+    WaitJobs(group);
+    return start - submitted;
+  }
+
+  /** @brief 拡張レジスタを 1 つ書き換える．CR0.TS が立っていれば #NM が起きる． */
+  void TouchSSE() {
+    __asm__ volatile("xorps %%xmm0, %%xmm0" ::: "xmm0");
+  }
+
+  /** @brief BenchmarkContextSwitch の相手のタスクが SSE を使うなら true */
+  volatile bool partner_uses_sse;
+  /** @brief BenchmarkContextSwitch が測り終えたら true．相手のタスクは眠ったままになる */
+  volatile bool partner_done;
+
+  /** @brief 切り替えられるたびに，すぐにメインタスクへ切り替え返すタスク */
+  void ContextSwitchPartner(uint64_t task_id, int64_t data) {
+    __asm__("cli");
+    while (!partner_done) {
+      if (partner_uses_sse) {
+        TouchSSE();
+      }
+      task_manager->SwitchTask();
+    }
+    // タスクを終わらせる仕組みは無いので，起こされても眠り直す
+    while (true) {
+      task_manager->Sleep(task_id);
+    }
+  }
+
+  /** @brief RecordInputLatency の集計．kInputLatencySamples 回ごとに表示して数え直す */
+  const int kInputLatencySamples = 256;
+  int input_latency_count;
+  uint64_t input_latency_min;
+  uint64_t input_latency_max;
+  uint64_t input_latency_sum;
+
+  uint64_t boot_start_tsc;
+  /** @brief 起動時間から除く TSC のカウント数 */
+  uint64_t excluded_tsc;
+  bool first_frame_reported;
+}
+
+void BenchmarkTimerManager() {
+  const int kNumTimers = 10000;
+  const unsigned long kMaxTimeout = 100000;
+
+  std::deque<Message> queue;
+  auto manager = new TimerManager{queue};
+  std::vector<TimerHandle> handles(kNumTimers);
+  Random rand{1};
+
+  const auto add_start = ReadTSC();
+  for (int i = 0; i < kNumTimers; ++i) {
+    const auto timeout = 1 + rand.Next() % kMaxTimeout;
+    handles[i] = manager->AddTimer(Timer{timeout, i}).value;
+  }
+  const auto add_cycles = ReadTSC() - add_start;
+
+  int num_canceled = 0;
+  const auto cancel_start = ReadTSC();
+  for (int i = 0; i < kNumTimers; i += 4) {
+    if (!manager->CancelTimer(handles[i])) {
+      ++num_canceled;
+    }
+  }
+  const auto cancel_cycles = ReadTSC() - cancel_start;
+
+  unsigned long num_ticks = 0;
+  const auto tick_start = ReadTSC();
+  while (manager->NumTimers() > 0) {
+    manager->Tick();
+    ++num_ticks;
+  }
+  const auto tick_cycles = ReadTSC() - tick_start;
+
+  printk("TimerManager: %d timers\n", kNumTimers);
+  printk("  add    %lu cycles/op\n", add_cycles / kNumTimers);
+  printk("  cancel %lu cycles/op (%d canceled)\n",
+         cancel_cycles / num_canceled, num_canceled);
+  printk("  tick   %lu cycles/tick, %lu expired in %lu ticks\n",
+         tick_cycles / num_ticks, queue.size(), num_ticks);
+
+  delete manager;
+}
+
+void BenchmarkClock() {
+  const int kNumCalls = 100000;
+
+  uint64_t min_step = ~0ul;
+  uint64_t prev = Clock::Now();
+  const auto start = Clock::Now();
+  for (int i = 0; i < kNumCalls; ++i) {
+    const auto now = Clock::Now();
+    if (now > prev) {
+      min_step = std::min(min_step, now - prev);
+    }
+    prev = now;
+  }
+  const auto elapsed = Clock::Now() - start;
+
+  printk("Clock: TSC %lu Hz\n", Clock::CounterFrequency());
+  printk("  Now()  %lu ns/call, resolution %lu ns\n",
+         elapsed / kNumCalls, min_step);
+}
+
+void BenchmarkJobs() {
+  const int kNumJobs = 20000;
+
+  std::vector<Job> jobs(kNumJobs);
+  std::vector<uint32_t> results(kNumJobs);
+
+  printk("Jobs: %d jobs\n", kNumJobs);
+  uint64_t single_cpu_ns = 0;
+  for (int n = 1; n <= num_cpus; ++n) {
+    SetJobCPUs(n);
+    for (int i = 0; i < kNumJobs; ++i) {
+      results[i] = i;
+    }
+
+    JobGroup group;
+    const auto start = Clock::Now();
+    for (int i = 0; i < kNumJobs; ++i) {
+      jobs[i] = Job{SpinJob, &results[i], &group};
+      SubmitJob(jobs[i]);
+    }
+    WaitJobs(group);
+    const auto elapsed = Clock::Now() - start;
+
+    if (n == 1) {
+      single_cpu_ns = elapsed;
+    }
+    printk("  %2d CPUs %8lu jobs/s, speedup x%lu.%02lu\n",
+           n, kNumJobs * 1000000000ul / elapsed,
+           single_cpu_ns / elapsed, single_cpu_ns * 100 / elapsed % 100);
+  }
+  SetJobCPUs(kMaxCPUs);
+}
+
+void BenchmarkIdleWakeup() {
+  const int kNumWakeups = 100;
+
+  if (num_cpus < 2) {
+    printk("IdleWakeup: skipped (needs 2 CPUs)\n");
+    return;
+  }
+
+  printk("IdleWakeup: %d wakeups of CPU 1\n", kNumWakeups);
+  const auto mode = CurrentIdleMode();
+  SetJobCPUs(2);
+  for (auto m : {IdleMode::kHalt, IdleMode::kMWait}) {
+    SetIdleMode(m);
+    if (CurrentIdleMode() != m) {
+      printk("  mwait  not supported\n");
+      continue;
+    }
+    MeasureWakeup(); // AP 1 を新しい眠り方で眠らせ直す
+
+    uint64_t min_cycles = ~0ul, total_cycles = 0;
+    for (int i = 0; i < kNumWakeups; ++i) {
+      const auto cycles = MeasureWakeup();
+      min_cycles = std::min(min_cycles, cycles);
+      total_cycles += cycles;
+    }
+    printk("  %-6s min %6lu ns, avg %6lu ns\n",
+           m == IdleMode::kHalt ? "hlt" : "mwait",
+           Clock::CounterToNanoseconds(min_cycles),
+           Clock::CounterToNanoseconds(total_cycles / kNumWakeups));
+  }
+  SetJobCPUs(kMaxCPUs);
+  SetIdleMode(mode);
+}
+
+void BenchmarkContextSwitch() {
+  const int kNumRoundTrips = 10000;
+
+  Task& partner = task_manager->NewTask();
+  if (auto err = partner.InitContext(ContextSwitchPartner, 0)) {
+    printk("ContextSwitch: failed to create task: %s\n", err.Name());
+    return;
+  }
+
+  printk("ContextSwitch: %d round trips\n", kNumRoundTrips);
+  const struct {
+    const char* name;
+    bool main_uses_sse, partner_uses_sse;
+  } cases[] = {
+    {"no SSE     ", false, false},
+    {"one task   ", false, true},
+    {"both tasks ", true, true},
+  };
+
+  __asm__("cli");
+  partner_done = false;
+  task_manager->Wakeup(&partner, TaskManager::kMaxLevel);
+  for (const auto& c : cases) {
+    partner_uses_sse = c.partner_uses_sse;
+    task_manager->SwitchTask(); // 相手のタスクに新しい設定で 1 周させておく
+
+    const auto restores = FPURestoreCount();
+    const auto start = ReadTSC();
+    for (int i = 0; i < kNumRoundTrips; ++i) {
+      if (c.main_uses_sse) {
+        TouchSSE();
+      }
+      task_manager->SwitchTask();
+    }
+    const auto cycles = ReadTSC() - start;
+
+    printk("  %s %5lu cycles/switch, %lu restores\n", c.name,
+           cycles / (2 * kNumRoundTrips), FPURestoreCount() - restores);
+  }
+  // 相手のタスクに自分で眠らせる
+  partner_done = true;
+  task_manager->SwitchTask();
+  __asm__("sti");
+}
+
+void BenchmarkCompositor() {
+  const bool tiled = layer_manager->IsTiledDraw();
+  const auto screen_size = ScreenSize();
+
+  const auto serial_ns = DrawFullScreen(false);
+  const auto serial_hash = HashScreen();
+  const auto tiled_ns = DrawFullScreen(true);
+  const auto tiled_hash = HashScreen();
+  layer_manager->SetTiledDraw(tiled);
+
+  printk("Compositor: %dx%d, %d CPUs, %dx%d tiles\n",
+         screen_size.x, screen_size.y, num_cpus,
+         LayerManager::kTileWidth, LayerManager::kTileHeight);
+  printk("  serial %6lu us/frame\n", serial_ns / 1000);
+  printk("  tiled  %6lu us/frame, speedup x%lu.%02lu, %s\n",
+         tiled_ns / 1000, serial_ns / tiled_ns, serial_ns * 100 / tiled_ns % 100,
+         serial_hash == tiled_hash ? "identical" : "MISMATCH");
+}
+
+void BenchmarkUSBStorage(usb::MassStorageDriver& msc) {
+  const uint64_t kMaxTotalBytes = 16 * 1024 * 1024;
+  const size_t kChunkBytes[] = {16 * 1024, 64 * 1024, usb::MassStorageDriver::kMaxTransferBytes};
+  /** @brief 同時に積んでおく Read の数 */
+  const size_t kDepth = 2;
+
+  const size_t buf_frames = usb::MassStorageDriver::kMaxTransferBytes / kBytesPerFrame * kDepth;
+  const auto buf_frame = memory_manager->Allocate(buf_frames);
+  if (buf_frame.error) {
+    printk("USB storage: no memory for the read buffers\n");
+    return;
+  }
+  auto buf = reinterpret_cast<uint8_t*>(buf_frame.value.Frame());
+
+  struct Progress {
+    size_t completed;
+    uint64_t bytes;
+    bool failed;
+  };
+  auto on_read = [](void* arg, Error err, size_t bytes) {
+    auto progress = static_cast<Progress*>(arg);
+    ++progress->completed;
+    progress->bytes += bytes;
+    progress->failed |= static_cast<bool>(err);
+  };
+
+  const uint64_t capacity = msc.NumBlocks() * msc.BlockSize();
+  printk("USB storage: %lu MiB, %u bytes/block\n", capacity >> 20, msc.BlockSize());
+  for (const size_t chunk : kChunkBytes) {
+    const size_t blocks_per_read = chunk / msc.BlockSize();
+    const size_t num_reads = std::min(kMaxTotalBytes, capacity) / chunk;
+    if (blocks_per_read == 0 || num_reads == 0) {
+      continue;
+    }
+
+    Progress progress{0, 0, false};
+    size_t submitted = 0;
+    const auto start = Clock::Now();
+    // 失敗しても，積んだ Read がすべて完了するまではバッファと progress を手放さない
+    while (progress.completed < submitted || (submitted < num_reads && !progress.failed)) {
+      while (!progress.failed &&
+             submitted < num_reads && submitted - progress.completed < kDepth) {
+        auto dst = buf + (submitted % kDepth) * usb::MassStorageDriver::kMaxTransferBytes;
+        if (msc.Read(submitted * blocks_per_read, blocks_per_read, dst, on_read, &progress)) {
+          progress.failed = true;
+          break;
+        }
+        ++submitted;
+      }
+      for (size_t i = 0; i < usb::xhci::controller->NumInterrupters(); ++i) {
+        usb::xhci::ProcessEvents(i);
+      }
+    }
+    const auto elapsed = Clock::Now() - start;
+
+    if (progress.failed) {
+      printk("  %4lu KiB reads: failed\n", chunk / 1024);
+      break;
+    }
+    printk("  %4lu KiB reads: %lu KiB/s (%lu reads in %lu ms)\n",
+           chunk / 1024, progress.bytes * 1'000'000'000 / 1024 / elapsed,
+           num_reads, elapsed / 1'000'000);
+  }
+
+  memory_manager->Free(buf_frame.value, buf_frames);
+}
+
+void RecordInputLatency(uint64_t seen_counter) {
+  if (seen_counter == 0) {
+    return;
+  }
+  const auto ns = Clock::CounterToNanoseconds(Clock::ReadCounter() - seen_counter);
+  if (input_latency_count == 0) {
+    input_latency_min = input_latency_max = ns;
+    input_latency_sum = 0;
+  }
+  input_latency_min = std::min(input_latency_min, ns);
+  input_latency_max = std::max(input_latency_max, ns);
+  input_latency_sum += ns;
+
+  if (++input_latency_count == kInputLatencySamples) {
+    printk("Input latency (%s): min %lu ns, avg %lu ns, max %lu ns (%d reports)\n",
+           usb::xhci::PollingModeName(usb::xhci::CurrentPollingMode()),
+           input_latency_min, input_latency_sum / kInputLatencySamples,
+           input_latency_max, kInputLatencySamples);
+    input_latency_count = 0;
+  }
+}
+
+void MarkBootStart() {
+  boot_start_tsc = ReadTSC();
+}
+
+void MarkFirstFrame() {
+  if (first_frame_reported) {
+    return;
+  }
+  first_frame_reported = true;
+
+  const auto elapsed = ReadTSC() - boot_start_tsc - excluded_tsc;
+  printk("Boot to first frame: %lu us\n",
+         Clock::CounterToNanoseconds(elapsed) / 1000);
+}
+
+void RunBenchmarks() {
+  const auto start = ReadTSC();
+  BenchmarkClock();
+  BenchmarkTimerManager();
+  BenchmarkJobs();
+  BenchmarkIdleWakeup();
+  BenchmarkContextSwitch();
+  BenchmarkCompositor();
+  excluded_tsc += ReadTSC() - start;
+}
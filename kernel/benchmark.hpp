@@ -0,0 +1,61 @@
+/**
+ * @file benchmark.hpp
+ *
+ * カーネル内部の性能を計測するプログラムを集めたファイル．
+ *
+ * make BENCHMARK=1 でビルドすると，起動時に RunBenchmarks が呼ばれ
+ * 各計測結果がコンソールに表示される．
+ */
+
+#pragma once
+
+/** @brief 10000 個のタイマを同時に登録し，登録・取り消し・満了処理の時間を計測する． */
+void BenchmarkTimerManager();
+
+/** @brief Clock::Now() 1 回あたりの所要時間と，連続して呼んだときの最小刻みを計測する． */
+void BenchmarkClock();
+
+/** @brief 小さなジョブを大量に投入し，使うコア数を 1 から全コアまで変えてスループットを計測する． */
+void BenchmarkJobs();
+
+/** @brief 眠っている AP にジョブを投入してから，その AP がジョブを始めるまでの時間を hlt と MWAIT で計測する． */
+void BenchmarkIdleWakeup();
+
+/** @brief 2 つのタスクの間で切り替えを繰り返し，拡張状態（SSE）の使い方ごとに切り替え 1 回の時間を計測する． */
+void BenchmarkContextSwitch();
+
+/** @brief 画面全体の再描画を逐次とタイル分割で行い，所要時間と描画結果が一致するかを表示する． */
+void BenchmarkCompositor();
+
+namespace usb {
+  class MassStorageDriver;
+}
+
+/** @brief USB マスストレージの先頭から順に読み込み，1 回の読み込みサイズごとのスループットを計測する．
+ *
+ * デバイスの準備ができるのは起動後しばらくしてからなので RunBenchmarks には含めない．
+ * メインループが xHCI のイベントを処理し終えた後に呼ぶ．
+ */
+void BenchmarkUSBStorage(usb::MassStorageDriver& msc);
+
+/** @brief xHC がイベントリングにイベントを書いてから Mouse::OnInterrupt が呼ばれるまでの時間を記録する．
+ *
+ * seen_counter はマウスの入力イベントの InputEvent::timestamp で，0 なら記録しない．
+ * 見張るコアが無ければ timestamp は HID ドライバがレポートを受け取った時刻なので，xHC 側の遅れは含まない．
+ * 一定の回数ごとに最小・平均・最大を xHCI のポーリングのモードと合わせて表示する．
+ * make USB_POLLING=timer または USB_POLLING=core でビルドすると，モードを変えて比べられる．
+ */
+void RecordInputLatency(uint64_t seen_counter);
+
+/** @brief 起動時刻を記録する．KernelMainNewStack の先頭で呼ぶ． */
+void MarkBootStart();
+
+/** @brief 起動してから最初のフレームを描き終えるまでの時間を表示する．
+ *
+ * メインループで描画するたびに呼んでよい．表示するのは初回だけで，
+ * RunBenchmarks に掛かった時間は除く．
+ */
+void MarkFirstFrame();
+
+/** @brief 全てのベンチマークを順に実行する． */
+void RunBenchmarks();
@@ -0,0 +1,91 @@
+#include "clock.hpp"
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "logger.hpp"
+
+namespace {
+    const uint64_t kNanosecondsPerSecond = 1000000000;
+
+    /** @brief CPUID leaf 0x15/0x16 から TSC の周波数を求める．分からなければ 0 を返す． */
+    uint64_t TSCFrequencyFromCPUID(){
+        uint32_t regs[4];
+        ReadCPUID(0, 0, regs);
+        const uint32_t max_leaf = regs[0];
+        if (max_leaf < 0x15){
+            return 0;
+        }
+
+        ReadCPUID(0x15, 0, regs);
+        const uint32_t denominator = regs[0];
+        const uint32_t numerator = regs[1];
+        const uint32_t crystal_hz = regs[2];
+        if (denominator == 0 || numerator == 0){
+            return 0;
+        }
+        if (crystal_hz != 0){
+            return static_cast<uint64_t>(crystal_hz) * numerator / denominator;
+        }
+
+        // 水晶の周波数が報告されなければ，TSC はプロセッサの基本周波数で進むとみなす
+        if (max_leaf < 0x16){
+            return 0;
+        }
+        ReadCPUID(0x16, 0, regs);
+        return static_cast<uint64_t>(regs[0] & 0xffffu) * 1000000;
+    }
+
+    bool IsTSCInvariant(){
+        uint32_t regs[4];
+        ReadCPUID(0x80000000, 0, regs);
+        if (regs[0] < 0x80000007){
+            return false;
+        }
+        ReadCPUID(0x80000007, 0, regs);
+        return (regs[3] >> 8) & 1;
+    }
+}
+
+uint64_t Clock::counter_freq_;
+uint64_t Clock::counter_base_;
+uint64_t Clock::mult_;
+
+uint64_t Clock::Now(){
+    return CounterToNanoseconds(ReadCounter() - counter_base_);
+}
+
+uint64_t Clock::ReadCounter(){
+    return ReadTSC();
+}
+
+uint64_t Clock::CounterToNanoseconds(uint64_t counter_delta){
+    return static_cast<unsigned __int128>(counter_delta) * mult_ >> kShift;
+}
+
+uint64_t Clock::CounterAt(uint64_t ns){
+    const uint64_t rem = ns % kNanosecondsPerSecond * counter_freq_;
+    return counter_base_ + ns / kNanosecondsPerSecond * counter_freq_
+        + (rem + kNanosecondsPerSecond - 1) / kNanosecondsPerSecond;
+}
+
+void InitializeClock(){
+    if (!IsTSCInvariant()){
+        Log(kWarn, "TSC is not invariant; clock may drift in deep C-states\n");
+    }
+
+    const char* source = "CPUID";
+    uint64_t freq = TSCFrequencyFromCPUID();
+    uint64_t error_ppm = 0;
+    if (freq == 0){
+        source = "PM timer";
+        const auto calib = acpi::CalibrateWithPMTimer(ReadTSC, 4, 2000);
+        freq = calib.freq;
+        error_ppm = calib.error_ppm;
+    }
+
+    Clock::counter_freq_ = freq;
+    // 切り上げておくと CounterAt で求めた時刻に Now() が追い越されることはない
+    Clock::mult_ = ((kNanosecondsPerSecond << Clock::kShift) + freq - 1) / freq;
+    Clock::counter_base_ = ReadTSC();
+    Log(kInfo, "Clock: TSC %lu Hz +-%lu ppm (from %s)\n", freq, error_ppm, source);
+}
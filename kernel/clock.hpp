@@ -0,0 +1,43 @@
+/**
+ * @file clock.hpp
+ *
+ * TSC を基にした高分解能の単調増加時計．
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/** @brief 起動後の経過時間をナノ秒単位で返す時計．
+ *
+ * invariant TSC を時刻源とし，その周波数は CPUID leaf 0x15/0x16 から，
+ * それらが使えなければ ACPI PM タイマとの比較で求める．
+ * カウンタ値からナノ秒への変換は乗算とシフトだけで済ませるので，
+ * 割り込みハンドラやプロファイラから気軽に呼べる．
+ */
+class Clock {
+public:
+    /** @brief InitializeClock を呼んでからの経過時間（ナノ秒） */
+    static uint64_t Now();
+    /** @brief 時刻源のカウンタ（TSC）の現在値 */
+    static uint64_t ReadCounter();
+    /** @brief カウンタの周波数（Hz） */
+    static uint64_t CounterFrequency() { return counter_freq_; }
+    /** @brief カウンタ値の差をナノ秒に変換する． */
+    static uint64_t CounterToNanoseconds(uint64_t counter_delta);
+    /** @brief Now() が ns 以上になる最初のカウンタ値を返す． */
+    static uint64_t CounterAt(uint64_t ns);
+
+private:
+    friend void InitializeClock();
+
+    static const int kShift = 32;
+
+    static uint64_t counter_freq_;
+    static uint64_t counter_base_;
+    /** @brief ナノ秒 = (カウンタ値の差 * mult_) >> kShift */
+    static uint64_t mult_;
+};
+
+/** @brief TSC の周波数を求めて Clock を使えるようにする．acpi::Initialize の後に呼ぶ． */
+void InitializeClock();
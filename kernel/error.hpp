@@ -28,6 +28,9 @@ class Error {
     kNoWaiter,
     kNoPCIMSI,
     kUnknownPixelFormat,
+    kTimerNotFound,
+    kNoSuchTask,
+    kNoFreeInterruptVector,
     kLastOfCode,  // この列挙子は常に最後に配置する
   };
 
@@ -55,6 +58,9 @@ class Error {
     "kNoWaiter",
     "kNoPCIMSI",
     "kUnknownPixelFormat",
+    "kTimerNotFound",
+    "kNoSuchTask",
+    "kNoFreeInterruptVector",
   };
   static_assert(Error::Code::kLastOfCode == code_names_.size());
 
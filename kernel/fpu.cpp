@@ -0,0 +1,113 @@
+#include "fpu.hpp"
+
+#include <cstring>
+
+#include "asmfunc.h"
+#include "logger.hpp"
+
+// asmfunc.asm の SwitchContext と IntHandlerDeviceNotAvailable が参照する
+extern "C" {
+  /** @brief レジスタ上の拡張状態を保存すべき領域．無ければ nullptr */
+  uint8_t* fpu_owner_area;
+  /** @brief 実行中のタスクの保存領域 */
+  uint8_t* fpu_current_area;
+  FPUSaveMode fpu_save_mode;
+  uint64_t fpu_restore_count;
+}
+
+namespace {
+  const uint64_t kCR0MonitorCoprocessor = 1u << 1;
+  const uint64_t kCR0Emulation = 1u << 2;
+  const uint64_t kCR4OSFXSR = 1u << 9;
+  const uint64_t kCR4OSXMMEXCPT = 1u << 10;
+  const uint64_t kCR4OSXSAVE = 1u << 18;
+
+  /** @brief XCR0 で有効にする状態．x87, SSE, AVX と AVX-512（opmask, ZMM_Hi256, Hi16_ZMM） */
+  const uint64_t kXCR0Wanted = 0b1110'0111;
+
+  /** @brief FXSAVE 形式の保存領域の大きさ */
+  const size_t kFXSaveAreaBytes = 512;
+
+  size_t area_frames;
+
+  bool HasXSave() {
+    uint32_t regs[4];
+    ReadCPUID(1, 0, regs);
+    return (regs[2] >> 26) & 1;
+  }
+
+  uint8_t* AreaOf(FrameID frame) {
+    return reinterpret_cast<uint8_t*>(frame.Frame());
+  }
+}
+
+size_t FPUAreaFrames() {
+  return area_frames;
+}
+
+WithError<FrameID> NewFPUArea() {
+  const auto frame = memory_manager->Allocate(area_frames);
+  if (frame.error) {
+    return frame;
+  }
+
+  // XSAVE ヘッダ（offset 512）が 0 なら，XRSTOR はすべての状態を初期値にする
+  auto area = AreaOf(frame.value);
+  memset(area, 0, area_frames * kBytesPerFrame);
+  *reinterpret_cast<uint16_t*>(&area[0]) = 0x037f; // FCW: x87 の例外をすべてマスク
+  *reinterpret_cast<uint32_t*>(&area[24]) = 0x1f80; // MXCSR: SSE の例外をすべてマスク
+  return frame;
+}
+
+void FreeFPUArea(FrameID frame) {
+  if (fpu_owner_area == AreaOf(frame)) {
+    fpu_owner_area = nullptr;
+  }
+  memory_manager->Free(frame, area_frames);
+}
+
+void SetFPUOwner(FrameID area) {
+  fpu_owner_area = AreaOf(area);
+  fpu_current_area = AreaOf(area);
+}
+
+uint64_t FPURestoreCount() {
+  return fpu_restore_count;
+}
+
+void EnableFPUFeatures() {
+  SetCR0((GetCR0() & ~kCR0Emulation) | kCR0MonitorCoprocessor);
+
+  auto cr4 = GetCR4() | kCR4OSFXSR | kCR4OSXMMEXCPT;
+  if (!HasXSave()) {
+    SetCR4(cr4);
+    return;
+  }
+  SetCR4(cr4 | kCR4OSXSAVE);
+
+  uint32_t regs[4];
+  ReadCPUID(0xd, 0, regs);
+  SetXCR0(regs[0] & kXCR0Wanted);
+}
+
+void InitializeFPU() {
+  EnableFPUFeatures();
+
+  size_t area_bytes = kFXSaveAreaBytes;
+  uint64_t xcr0 = 0;
+  fpu_save_mode = FPUSaveMode::kFXSave;
+  if (HasXSave()) {
+    uint32_t regs[4];
+    ReadCPUID(0xd, 0, regs);
+    xcr0 = regs[0] & kXCR0Wanted;
+    area_bytes = regs[1]; // 今の XCR0 で必要な大きさ
+
+    ReadCPUID(0xd, 1, regs);
+    fpu_save_mode = (regs[0] & 1) ? FPUSaveMode::kXSaveOpt : FPUSaveMode::kXSave;
+  }
+  area_frames = (area_bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+
+  const char* mode_names[] = {"FXSAVE", "XSAVE", "XSAVEOPT"};
+  Log(kInfo, "FPU: lazy %s, XCR0 %#lx, %lu bytes/task\n",
+      mode_names[static_cast<int>(fpu_save_mode)], xcr0, area_bytes);
+}
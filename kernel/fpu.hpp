@@ -0,0 +1,50 @@
+/**
+ * @file fpu.hpp
+ *
+ * x87/SSE/AVX の拡張状態をタスクごとに保存・復帰するプログラムを集めたファイル．
+ *
+ * 拡張状態の保存と復帰は遅延させる．SwitchContext は切り替え先のタスクが
+ * レジスタ上の拡張状態の持ち主でなければ CR0.TS を立てるだけで，
+ * そのタスクが最初に拡張命令を使ったときの #NM 例外で，持ち主の状態を
+ * 保存してから自分の状態を復帰する．拡張命令を使わないタスクは
+ * 切り替えのたびに保存領域を読み書きせずに済む．
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+#include "memory_manager.hpp"
+
+/** @brief 拡張状態の保存に使う命令 */
+enum class FPUSaveMode : uint8_t {
+  kFXSave = 0,
+  kXSave = 1,
+  kXSaveOpt = 2,
+};
+
+/** @brief タスク 1 つ分の保存領域に必要なフレーム数 */
+size_t FPUAreaFrames();
+
+/** @brief 保存領域を確保し，x87 と SSE の初期状態を書き込む． */
+WithError<FrameID> NewFPUArea();
+
+/** @brief 保存領域を解放する．レジスタ上の状態の持ち主であれば持ち主を無くす． */
+void FreeFPUArea(FrameID frame);
+
+/** @brief レジスタ上の拡張状態が area に保存されるべきものだと記録する．
+ *
+ * InitializeFPU の後，最初に動いているタスク（メインタスク）の領域を登録するのに使う．
+ */
+void SetFPUOwner(FrameID area);
+
+/** @brief #NM で拡張状態を復帰した回数 */
+uint64_t FPURestoreCount();
+
+/** @brief 実行中のコアで XSAVE と使える拡張状態を有効にする．AP の起動時にも呼ぶ． */
+void EnableFPUFeatures();
+
+/** @brief 保存に使う命令と保存領域の大きさを決める．InitializeTask の前に呼ぶ． */
+void InitializeFPU();
@@ -0,0 +1,130 @@
+#include "idle.hpp"
+
+#include <array>
+#include <atomic>
+
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "smp.hpp"
+
+namespace {
+  enum IdleState : uint32_t {
+    kAwake,
+    kHalted,
+    kMWaiting,
+  };
+
+  /** @brief コアごとの起床ライン．MONITOR の単位より大きくなるよう，キャッシュライン 1 本を占める． */
+  struct alignas(64) IdleLine {
+    std::atomic<uint32_t> state{kAwake};
+    /** @brief 起こす側が書き換える．値そのものに意味は無い */
+    std::atomic<uint32_t> wakeup{0};
+  };
+
+  std::array<IdleLine, kMaxCPUs> idle_lines;
+  /** @brief 眠っている（眠ろうとしている）コアの数．0 なら WakeIdleCPUs は何もしない */
+  std::atomic<int> num_idle{0};
+
+  bool has_mwait;
+  IdleMode idle_mode{IdleMode::kHalt};
+  /** @brief MWAIT の EAX に渡すヒント．bit 7:4 が目標の C-state - 1，bit 3:0 が sub C-state */
+  uint32_t mwait_hint;
+
+  /** @brief CPUID leaf 5 の EDX から，使える最も深い C-state のヒントを求める．
+   *
+   * Local APIC タイマが深い C-state でも止まらない（ARAT）と報告されなければ，
+   * タイマ割り込みを取りこぼさないよう C1 に留める．
+   */
+  uint32_t DeepestMWaitHint() {
+    uint32_t regs[4];
+    ReadCPUID(6, 0, regs);
+    const bool arat = (regs[0] >> 2) & 1;
+
+    ReadCPUID(5, 0, regs);
+    const uint32_t substates = regs[3];
+    const int max_cstate = arat ? 7 : 1;
+    for (int c = max_cstate; c >= 1; --c) {
+      if ((substates >> (4 * c)) & 0xf) {
+        return (c - 1) << 4;
+      }
+    }
+    return 0;
+  }
+}
+
+void IdleWait(int cpu_index, IdleCheckFunc* has_work) {
+  auto& line = idle_lines[cpu_index];
+  const bool mwait = idle_mode == IdleMode::kMWait;
+
+  __asm__("cli");
+  num_idle.fetch_add(1, std::memory_order_seq_cst);
+  line.state.store(mwait ? kMWaiting : kHalted, std::memory_order_seq_cst);
+  if (mwait) {
+    __asm__ volatile("monitor" :: "a"(&line.wakeup), "c"(0), "d"(0));
+  }
+
+  // WakeIdleCPUs が state を読む前に仕事を公開するのと対になる
+  if (has_work == nullptr || !has_work(cpu_index)) {
+    // sti の直後の 1 命令は割り込みが入らないので，起こす IPI を取りこぼさない
+    if (mwait) {
+      __asm__ volatile("sti\n\tmwait" :: "a"(mwait_hint), "c"(0));
+    } else {
+      __asm__ volatile("sti\n\thlt");
+    }
+  }
+
+  line.state.store(kAwake, std::memory_order_relaxed);
+  num_idle.fetch_sub(1, std::memory_order_relaxed);
+  __asm__("sti");
+}
+
+void WakeIdleCPUs() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (num_idle.load(std::memory_order_relaxed) == 0) {
+    return;
+  }
+
+  const auto self = CurrentCPUIndex();
+  for (int i = 0; i < num_cpus; ++i) {
+    if (i == self) {
+      continue;
+    }
+    switch (idle_lines[i].state.load(std::memory_order_relaxed)) {
+      case kMWaiting:
+        idle_lines[i].wakeup.fetch_add(1, std::memory_order_relaxed);
+        break;
+      case kHalted:
+        SendIPIToCPU(i, InterruptVector::kJobWakeup);
+        break;
+    }
+  }
+}
+
+bool IsCPUIdle(int cpu_index) {
+  return idle_lines[cpu_index].state.load(std::memory_order_relaxed) != kAwake;
+}
+
+IdleMode CurrentIdleMode() {
+  return idle_mode;
+}
+
+void SetIdleMode(IdleMode mode) {
+  idle_mode = has_mwait ? mode : IdleMode::kHalt;
+}
+
+void InitializeIdle() {
+  uint32_t regs[4];
+  ReadCPUID(0, 0, regs);
+  const uint32_t max_leaf = regs[0];
+  ReadCPUID(1, 0, regs);
+  has_mwait = max_leaf >= 6 && ((regs[2] >> 3) & 1);
+
+  if (!has_mwait) {
+    Log(kInfo, "Idle: hlt (MONITOR/MWAIT not supported)\n");
+    return;
+  }
+  mwait_hint = DeepestMWaitHint();
+  idle_mode = IdleMode::kMWait;
+  Log(kInfo, "Idle: MWAIT, C%u hint %#x\n", (mwait_hint >> 4) + 1, mwait_hint);
+}
@@ -0,0 +1,49 @@
+/**
+ * @file idle.hpp
+ *
+ * 仕事の無いコアを眠らせ，仕事ができたら起こすプログラムを集めたファイル．
+ *
+ * MONITOR/MWAIT が使えれば，コアは自分専用のキャッシュライン（起床ライン）を
+ * 監視しながら MWAIT で眠る．起こす側はそのラインに書き込むだけでよく，IPI は要らない．
+ * 使えなければ hlt で眠り，起こす側はそのコアにだけ IPI を送る．
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/** @brief コアを眠らせる方法 */
+enum class IdleMode {
+  kHalt,
+  kMWait,
+};
+
+/** @brief 眠る直前に仕事が無いかを確かめる関数．cpu_index は眠ろうとしているコア */
+using IdleCheckFunc = bool (int cpu_index);
+
+/** @brief 実行中のコアを，起こされるか割り込みが来るまで眠らせる．
+ *
+ * 起床ラインを監視し始めてから has_work で最後の確認をするので，
+ * 確認の後に WakeIdleCPUs されても取りこぼさない．has_work が true を返せば眠らずに戻る．
+ * has_work が nullptr なら割り込みだけを待つ．
+ * 戻ったときは割り込みが許可されている．
+ */
+void IdleWait(int cpu_index, IdleCheckFunc* has_work);
+
+/** @brief 眠っているコアをすべて起こす．
+ *
+ * 仕事を公開した（deque に積んだ）後に呼ぶ．眠っているコアが無ければ何もしない．
+ */
+void WakeIdleCPUs();
+
+/** @brief cpu_index のコアが IdleWait で眠っていれば true */
+bool IsCPUIdle(int cpu_index);
+
+/** @brief 現在の眠り方を返す． */
+IdleMode CurrentIdleMode();
+
+/** @brief 眠り方を変える．MWAIT が使えない CPU で kMWait を指定しても kHalt のまま． */
+void SetIdleMode(IdleMode mode);
+
+/** @brief MONITOR/MWAIT の有無を調べ，MWAIT に渡す C-state のヒントを決める． */
+void InitializeIdle();
@@ -0,0 +1,58 @@
+#include "input.hpp"
+
+namespace {
+  std::array<SPSCRing<InputEvent, kInputRingSize>, kMaxInputDevices> input_rings;
+  /** @brief 登録済みの番号なら true */
+  std::array<std::atomic<bool>, kMaxInputDevices> input_device_registered{};
+  std::atomic<uint64_t> dropped_input_events{0};
+}
+
+WithError<int> RegisterInputDevice() {
+  for (int device = 0; device < kMaxInputDevices; ++device) {
+    bool registered = false;
+    if (input_device_registered[device].compare_exchange_strong(
+          registered, true, std::memory_order_acquire, std::memory_order_relaxed)) {
+      return {device, MAKE_ERROR(Error::kSuccess)};
+    }
+  }
+  return {-1, MAKE_ERROR(Error::kFull)};
+}
+
+Error UnregisterInputDevice(int device) {
+  if (device < 0 || device >= kMaxInputDevices) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  // 外したドライバが書いたイベントを，次に登録したドライバより先に読み手へ見せる
+  if (!input_device_registered[device].exchange(false, std::memory_order_release)) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error PublishInputEvent(int device, InputEvent event) {
+  if (device < 0 || device >= kMaxInputDevices ||
+      !input_device_registered[device].load(std::memory_order_relaxed)) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  event.device = device;
+
+  if (!input_rings[device].Push(event)) {
+    dropped_input_events.fetch_add(1, std::memory_order_relaxed);
+    return MAKE_ERROR(Error::kFull);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+size_t PollInputEvents(InputEvent* events, size_t max) {
+  // 外れたデバイスのリングに残ったイベントも読み出すため，登録の有無によらず全部見る
+  size_t n = 0;
+  for (int device = 0; device < kMaxInputDevices && n < max; ++device) {
+    n += input_rings[device].PopBatch(events + n, max - n);
+  }
+  return n;
+}
+
+uint64_t DroppedInputEvents() {
+  return dropped_input_events.load(std::memory_order_relaxed);
+}
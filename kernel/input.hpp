@@ -0,0 +1,124 @@
+/**
+ * @file input.hpp
+ *
+ * 入力デバイスのドライバから利用者（マウスカーソル，テキストボックスなど）へ
+ * 入力イベントを届ける仕組み．
+ *
+ * ドライバは入力デバイスごとのリングに固定長の InputEvent を書き，利用者は
+ * PollInputEvents でまとめて読み出す．ドライバは利用者を知らないので，
+ * イベントの経路にはヒープに確保した呼び出し先も間接呼び出しも無い．
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "error.hpp"
+
+/** @brief 1 つの入力イベント．デバイスの種類によらず同じ大きさ． */
+struct InputEvent {
+  enum Type : uint8_t {
+    kMouseMove,
+    kKeyPush,
+  } type;
+  /** @brief 発生元のデバイス．RegisterInputDevice が返した番号．
+   *
+   * 番号は再利用されるので，外れたデバイスの番号を後から別のデバイスが使うことがある．
+   */
+  uint8_t device;
+
+  union {
+    /** @brief 移動量はレポートの値そのまま */
+    struct {
+      uint8_t buttons;
+      int32_t displacement_x, displacement_y, wheel;
+    } mouse;
+
+    struct {
+      uint8_t modifier;
+      uint8_t keycode;
+    } keyboard;
+  } arg;
+
+  /** @brief 入力が起きた時刻（Clock::ReadCounter の値）．書き手のドライバが埋める */
+  uint64_t timestamp;
+};
+
+/** @brief 書き手と読み手が 1 つずつのロックフリーなリングバッファ．
+ *
+ * Push は書き手だけが，PopBatch は読み手だけが呼べる．
+ * 容量は固定で，一杯なら Push は false を返す．
+ *
+ * @tparam T  要素の型．コピーできる型．
+ * @tparam N  容量．2 のべき乗．
+ */
+template <typename T, size_t N>
+class SPSCRing {
+  static_assert((N & (N - 1)) == 0, "N must be a power of 2");
+
+ public:
+  bool Push(const T& value) {
+    const auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) >= N) {
+      return false;
+    }
+    buffer_[tail & (N - 1)] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /** @brief 古いものから最大 max 個を values に取り出し，取り出した数を返す． */
+  size_t PopBatch(T* values, size_t max) {
+    const auto head = head_.load(std::memory_order_relaxed);
+    const auto available = tail_.load(std::memory_order_acquire) - head;
+    const size_t n = available < max ? available : max;
+    for (size_t i = 0; i < n; ++i) {
+      values[i] = buffer_[(head + i) & (N - 1)];
+    }
+    head_.store(head + n, std::memory_order_release);
+    return n;
+  }
+
+ private:
+  // head_ と tail_ は別々のコアが書き換えることがあるので，キャッシュラインを分ける
+  alignas(64) std::atomic<uint64_t> head_{0};
+  alignas(64) std::atomic<uint64_t> tail_{0};
+  std::array<T, N> buffer_{};
+};
+
+/** @brief 登録できる入力デバイスの数 */
+const int kMaxInputDevices = 8;
+/** @brief 入力デバイス 1 つあたりに溜められるイベントの数 */
+const size_t kInputRingSize = 64;
+
+/** @brief 入力デバイスを登録し，イベントを書くための番号を返す．
+ *
+ * デバイスの設定時に 1 度だけ呼ぶ．UnregisterInputDevice で返された番号を再び使う．
+ * 空きが無ければ kFull．
+ */
+WithError<int> RegisterInputDevice();
+
+/** @brief RegisterInputDevice で得た番号を返す．
+ *
+ * ドライバを破棄するときに呼ぶ．これ以降その番号に PublishInputEvent はできない．
+ * リングに残ったイベントは PollInputEvents で読み出される．
+ */
+Error UnregisterInputDevice(int device);
+
+/** @brief device 番のデバイスのリングに event を書く．
+ *
+ * device はここで埋める．1 つのデバイスのリングに書くのは 1 つの
+ * ドライバだけなので，ロックは取らない．リングが一杯ならイベントを捨てて kFull を返す．
+ */
+Error PublishInputEvent(int device, InputEvent event);
+
+/** @brief 全デバイスのリングから最大 max 個のイベントを events に取り出し，その数を返す．
+ *
+ * 同じデバイスのイベントは起きた順に並ぶ．読み手は 1 つだけ（メインタスク）．
+ */
+size_t PollInputEvents(InputEvent* events, size_t max);
+
+/** @brief リングが一杯で捨てたイベントの数 */
+uint64_t DroppedInputEvents();
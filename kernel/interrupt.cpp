@@ -6,11 +6,21 @@
 
 #include "interrupt.hpp"
 
+#include <atomic>
+#include <bitset>
+
 #include "asmfunc.h"
 #include "segment.hpp"
+#include "smp.hpp"
+#include "task.hpp"
 
 std::array<InterruptDescriptor, 256> idt;
 
+namespace {
+  /** @brief AllocateInterruptVectors で割り当て済みのベクタ */
+  std::bitset<256> allocated_vectors;
+}
+
 void SetIDTEntry(InterruptDescriptor& desc,
                  InterruptDescriptorAttribute attr,
                  uint64_t offset,
@@ -28,26 +38,107 @@ void NotifyEndOfInterrupt() {
 }
 
 namespace {
-    std::deque<Message>* msg_queue;
+    std::array<std::atomic<uint64_t>, InterruptVector::kNumXHCIVectors> xhci_interrupt_counts{};
 
-    __attribute__((interrupt))
-    void IntHandlerXHCI(InterruptFrame* frame){
-        msg_queue->push_back(Message{Message::kInterruptXHCI});
+    void NotifyXHCIInterrupt(int interrupter){
+        xhci_interrupt_counts[interrupter].fetch_add(1, std::memory_order_relaxed);
+        Message msg{Message::kInterruptXHCI};
+        msg.arg.xhci.interrupter = interrupter;
+        task_manager->SendMessage(1, msg);
         NotifyEndOfInterrupt();
+        task_manager->PreemptIfNeeded();
     }
 
+    /** @brief xHCI のインタラプタごとの割り込み．どのイベントリングかをメインタスクへ伝える． */
+    __attribute__((interrupt))
+    void IntHandlerXHCI0(InterruptFrame* frame){
+        NotifyXHCIInterrupt(0);
+    }
+
+    __attribute__((interrupt))
+    void IntHandlerXHCI1(InterruptFrame* frame){
+        NotifyXHCIInterrupt(1);
+    }
+
+    __attribute__((interrupt))
+    void IntHandlerXHCI2(InterruptFrame* frame){
+        NotifyXHCIInterrupt(2);
+    }
+
+    __attribute__((interrupt))
+    void IntHandlerXHCI3(InterruptFrame* frame){
+        NotifyXHCIInterrupt(3);
+    }
+
+    const decltype(IntHandlerXHCI0)* xhci_handlers[InterruptVector::kNumXHCIVectors] = {
+        IntHandlerXHCI0, IntHandlerXHCI1, IntHandlerXHCI2, IntHandlerXHCI3,
+    };
+
     __attribute__((interrupt))
     void IntHandlerLAPICTimer(InterruptFrame* frame){
         LAPICTimerOnInterrupt();
+    }
+
+    /** @brief hlt で眠っているコアを起こすだけの割り込み．起きたコアが仕事を探す． */
+    __attribute__((interrupt))
+    void IntHandlerJobWakeup(InterruptFrame* frame){
         NotifyEndOfInterrupt();
     }
 }
 
-void InitializeInterrupt(std::deque<Message>* msg_queue){
-    ::msg_queue = msg_queue;
-    SetIDTEntry(idt[InterruptVector::kXHCI], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
-                reinterpret_cast<uint64_t>(IntHandlerXHCI), kKernelCS);
+WithError<uint8_t> AllocateInterruptVectors(unsigned int count){
+    unsigned int align = 1;
+    while (align < count) {
+        align <<= 1;
+    }
+    if (count == 0 || align > InterruptVector::kDynamicEnd - InterruptVector::kDynamicBegin) {
+        return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+
+    for (unsigned int first = InterruptVector::kDynamicBegin;
+         first + count <= InterruptVector::kDynamicEnd; first += align) {
+        bool free = true;
+        for (unsigned int v = first; v < first + count; ++v) {
+            free &= !allocated_vectors[v];
+        }
+        if (free) {
+            for (unsigned int v = first; v < first + count; ++v) {
+                allocated_vectors[v] = true;
+            }
+            return {static_cast<uint8_t>(first), MAKE_ERROR(Error::kSuccess)};
+        }
+    }
+    return {0, MAKE_ERROR(Error::kNoFreeInterruptVector)};
+}
+
+void FreeInterruptVectors(uint8_t first, unsigned int count){
+    for (unsigned int v = first; v < first + count && v < allocated_vectors.size(); ++v) {
+        allocated_vectors[v] = false;
+    }
+}
+
+void SetInterruptHandler(uint8_t vector, uint64_t handler){
+    const auto attr = MakeIDTAttr(DescriptorType::kInterruptGate, 0);
+    SetIDTEntry(idt[vector], attr, handler, kKernelCS);
+    for (int i = 1; i < num_cpus; ++i) {
+        SetIDTEntry(cpus[i]->idt[vector], attr, handler, kKernelCS);
+    }
+}
+
+uint64_t XHCIInterruptHandler(int interrupter){
+    return reinterpret_cast<uint64_t>(xhci_handlers[interrupter]);
+}
+
+uint64_t XHCIInterruptCount(int interrupter){
+    return xhci_interrupt_counts[interrupter].load(std::memory_order_relaxed);
+}
+
+void InitializeInterrupt(){
+    SetIDTEntry(idt[InterruptVector::kDeviceNotAvailable], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                reinterpret_cast<uint64_t>(IntHandlerDeviceNotAvailable), kKernelCS);
     SetIDTEntry(idt[InterruptVector::kLAPICTimer], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
                 reinterpret_cast<uint64_t>(IntHandlerLAPICTimer), kKernelCS);
+    SetIDTEntry(idt[InterruptVector::kJobWakeup], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                reinterpret_cast<uint64_t>(IntHandlerJobWakeup), kKernelCS);
     LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
 }
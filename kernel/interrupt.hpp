@@ -10,6 +10,7 @@
 #include <cstdint>
 #include <deque>
 
+#include "error.hpp"
 #include "x86_descriptor.hpp"
 #include "message.hpp"
 #include "timer.hpp"
@@ -58,9 +59,16 @@ void SetIDTEntry(InterruptDescriptor& desc,
 class InterruptVector {
  public:
   enum Number {
-    kXHCI = 0x40,
+    kDeviceNotAvailable = 0x07,
     kLAPICTimer = 0x41,
+    kJobWakeup = 0x42,
   };
+
+  /** @brief デバイスの割り込みに AllocateInterruptVectors で割り当てる範囲 [kDynamicBegin, kDynamicEnd) */
+  static const int kDynamicBegin = 0x50;
+  static const int kDynamicEnd = 0xf0;
+  /** @brief xHCI のインタラプタ用に用意しているハンドラの数 */
+  static const int kNumXHCIVectors = 4;
 };
 
 struct InterruptFrame {
@@ -73,4 +81,29 @@ struct InterruptFrame {
 
 void NotifyEndOfInterrupt();
 
-void InitializeInterrupt(std::deque<Message>* msg_queue);
+/** @brief 空いている連続した count 個のベクタを割り当て，先頭のベクタを返す．
+ *
+ * MSI の複数メッセージはベクタの下位ビットをメッセージ番号で置き換えるので，
+ * 先頭は count 以上の 2 のべき乗の倍数に揃える．
+ * 割り当て表はロックで守っていないので，BSP の初期化処理から呼ぶ．
+ */
+WithError<uint8_t> AllocateInterruptVectors(unsigned int count);
+
+/** @brief AllocateInterruptVectors で割り当てたベクタを返却する． */
+void FreeInterruptVectors(uint8_t first, unsigned int count);
+
+/** @brief vector の割り込みゲートを handler に向ける．
+ *
+ * 起動済みの AP は IDT の複製を持っているので，それらにも同じ値を書き込む．
+ */
+void SetInterruptHandler(uint8_t vector, uint64_t handler);
+
+/** @brief xHCI のインタラプタ interrupter 番を受け持つ割り込みハンドラのアドレスを返す． */
+uint64_t XHCIInterruptHandler(int interrupter);
+/** @brief xHCI のインタラプタ interrupter 番の割り込みハンドラが呼ばれた回数．
+ *
+ * ProcessEvents を直接呼ぶポーリングやビジーループは数えない．
+ */
+uint64_t XHCIInterruptCount(int interrupter);
+
+void InitializeInterrupt();
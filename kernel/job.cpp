@@ -0,0 +1,129 @@
+#include "job.hpp"
+
+#include <algorithm>
+
+#include "idle.hpp"
+#include "smp.hpp"
+
+namespace {
+  using JobDeque = WorkStealingDeque<Job*, 1024>;
+
+  std::array<JobDeque*, kMaxCPUs> deques;
+  std::atomic<int> job_cpus{kMaxCPUs};
+  /** @brief DedicateCPU で各コアに渡されたジョブ */
+  std::array<std::atomic<Job*>, kMaxCPUs> dedicated_jobs{};
+
+  /** @brief 割り込みを禁止し，禁止する前の RFLAGS を返す． */
+  uint64_t DisableInterrupts() {
+    uint64_t rflags;
+    __asm__ volatile("pushfq\n\tpop %0\n\tcli" : "=r"(rflags) :: "memory");
+    return rflags;
+  }
+
+  void RestoreInterrupts(uint64_t rflags) {
+    if (rflags & 0x200) {
+      __asm__ volatile("sti" ::: "memory");
+    }
+  }
+
+  int NumJobCPUs() {
+    return std::min(num_cpus, job_cpus.load(std::memory_order_relaxed));
+  }
+
+  void RunJob(Job* job) {
+    auto group = job->group;
+    job->func(job->arg);
+    group->pending.fetch_sub(1, std::memory_order_release);
+  }
+
+  /** @brief 自分の deque から取り出し，空なら他のコアから盗む． */
+  bool FindJob(int cpu_index, Job*& job) {
+    // BSP では複数のタスクが同じ deque の持ち主になるので，切り替えを止めて取り出す
+    const auto rflags = DisableInterrupts();
+    const bool popped = deques[cpu_index]->Pop(job);
+    RestoreInterrupts(rflags);
+    if (popped) {
+      return true;
+    }
+
+    const int n = NumJobCPUs();
+    for (int i = 1; i < n; ++i) {
+      if (deques[(cpu_index + i) % n]->Steal(job)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool HasJobs() {
+    const int n = NumJobCPUs();
+    for (int i = 0; i < n; ++i) {
+      if (!deques[i]->Empty()) {
+        return true;
+      }
+    }
+    return false;
+  }
+}
+
+void SubmitJob(Job& job) {
+  job.group->pending.fetch_add(1, std::memory_order_relaxed);
+
+  const auto rflags = DisableInterrupts();
+  const bool pushed = deques[CurrentCPUIndex()]->Push(&job);
+  if (pushed) {
+    WakeIdleCPUs();
+  }
+  RestoreInterrupts(rflags);
+
+  if (!pushed) {
+    RunJob(&job);
+  }
+}
+
+void WaitJobs(JobGroup& group) {
+  const int cpu_index = CurrentCPUIndex();
+  while (group.pending.load(std::memory_order_acquire) > 0) {
+    Job* job;
+    if (FindJob(cpu_index, job)) {
+      RunJob(job);
+    } else {
+      __builtin_ia32_pause();
+    }
+  }
+}
+
+void SetJobCPUs(int n) {
+  job_cpus.store(std::max(n, 1), std::memory_order_relaxed);
+}
+
+void DedicateCPU(int cpu_index, Job& job) {
+  dedicated_jobs[cpu_index].store(&job, std::memory_order_release);
+  WakeIdleCPUs();
+}
+
+void RunJobLoop(int cpu_index) {
+  while (true) {
+    if (auto job = dedicated_jobs[cpu_index].exchange(nullptr, std::memory_order_acquire)) {
+      job->func(job->arg);
+      continue;
+    }
+
+    Job* job;
+    if (cpu_index < NumJobCPUs() && FindJob(cpu_index, job)) {
+      RunJob(job);
+      continue;
+    }
+
+    IdleWait(cpu_index, [](int cpu_index) {
+      return dedicated_jobs[cpu_index].load(std::memory_order_relaxed) != nullptr ||
+        (cpu_index < NumJobCPUs() && HasJobs());
+    });
+  }
+}
+
+void InitializeJob() {
+  for (auto& deque : deques) {
+    deque = new JobDeque;
+  }
+}
@@ -0,0 +1,133 @@
+/**
+ * @file job.hpp
+ *
+ * 短い処理（ジョブ）を全コアに分散して実行する仕組みを集めたファイル．
+ *
+ * ジョブはコアごとの work-stealing deque に積まれる．積んだコアは自分の
+ * deque の末尾から取り出し，手の空いたコアは他のコアの deque の先頭から盗む．
+ * AP はジョブが無い間 IdleWait で眠り，ジョブが積まれると WakeIdleCPUs で起こされる．
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/** @brief Chase-Lev の work-stealing deque．
+ *
+ * Push と Pop は持ち主のコアだけが呼べ，Steal はどのコアからでも呼べる．
+ * 容量は固定で，一杯なら Push は false を返す．
+ *
+ * @tparam T  要素の型．ポインタなど，アトミックに読み書きできる型に限る．
+ * @tparam N  容量．2 のべき乗．
+ */
+template <typename T, size_t N>
+class WorkStealingDeque {
+  static_assert((N & (N - 1)) == 0, "N must be a power of 2");
+
+ public:
+  bool Push(T value) {
+    const auto b = bottom_.load(std::memory_order_relaxed);
+    const auto t = top_.load(std::memory_order_acquire);
+    if (b - t >= static_cast<int64_t>(N)) {
+      return false;
+    }
+    buffer_[b & (N - 1)].store(value, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /** @brief 末尾（最後に積んだもの）を取り出す．空なら false． */
+  bool Pop(T& value) {
+    const auto b = bottom_.load(std::memory_order_relaxed) - 1;
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto t = top_.load(std::memory_order_relaxed);
+
+    if (t > b) {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return false;
+    }
+
+    value = buffer_[b & (N - 1)].load(std::memory_order_relaxed);
+    if (t == b) {
+      // 最後の 1 つは Steal と取り合う
+      const bool won = top_.compare_exchange_strong(
+          t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  /** @brief 先頭（最も古いもの）を盗む．空か，他のコアと取り合って負けたら false． */
+  bool Steal(T& value) {
+    auto t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const auto b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) {
+      return false;
+    }
+
+    value = buffer_[t & (N - 1)].load(std::memory_order_relaxed);
+    return top_.compare_exchange_strong(
+        t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+  }
+
+  bool Empty() const {
+    return bottom_.load(std::memory_order_relaxed)
+      <= top_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  // top_ と bottom_ は別々のコアが書き換えるので，キャッシュラインを分ける
+  std::atomic<int64_t> top_{0};
+  char padding_[64 - sizeof(std::atomic<int64_t>)];
+  std::atomic<int64_t> bottom_{0};
+  std::array<std::atomic<T>, N> buffer_{};
+};
+
+struct JobGroup;
+
+using JobFunc = void (void* arg);
+
+/** @brief 1 つのジョブ．実体は投入した側が完了まで保持する． */
+struct Job {
+  JobFunc* func;
+  void* arg;
+  JobGroup* group;
+};
+
+/** @brief 完了を待ち合わせるジョブのまとまり． */
+struct JobGroup {
+  std::atomic<int> pending{0};
+};
+
+/** @brief ジョブを実行中のコアの deque に積み，眠っているコアを起こす．
+ *
+ * deque が一杯ならその場で実行する．
+ */
+void SubmitJob(Job& job);
+
+/** @brief group のジョブがすべて終わるまで待つ．待つ間は呼び出し元もジョブを実行する． */
+void WaitJobs(JobGroup& group);
+
+/** @brief ジョブを実行するコアを [0, n) 番に制限する．ベンチマークで使う． */
+void SetJobCPUs(int n);
+
+/** @brief AP の cpu_index 番のコアに func を専用に実行させる．
+ *
+ * func は戻らなくてよい．ポーリングのようにコアを占有し続ける処理に使う．
+ * そのコアは func が戻るまでジョブを実行しないが，deque は空なので他のコアの邪魔はしない．
+ * job は func が戻るまで呼び出し側が保持する．group は使わない．
+ */
+void DedicateCPU(int cpu_index, Job& job);
+
+/** @brief AP のアイドルループ．ジョブを実行し，無ければ盗み，それも無ければ眠る． */
+[[noreturn]] void RunJobLoop(int cpu_index);
+
+/** @brief 各コアの deque を用意する．InitializeSMP の前に呼ぶ． */
+void InitializeJob();
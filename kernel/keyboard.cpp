@@ -1,8 +1,5 @@
 #include "keyboard.hpp"
 
-#include <memory>
-#include "usb/classdriver/keyboard.hpp"
-
 namespace {
     const char keycode_map[256] = {
         0,    0,    0,    0,    'a',  'b',  'c',  'd', // 0
@@ -46,18 +43,7 @@ namespace {
     const int kRGUIBitMask     = 0b10000000u;
 }
 
-void InitializeKeyboard(std::deque<Message>& msg_queue){
-    usb::HIDKeyboardDriver::default_observer =
-        [&msg_queue](uint8_t modifier, uint8_t keycode) {
-            const bool shift = (modifier & (kLShiftBitMask | kRShiftBitMask)) != 0;
-            char ascii = keycode_map[keycode];
-            if (shift){
-                ascii = keycode_map_shifted[keycode];
-            }
-            Message msg{Message::kKeyPush};
-            msg.arg.keyboard.modifier = modifier;
-            msg.arg.keyboard.keycode = keycode;
-            msg.arg.keyboard.ascii = ascii;
-            msg_queue.push_back(msg);
-        };
+char KeycodeToAscii(uint8_t modifier, uint8_t keycode){
+    const bool shift = (modifier & (kLShiftBitMask | kRShiftBitMask)) != 0;
+    return shift ? keycode_map_shifted[keycode] : keycode_map[keycode];
 }
@@ -1,6 +1,6 @@
 #pragma once
 
-#include <deque>
-#include "message.hpp"
+#include <cstdint>
 
-void InitializeKeyboard(std::deque<Message>& msg_queue);
+/** @brief HID のキーコードを ASCII に変換する．対応する文字が無ければ 0 */
+char KeycodeToAscii(uint8_t modifier, uint8_t keycode);
@@ -2,7 +2,9 @@
 
 #include <algorithm>
 #include "console.hpp"
+#include "job.hpp"
 #include "logger.hpp"
+#include "smp.hpp"
 
 Layer::Layer(unsigned int id) : id_{id} {
 }
@@ -58,6 +60,10 @@ void LayerManager::SetWriter(FrameBuffer* screen) {
     FrameBufferConfig back_config = screen->Config();
     back_config.frame_buffer = nullptr;
     back_buffer_.Initialize(back_config);
+
+    const int columns = (back_config.horizontal_resolution + kTileWidth - 1) / kTileWidth;
+    const int rows = (back_config.vertical_resolution + kTileHeight - 1) / kTileHeight;
+    tiles_.resize(columns * rows);
 }
 
 Layer& LayerManager::NewLayer() {
@@ -67,29 +73,77 @@ Layer& LayerManager::NewLayer() {
 
 // #@@range_begin(layermgr_draw)
 void LayerManager::Draw(const Rectangle<int>& area) const {
-    for (auto layer : layer_stack_) {
-        layer->DrawTo(back_buffer_, area);
-    }
-    screen_->Copy(area.pos, back_buffer_, area);
+    DrawArea(area, 0);
 }
 
 void LayerManager::Draw(unsigned int id) const {
-    bool draw = false;
-    Rectangle<int> window_area;
-    for (auto layer : layer_stack_) {
+    for (size_t i = 0; i < layer_stack_.size(); ++i) {
+        auto layer = layer_stack_[i];
         if (layer->ID() == id) {
+            Rectangle<int> window_area;
             window_area.size = layer->GetWindow()->Size();
             window_area.pos = layer->GetPosition();
-            draw = true;
-        }
-        if (draw) {
-            layer->DrawTo(back_buffer_, window_area);
+            DrawArea(window_area, i);
+            return;
         }
     }
-    screen_->Copy(window_area.pos, back_buffer_, window_area);
 }
 // #@@range_end(layermgr_draw)
 
+void LayerManager::SetTiledDraw(bool tiled) {
+    tiled_draw_ = tiled;
+}
+
+bool LayerManager::IsTiledDraw() const {
+    return tiled_draw_;
+}
+
+void LayerManager::DrawTileJob(void* arg) {
+    auto tile = static_cast<const Tile*>(arg);
+    tile->manager->DrawAreaSerial(tile->area, tile->first_layer);
+}
+
+void LayerManager::DrawArea(const Rectangle<int>& area, size_t first_layer) const {
+    const auto& config = back_buffer_.Config();
+    const Rectangle<int> screen_area{
+        {0, 0},
+        {static_cast<int>(config.horizontal_resolution),
+         static_cast<int>(config.vertical_resolution)}};
+    const auto clipped = area & screen_area;
+    if (!tiled_draw_ || num_cpus == 1 ||
+        (clipped.size.x <= kTileWidth && clipped.size.y <= kTileHeight)) {
+        DrawAreaSerial(area, first_layer);
+        return;
+    }
+
+    const int columns = (clipped.size.x + kTileWidth - 1) / kTileWidth;
+    const int rows = (clipped.size.y + kTileHeight - 1) / kTileHeight;
+    const auto clipped_end = clipped.pos + clipped.size;
+
+    // 各タイルは自分の範囲の back_buffer_ と画面にしか書かないので，どの順で終わっても結果は同じ
+    JobGroup group;
+    for (int row = 0; row < rows; ++row) {
+        for (int column = 0; column < columns; ++column) {
+            auto& tile = tiles_[row * columns + column];
+            tile.manager = this;
+            tile.first_layer = first_layer;
+            tile.area.pos = clipped.pos + Vector2D<int>{column * kTileWidth, row * kTileHeight};
+            tile.area.size = ElementMin(tile.area.pos + Vector2D<int>{kTileWidth, kTileHeight},
+                                        clipped_end) - tile.area.pos;
+            tile.job = Job{DrawTileJob, &tile, &group};
+            SubmitJob(tile.job);
+        }
+    }
+    WaitJobs(group);
+}
+
+void LayerManager::DrawAreaSerial(const Rectangle<int>& area, size_t first_layer) const {
+    for (size_t i = first_layer; i < layer_stack_.size(); ++i) {
+        layer_stack_[i]->DrawTo(back_buffer_, area);
+    }
+    screen_->Copy(area.pos, back_buffer_, area);
+}
+
 // #@@range_begin(layermgr_move)
 void LayerManager::Move(unsigned int id, Vector2D<int> new_pos) {
     auto layer = FindLayer(id);
@@ -11,6 +11,7 @@
 #include <vector>
 
 #include "graphics.hpp"
+#include "job.hpp"
 #include "window.hpp"
 
 /** @brief Layer は 1 つの層を表す。
@@ -53,9 +54,21 @@ class Layer {
   bool draggable_{false};
 };
 
-/** @brief LayerManager は複数のレイヤーを管理する。 */
+/** @brief LayerManager は複数のレイヤーを管理する。
+ *
+ * 描画は back_buffer_ を共有するので，メインタスクからだけ行う。
+ * 他のタスクは kLayer メッセージで再描画を依頼する。
+ */
 class LayerManager {
  public:
+  /** @brief タイル分割して描画するときの 1 タイルの大きさ。
+   *
+   * 1 タイル分の back_buffer_ が 32 KiB となり，L1 データキャッシュに収まる。
+   * 画面への転送は行単位なので，横長にしておく。
+   */
+  static const int kTileWidth = 256;
+  static const int kTileHeight = 32;
+
   /** @brief Draw メソッドなどで描画する際の描画先を設定する。 */
   void SetWriter(FrameBuffer* screen);
   /** @brief 新しいレイヤーを生成して参照を返す。
@@ -69,6 +82,15 @@ class LayerManager {
   /** @brief 指定したレイヤーに設定されているウィンドウの描画領域内を再描画する。 */
   void Draw(unsigned int id) const;
 
+  /** @brief Draw をタイル分割して全コアで並列に行うかを設定する。
+   *
+   * 有効にできるのは InitializeJob の後。タイルは互いに重ならず，
+   * タイルごとにレイヤーを下から順に描くので，描画結果は逐次の場合と同じになる。
+   */
+  void SetTiledDraw(bool tiled);
+  /** @brief タイル分割して描画する設定になっているかを返す。 */
+  bool IsTiledDraw() const;
+
   /** @brief レイヤーの位置情報を指定された絶対座標へと更新する。再描画する。 */
   void Move(unsigned int id, Vector2D<int> new_pos);
   /** @brief レイヤーの位置情報を指定された相対座標へと更新する。再描画する。 */
@@ -91,8 +113,23 @@ class LayerManager {
   std::vector<std::unique_ptr<Layer>> layers_{};
   std::vector<Layer*> layer_stack_{};
   unsigned int latest_id_{0};
+  bool tiled_draw_{false};
+
+  struct Tile {
+    Job job;
+    const LayerManager* manager;
+    Rectangle<int> area;
+    size_t first_layer;
+  };
+  /** @brief タイル分割の作業領域。画面全体のタイル数の分を SetWriter で確保しておく。 */
+  mutable std::vector<Tile> tiles_{};
+  static void DrawTileJob(void* arg);
 
   Layer* FindLayer(unsigned int id);
+  /** @brief layer_stack_ の first_layer 番目以降のレイヤーで area を描画する。 */
+  void DrawArea(const Rectangle<int>& area, size_t first_layer) const;
+  /** @brief DrawArea を 1 つのコアで行う。 */
+  void DrawAreaSerial(const Rectangle<int>& area, size_t first_layer) const;
 };
 
 extern LayerManager* layer_manager;
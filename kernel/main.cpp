@@ -8,6 +8,7 @@
 #include <cstddef>
 #include <cstdio>
 
+#include <array>
 #include <numeric>
 #include <vector>
 #include <deque>
@@ -23,6 +24,8 @@
 #include "logger.hpp"
 
 #include "usb/xhci/xhci.hpp"
+#include "usb/classdriver/hub.hpp"
+#include "usb/classdriver/msc.hpp"
 #include "interrupt.hpp"
 #include "asmfunc.h"
 #include "segment.hpp"
@@ -33,7 +36,15 @@
 #include "message.hpp"
 #include "timer.hpp"
 #include "acpi.hpp"
+#include "clock.hpp"
 #include "keyboard.hpp"
+#include "input.hpp"
+#include "benchmark.hpp"
+#include "fpu.hpp"
+#include "task.hpp"
+#include "smp.hpp"
+#include "job.hpp"
+#include "idle.hpp"
 
 
 int printk(const char* format, ...) {
@@ -49,6 +60,11 @@ int printk(const char* format, ...) {
   return result;
 }
 
+#ifdef ENABLE_BENCHMARK
+/** @brief 準備のできたマスストレージ．メインループがベンチマークを実行したら nullptr に戻す */
+usb::MassStorageDriver* storage_to_benchmark;
+#endif
+
 std::shared_ptr<Window> main_window;
 unsigned int main_window_layer_id;
 void InitializeMainWindow(){
@@ -117,6 +133,30 @@ void InputTextWindow(char c){
     layer_manager->Draw(text_window_layer_id);
 }
 
+/** @brief 溜まった入力イベントをまとめて読み，マウスカーソルとテキストボックスに渡す */
+void ProcessInputEvents(){
+    std::array<InputEvent, 16> events;
+    while (const auto n = PollInputEvents(events.data(), events.size())){
+        for (size_t i = 0; i < n; ++i){
+            const auto& event = events[i];
+            switch (event.type){
+            case InputEvent::kMouseMove:
+#ifdef ENABLE_BENCHMARK
+                RecordInputLatency(event.timestamp);
+#endif
+                mouse->OnInterrupt(event.arg.mouse.buttons,
+                                   event.arg.mouse.displacement_x,
+                                   event.arg.mouse.displacement_y);
+                break;
+            case InputEvent::kKeyPush:
+                InputTextWindow(KeycodeToAscii(event.arg.keyboard.modifier,
+                                               event.arg.keyboard.keycode));
+                break;
+            }
+        }
+    }
+}
+
 // #@@range_begin(taskb_window)
 std::shared_ptr<Window> task_b_window;
 unsigned int task_b_window_layer_id;
@@ -125,7 +165,7 @@ void InitializeTaskBWindow(){
         160, 52, screen_config.pixel_format);
     DrawWindow(*task_b_window->Writer(), "TaskB Window");
 
-    task_b_widow_layer_id = layer_manager->NewLayer()
+    task_b_window_layer_id = layer_manager->NewLayer()
         .SetWindow(task_b_window)
         .SetDraggable(true)
         .Move({100, 100})
@@ -135,20 +175,10 @@ void InitializeTaskBWindow(){
 }
 // #@@range_end(taskb_window)
 
-// #@@range_begin(task_context)
-struct TaskContext {
-    uint64_t cr3, rip, rflags, reserved1; //offset 0x00
-    uint64_t cs, ss, fs, gs; //offset 0x20
-    uint64_t rax, rbx, rcx, rdx, rdi, rsi, rsp, rbp; //offset 0x40
-    uint64_t r8, r9, r10, r11, r12, r13, r14, r15; //offset 0xc0
-} __attribute__((packed));
-
-alignas(16) TaskContext taqsk_b_ctx, task_a_ctx;
-// #@@range_end(task_context)
-
 // #@@range_begin(taskb_func)
-void TaskB(int task_id, int data){
-    printk("TaskB: task_id=%d, data=%d\n", task_id, data);
+void TaskB(uint64_t task_id, int64_t data){
+    printk("TaskB: task_id=%lu, data=%lx\n", task_id, data);
+    Task& task = task_manager->CurrentTask();
     char str[128];
     int count = 0;
     while (true){
@@ -156,16 +186,33 @@ void TaskB(int task_id, int data){
         sprintf(str, "%010d", count);
         FillRectangle(*task_b_window->Writer(), {24, 28}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
         WriteString(*task_b_window->Writer(), {24, 28}, str, {0, 0, 0});
-        layer_manager->Draw(task_b_widow_layer_id);
 
-        SwitchContext(&task_a_ctx, &task_b_ctx);
+        // back_buffer_ は AP も描くので，描画はメインタスクに任せて終わるまで待つ
+        Message msg{Message::kLayer};
+        msg.arg.layer.layer_id = task_b_window_layer_id;
+        msg.arg.layer.src_task = task_id;
+        __asm__("cli");
+        task_manager->SendMessage(1, msg);
+        __asm__("sti");
+
+        while (true){
+            __asm__("cli");
+            auto reply = task.ReceiveMessage();
+            if (!reply){
+                task.Sleep();
+                __asm__("sti");
+                continue;
+            }
+            __asm__("sti");
+            if (reply->type == Message::kLayerFinish){
+                break;
+            }
+        }
     }
 }
 // #@@range_end(taskb_func)
 
 
-std::deque<Message>* main_queue;
-
 alignas(16) uint8_t kernel_main_stack[1024 * 1024];
 
 extern "C" void KernelMainNewStack(
@@ -173,6 +220,10 @@ extern "C" void KernelMainNewStack(
     const MemoryMap& memory_map_ref,
     const acpi::RSDP& acpi_table) {
 
+#ifdef ENABLE_BENCHMARK
+  MarkBootStart();
+#endif
+
   MemoryMap memory_map{memory_map_ref};
 
   InitializeGraphics(frame_buffer_config_ref);
@@ -184,31 +235,63 @@ extern "C" void KernelMainNewStack(
   InitializeSegmentation();
   InitializePaging();
   InitializeMemoryManager(memory_map);
-  ::main_queue = new std::deque<Message>(32);
-  InitializeInterrupt(main_queue);
+  InitializeFPU();
+  InitializeTask();
+  Task& main_task = task_manager->CurrentTask();
+  InitializeInterrupt();
 
   InitializePCI();
 
-  usb::xhci::Initialize();
+#ifdef ENABLE_BENCHMARK
+  usb::MassStorageDriver::default_observer = [](usb::MassStorageDriver* msc) {
+    storage_to_benchmark = msc;
+  };
+#endif
+#if defined(USB_POLLING_CORE)
+  usb::xhci::Initialize(usb::xhci::PollingMode::kDedicatedCore);
+#elif defined(USB_POLLING_TIMER)
+  usb::xhci::Initialize(usb::xhci::PollingMode::kTimer);
+#else
+  usb::xhci::Initialize(usb::xhci::PollingMode::kInterrupt);
+#endif
 
   InitializeLayer();
   InitializeMainWindow();
   InitializeTextWindow();
+  InitializeTaskBWindow();
   InitializeMouse();
 
   layer_manager->Draw({{0, 0}, ScreenSize()});
 
   acpi::Initialize(acpi_table);
-  InitializeLAPICTimer(*main_queue);
-
-  InitializeKeyboard(*main_queue);
+  InitializeClock();
+  InitializeLAPICTimer();
+  InitializeIdle();
+  InitializeJob();
+  InitializeSMP();
+  layer_manager->SetTiledDraw(num_cpus > 1);
+
+#ifdef ENABLE_BENCHMARK
+  RunBenchmarks();
+#endif
+  // ベンチマークが全コアを使い終えてから AP を専有する
+  usb::xhci::StartPolling();
 
   const int kTextboxCursorTimer = 1;
   const int kTimer05Sec = static_cast<int>(kTimerFreq * 0.5);
+  bool textbox_cursor_visible = false;
+
+  // タスクの一覧と実行キューは割り込みハンドラも触るので，割り込みを止めて変更する
   __asm__("cli");
   timer_manager->AddTimer(Timer{kTimer05Sec, kTextboxCursorTimer});
+  Task& task_b = task_manager->NewTask();
+  if (auto err = task_b.InitContext(TaskB, 45)) {
+    Log(kError, "failed to create TaskB: %s at %s:%d\n",
+        err.Name(), err.File(), err.Line());
+  } else {
+    task_b.Wakeup();
+  }
   __asm__("sti");
-  bool textbox_cursor_visible = false;
 
   char str[128];
 
@@ -222,39 +305,57 @@ extern "C" void KernelMainNewStack(
     FillRectangle(*main_window->Writer(), {24, 28}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
     WriteString(*main_window->Writer(), {24, 28}, str, {0, 0, 0});
     layer_manager->Draw(main_window_layer_id);
+#ifdef ENABLE_BENCHMARK
+    MarkFirstFrame();
+#endif
     // #@@range_end(draw_window_layer)
 
     __asm__("cli");
-    if (main_queue->size() == 0) {
-      __asm__("sti\n\thlt");
+    auto msg = main_task.ReceiveMessage();
+    if (!msg) {
+      main_task.Sleep();
+      __asm__("sti");
       continue;
     }
-
-    Message msg = main_queue->front();
-    main_queue->pop_front();
     __asm__("sti");
 
-    switch (msg.type) {
+    switch (msg->type) {
         case Message::kInterruptXHCI:
-            usb::xhci::ProcessEvents();
+            usb::xhci::ProcessEvents(msg->arg.xhci.interrupter);
+            ProcessInputEvents();
+#ifdef ENABLE_BENCHMARK
+            if (storage_to_benchmark) {
+                BenchmarkUSBStorage(*storage_to_benchmark);
+                storage_to_benchmark = nullptr;
+            }
+#endif
             break;
         case Message::kTimerTimeout:
-            if (msg.arg.timer.value == kTextboxCursorTimer){
+            if (msg->arg.timer.value == kTextboxCursorTimer){
                 __asm__("cli");
                 timer_manager->AddTimer(
-                    Timer{msg.arg.timer.timeout + kTimer05Sec, kTextboxCursorTimer}
+                    Timer{msg->arg.timer.timeout + kTimer05Sec, kTextboxCursorTimer}
                 );
                 __asm__("sti");
                 textbox_cursor_visible = !textbox_cursor_visible;
                 DrawTextCursor(textbox_cursor_visible);
                 layer_manager->Draw(text_window_layer_id);
+            } else if (usb::HubDriver::IsTimerValue(msg->arg.timer.value)) {
+                if (auto err = usb::HubDriver::OnTimerTimeout(msg->arg.timer.value)) {
+                    Log(kError, "USB hub timer: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+                }
             }
             break;
-        case Message::kKeyPush:
-            InputTextWindow(msg.arg.keyboard.ascii);
+        case Message::kLayer: {
+            layer_manager->Draw(msg->arg.layer.layer_id);
+            Message reply{Message::kLayerFinish};
+            __asm__("cli");
+            task_manager->SendMessage(msg->arg.layer.src_task, reply);
+            __asm__("sti");
             break;
+        }
         default:
-          Log(kError, "Unknown message type: %d\n", msg.type);
+          Log(kError, "Unknown message type: %d\n", msg->type);
         }
   }
 }
@@ -70,9 +70,10 @@ void BitmapMemoryManager::SetBit(FrameID frame, bool allocated) {
 
 extern "C" caddr_t program_break, program_break_end;
 
+BitmapMemoryManager* memory_manager;
+
 namespace {
     char memory_manager_buf[sizeof(BitmapMemoryManager)];
-    BitmapMemoryManager* memory_manager;
 
     Error InitializeHeap(BitmapMemoryManager& memory_manager) {
         const int kHeapFrames = 64 * 512;
@@ -1,10 +1,15 @@
 #pragma once
 
+#include <cstdint>
+
 struct Message {
     enum Type {
         kInterruptXHCI,
         kTimerTimeout,
-        kKeyPush,
+        /** @brief レイヤーの再描画の依頼．描画はメインタスクだけが行う */
+        kLayer,
+        /** @brief kLayer の描画が終わったことを依頼元に知らせる */
+        kLayerFinish,
     } type;
 
     union {
@@ -14,9 +19,12 @@ struct Message {
         } timer;
 
         struct {
-            uint8_t modifier;
-            uint8_t keycode;
-            char ascii;
-        } keyboard;
+            int interrupter;
+        } xhci;
+
+        struct {
+            unsigned int layer_id;
+            uint64_t src_task;
+        } layer;
     } arg;
 };
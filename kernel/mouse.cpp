@@ -4,7 +4,6 @@
 #include <memory>
 #include "graphics.hpp"
 #include "layer.hpp"
-#include "usb/classdriver/mouse.hpp"
 
 namespace {
   const char mouse_cursor_shape[kMouseCursorHeight][kMouseCursorWidth + 1] = {
@@ -50,6 +49,8 @@ void DrawMouseCursor(PixelWriter* pixel_writer, Vector2D<int> position) {
 }
 
 
+std::shared_ptr<Mouse> mouse;
+
 Mouse::Mouse(unsigned int layer_id) : layer_id_{layer_id} {
 }
 
@@ -58,7 +59,7 @@ void Mouse::SetPosition(Vector2D<int> position) {
     layer_manager->Move(layer_id_, position_);
 }
 
-void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
+void Mouse::OnInterrupt(uint8_t buttons, int displacement_x, int displacement_y) {
     const auto oldpos = position_;
     auto newpos = position_ + Vector2D<int>{displacement_x, displacement_y};
     newpos = ElementMin(newpos, ScreenSize() + Vector2D<int>{-1, -1});
@@ -96,12 +97,7 @@ void InitializeMouse() {
         .SetWindow(mouse_window)
         .ID();
 
-    auto mouse = std::make_shared<Mouse>(mouse_layer_id);
+    mouse = std::make_shared<Mouse>(mouse_layer_id);
     mouse->SetPosition({200, 200});
     layer_manager->UpDown(mouse->LayerID(), std::numeric_limits<int>::max());
-
-    usb::HIDMouseDriver::default_observer =
-    [mouse](uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
-        mouse->OnInterrupt(buttons, displacement_x, displacement_y);
-    };
 }
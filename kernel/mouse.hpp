@@ -19,7 +19,7 @@ void DrawMouseCursor(PixelWriter* pixel_writer, Vector2D<int> position);
 class Mouse {
  public:
   Mouse(unsigned int layer_id);
-  void OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y);
+  void OnInterrupt(uint8_t buttons, int displacement_x, int displacement_y);
 
   unsigned int LayerID() const { return layer_id_; }
   void SetPosition(Vector2D<int> position);
@@ -33,4 +33,7 @@ class Mouse {
   uint8_t previous_buttons_{0};
 };
 
+/** @brief マウスカーソル．メインループが入力イベントを渡す */
+extern std::shared_ptr<Mouse> mouse;
+
 void InitializeMouse();
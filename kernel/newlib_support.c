@@ -1,6 +1,9 @@
 #include <errno.h>
+#include <stdint.h>
 #include <sys/types.h>
 
+struct _reent;
+
 void _exit(void) {
   while (1) __asm__("hlt");
 }
@@ -26,3 +29,42 @@ int kill(int pid, int sig) {
   errno = EINVAL;
   return -1;
 }
+
+/* malloc/free はタスクの中からも割り込みハンドラや AP からも呼ばれる．
+ * newlib の malloc は再入できないので，ロックを取っている間は割り込みを止め，
+ * 他のコアとはスピンロックで排他する．newlib はロックを入れ子に取るので，
+ * 同じコアからは深さを数えるだけにする． */
+static volatile int malloc_lock_owner = -1;  /* ロックを持つコアの APIC ID */
+static int malloc_lock_depth;
+static uint64_t malloc_lock_rflags;
+
+static int ReadAPICID(void) {
+  return *(volatile uint32_t*)0xfee00020 >> 24;
+}
+
+void __malloc_lock(struct _reent* r) {
+  uint64_t rflags;
+  __asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(rflags) :: "memory");
+
+  const int apic_id = ReadAPICID();
+  if (malloc_lock_owner == apic_id) {
+    ++malloc_lock_depth;
+    return;
+  }
+  while (!__sync_bool_compare_and_swap(&malloc_lock_owner, -1, apic_id)) {
+    __asm__ volatile("pause");
+  }
+  malloc_lock_depth = 1;
+  malloc_lock_rflags = rflags;
+}
+
+void __malloc_unlock(struct _reent* r) {
+  if (--malloc_lock_depth > 0) {
+    return;
+  }
+  const uint64_t rflags = malloc_lock_rflags;
+  __atomic_store_n(&malloc_lock_owner, -1, __ATOMIC_RELEASE);
+  if (rflags & 0x200) {  /* IF */
+    __asm__ volatile("sti" ::: "memory");
+  }
+}
@@ -6,8 +6,11 @@
 
 #include "pci.hpp"
 
+#include <algorithm>
+
 #include "asmfunc.h"
 #include "logger.hpp"
+#include "paging.hpp"
 
 namespace {
   using namespace pci;
@@ -170,11 +173,82 @@ namespace {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  /** @brief 指定された MSI レジスタを設定する */
+  /** @brief 指定された MSI-X ケーパビリティ構造を読み取る */
+  MSIXCapability ReadMSIXCapability(const Device& dev, uint8_t cap_addr) {
+    MSIXCapability msix_cap{};
+    msix_cap.header.data = ReadConfReg(dev, cap_addr);
+    msix_cap.table = ReadConfReg(dev, cap_addr + 4);
+    msix_cap.pba = ReadConfReg(dev, cap_addr + 8);
+    return msix_cap;
+  }
+
+  /** @brief 指定された ID のケーパビリティを探す．見つからなければ 0 を返す */
+  uint8_t FindCapability(const Device& dev, uint8_t cap_id) {
+    uint8_t cap_addr = ReadConfReg(dev, 0x34) & 0xffu;
+    while (cap_addr != 0) {
+      auto header = ReadCapabilityHeader(dev, cap_addr);
+      if (header.bits.cap_id == cap_id) {
+        return cap_addr;
+      }
+      cap_addr = header.bits.next_ptr;
+    }
+    return 0;
+  }
+
+  /** @brief MSI-X テーブルの index 番のエントリのアドレスを返す
+   *
+   * テーブルは BAR が指すメモリ空間にある．カーネルは先頭 kPageDirectoryCount GiB を
+   * アイデンティティマップしているので，その範囲にあれば物理アドレスのまま触れる．
+   */
+  WithError<volatile MSIXTableEntry*> MSIXEntry(const Device& dev, unsigned int index) {
+    const uint8_t cap_addr = FindCapability(dev, kCapabilityMSIX);
+    if (cap_addr == 0) {
+      return {nullptr, MAKE_ERROR(Error::kNoPCIMSI)};
+    }
+
+    const auto msix_cap = ReadMSIXCapability(dev, cap_addr);
+    if (index > msix_cap.header.bits.table_size) {
+      return {nullptr, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+
+    const auto bar = ReadBar(dev, msix_cap.table & 0x7u);
+    if (bar.error) {
+      return {nullptr, bar.error};
+    }
+    const uint64_t table_addr = (bar.value & ~static_cast<uint64_t>(0xf))
+      + (msix_cap.table & ~0x7u);
+    if (table_addr >= (kPageDirectoryCount << 30)) {
+      return {nullptr, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+
+    auto table = reinterpret_cast<volatile MSIXTableEntry*>(table_addr);
+    return {&table[index], MAKE_ERROR(Error::kSuccess)};
+  }
+
+  /** @brief 指定された MSI-X レジスタを設定する
+   *
+   * 先頭から 2^num_vector_exponent 個のエントリに，msg_data のベクタから
+   * 連続したベクタを割り当てる．
+   */
   Error ConfigureMSIXRegister(const Device& dev, uint8_t cap_addr,
                              uint32_t msg_addr, uint32_t msg_data,
                              unsigned int num_vector_exponent) {
-    return MAKE_ERROR(Error::kNotImplemented);
+    const auto msix_cap = ReadMSIXCapability(dev, cap_addr);
+    const unsigned int num_entries = std::min<unsigned int>(
+        1u << num_vector_exponent, msix_cap.header.bits.table_size + 1);
+
+    for (unsigned int i = 0; i < num_entries; ++i) {
+      auto entry = MSIXEntry(dev, i);
+      if (entry.error) {
+        return entry.error;
+      }
+      entry.value->vector_control = 1;
+      entry.value->msg_addr = msg_addr;
+      entry.value->msg_upper_addr = 0;
+      entry.value->msg_data = msg_data + i;
+      entry.value->vector_control = 0;
+    }
+    return pci::EnableMSIX(dev);
   }
 }
 
@@ -254,7 +328,7 @@ namespace pci {
     WriteData(value);
   }
 
-  WithError<uint64_t> ReadBar(Device& device, unsigned int bar_index) {
+  WithError<uint64_t> ReadBar(const Device& device, unsigned int bar_index) {
     if (bar_index >= 6) {
       return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
     }
@@ -307,6 +381,13 @@ namespace pci {
     return MAKE_ERROR(Error::kNoPCIMSI);
   }
 
+  unsigned int MSIVectorExponentCapable(const Device& dev) {
+    if (const uint8_t cap_addr = FindCapability(dev, kCapabilityMSI)) {
+      return ReadMSICapability(dev, cap_addr).header.bits.multi_msg_capable;
+    }
+    return 0;
+  }
+
   Error ConfigureMSIFixedDestination(
       const Device& dev, uint8_t apic_id,
       MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
@@ -318,6 +399,76 @@ namespace pci {
     }
     return ConfigureMSI(dev, msg_addr, msg_data, num_vector_exponent);
   }
+
+  unsigned int MSIXTableSize(const Device& dev) {
+    if (const uint8_t cap_addr = FindCapability(dev, kCapabilityMSIX)) {
+      return ReadMSIXCapability(dev, cap_addr).header.bits.table_size + 1;
+    }
+    return 0;
+  }
+
+  Error ConfigureMSIXEntry(
+      const Device& dev, unsigned int index, uint8_t apic_id,
+      MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
+      uint8_t vector) {
+    auto entry = MSIXEntry(dev, index);
+    if (entry.error) {
+      return entry.error;
+    }
+
+    uint32_t msg_data = (static_cast<uint32_t>(delivery_mode) << 8) | vector;
+    if (trigger_mode == MSITriggerMode::kLevel) {
+      msg_data |= 0xc000;
+    }
+    entry.value->vector_control = 1;
+    entry.value->msg_addr = 0xfee00000u | (apic_id << 12);
+    entry.value->msg_upper_addr = 0;
+    entry.value->msg_data = msg_data;
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error MaskMSIX(const Device& dev, unsigned int index) {
+    auto entry = MSIXEntry(dev, index);
+    if (entry.error) {
+      return entry.error;
+    }
+    entry.value->vector_control = 1;
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error UnmaskMSIX(const Device& dev, unsigned int index) {
+    auto entry = MSIXEntry(dev, index);
+    if (entry.error) {
+      return entry.error;
+    }
+    entry.value->vector_control = 0;
+    // 書き込みがデバイスに届いたことを読み戻して確かめる
+    (void)entry.value->vector_control;
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error EnableMSIX(const Device& dev) {
+    const uint8_t msix_cap_addr = FindCapability(dev, kCapabilityMSIX);
+    if (msix_cap_addr == 0) {
+      return MAKE_ERROR(Error::kNoPCIMSI);
+    }
+
+    if (const uint8_t msi_cap_addr = FindCapability(dev, kCapabilityMSI)) {
+      auto msi_cap = ReadMSICapability(dev, msi_cap_addr);
+      msi_cap.header.bits.msi_enable = 0;
+      WriteConfReg(dev, msi_cap_addr, msi_cap.header.data);
+    }
+
+    // Memory Space Enable を立て，INTx を止める
+    const uint32_t command = ReadConfReg(dev, 0x04);
+    WriteConfReg(dev, 0x04, command | (1u << 1) | (1u << 10));
+
+    auto msix_cap = ReadMSIXCapability(dev, msix_cap_addr);
+    msix_cap.header.bits.msix_enable = 1;
+    msix_cap.header.bits.function_mask = 0;
+    WriteConfReg(dev, msix_cap_addr, msix_cap.header.data);
+    return MAKE_ERROR(Error::kSuccess);
+  }
 }
 
 void InitializePCI() {
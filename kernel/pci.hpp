@@ -93,7 +93,7 @@ namespace pci {
     return 0x10 + 4 * bar_index;
   }
 
-  WithError<uint64_t> ReadBar(Device& device, unsigned int bar_index);
+  WithError<uint64_t> ReadBar(const Device& device, unsigned int bar_index);
 
   /** @brief PCI ケーパビリティレジスタの共通ヘッダ */
   union CapabilityHeader {
@@ -142,6 +142,34 @@ namespace pci {
     uint32_t pending_bits;
   } __attribute__((packed));
 
+  /** @brief MSI-X ケーパビリティ構造 */
+  struct MSIXCapability {
+    union {
+      uint32_t data;
+      struct {
+        uint32_t cap_id : 8;
+        uint32_t next_ptr : 8;
+        uint32_t table_size : 11;  // エントリ数 - 1
+        uint32_t : 3;
+        uint32_t function_mask : 1;
+        uint32_t msix_enable : 1;
+      } __attribute__((packed)) bits;
+    } __attribute__((packed)) header ;
+
+    /** @brief 下位 3 ビットがテーブルのある BAR 番号，残りが BAR 先頭からのオフセット */
+    uint32_t table;
+    /** @brief 下位 3 ビットが Pending Bit Array のある BAR 番号，残りがオフセット */
+    uint32_t pba;
+  } __attribute__((packed));
+
+  /** @brief MSI-X テーブルの 1 エントリ．テーブルは BAR が指すメモリ空間に置かれる． */
+  struct MSIXTableEntry {
+    uint32_t msg_addr;
+    uint32_t msg_upper_addr;
+    uint32_t msg_data;
+    uint32_t vector_control;  // ビット 0 が 1 ならマスク
+  } __attribute__((packed));
+
   /** @brief MSI または MSI-X 割り込みを設定する
    *
    * @param dev  設定対象の PCI デバイス
@@ -152,6 +180,9 @@ namespace pci {
   Error ConfigureMSI(const Device& dev, uint32_t msg_addr, uint32_t msg_data,
                      unsigned int num_vector_exponent);
 
+  /** @brief MSI で割り当てられるベクタ数（2^n の n）を返す．MSI が無ければ 0 */
+  unsigned int MSIVectorExponentCapable(const Device& dev);
+
   enum class MSITriggerMode {
     kEdge = 0,
     kLevel = 1
@@ -170,6 +201,29 @@ namespace pci {
       const Device& dev, uint8_t apic_id,
       MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
       uint8_t vector, unsigned int num_vector_exponent);
+
+  /** @brief MSI-X テーブルのエントリ数を返す．MSI-X が無ければ 0 */
+  unsigned int MSIXTableSize(const Device& dev);
+
+  /** @brief MSI-X テーブルの index 番のエントリに，apic_id のコアへ vector を届けるメッセージを書き込む
+   *
+   * 書き換えの間と書き換えた後はエントリをマスクしておく．UnmaskMSIX で割り込みを通す．
+   */
+  Error ConfigureMSIXEntry(
+      const Device& dev, unsigned int index, uint8_t apic_id,
+      MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
+      uint8_t vector);
+
+  /** @brief MSI-X テーブルの index 番のエントリをマスクする．その間の割り込みは保留される */
+  Error MaskMSIX(const Device& dev, unsigned int index);
+  /** @brief MSI-X テーブルの index 番のエントリのマスクを解除する */
+  Error UnmaskMSIX(const Device& dev, unsigned int index);
+
+  /** @brief MSI-X を有効にする
+   *
+   * MSI と INTx は無効にする．各エントリのマスクはそのまま残す．
+   */
+  Error EnableMSIX(const Device& dev);
 }
 
 void InitializePCI();
@@ -0,0 +1,194 @@
+#include "smp.hpp"
+
+#include <cstring>
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "clock.hpp"
+#include "fpu.hpp"
+#include "job.hpp"
+#include "logger.hpp"
+
+extern "C" uint8_t ApTrampoline[], ApTrampolineData[], ApTrampolineEnd[];
+
+std::array<CPU*, kMaxCPUs> cpus;
+int num_cpus;
+
+namespace {
+  volatile uint32_t& lapic_id = *reinterpret_cast<uint32_t*>(0xfee00020);
+  volatile uint32_t& spurious_vector = *reinterpret_cast<uint32_t*>(0xfee000f0);
+  volatile uint32_t& icr_low = *reinterpret_cast<uint32_t*>(0xfee00300);
+  volatile uint32_t& icr_high = *reinterpret_cast<uint32_t*>(0xfee00310);
+
+  const size_t kAPStackFrames = 16;
+  const uint32_t kSpuriousInterruptVector = 0xff;
+  /** @brief AP が起動処理を終えるのを待つ時間（ナノ秒） */
+  const uint64_t kAPStartTimeout = 100'000'000;
+
+  /** @brief asmfunc.asm の ApTrampolineData と同じ並び */
+  struct TrampolineData {
+    uint64_t cr3;
+    uint64_t stack_end;
+    uint64_t entry;
+    uint64_t arg;
+  };
+
+  void WaitMicroseconds(uint64_t usec) {
+    const auto end = Clock::Now() + usec * 1000;
+    while (Clock::Now() < end);
+  }
+
+  void SendIPI(uint8_t apic_id, uint32_t command) {
+    icr_high = static_cast<uint32_t>(apic_id) << 24;
+    icr_low = command;
+    // Delivery Status が Idle に戻るまで待つ
+    while (icr_low & (1u << 12));
+  }
+
+  void ApMain(uint64_t cpu_index) {
+    CPU& cpu = *cpus[cpu_index];
+
+    cpu.gdt[0].data = 0;
+    SetCodeSegment(cpu.gdt[1], DescriptorType::kExecuteRead, 0, 0, 0xfffff);
+    SetDataSegment(cpu.gdt[2], DescriptorType::kReadWrite, 0, 0, 0xfffff);
+    LoadGDT(sizeof(cpu.gdt) - 1, reinterpret_cast<uintptr_t>(&cpu.gdt[0]));
+    SetDSAll(kKernelDS);
+    SetCSSS(kKernelCS, kKernelSS);
+
+    cpu.idt = idt;
+    LoadIDT(sizeof(cpu.idt) - 1, reinterpret_cast<uintptr_t>(&cpu.idt[0]));
+
+    EnableFPUFeatures();
+
+    // APIC Software Enable
+    spurious_vector = (1u << 8) | kSpuriousInterruptVector;
+
+    cpu.started.store(true, std::memory_order_release);
+    RunJobLoop(cpu.index);
+  }
+
+  /** @brief AP を 1 つ起動する．
+   *
+   * 時間内に起動を確認できなければ，INIT で止めてスタックを返す．
+   * 止めた AP はトランポリンを読まないので，トランポリンは次の AP に使える．
+   *
+   * @return 起動処理を終えるのを時間内に確認できなければ false．
+   */
+  bool StartAP(CPU& cpu, uint8_t* trampoline) {
+    const auto stack = memory_manager->Allocate(kAPStackFrames);
+    if (stack.error) {
+      Log(kError, "failed to allocate AP stack: %s at %s:%d\n",
+          stack.error.Name(), stack.error.File(), stack.error.Line());
+      return false;
+    }
+    cpu.stack_frame = stack.value;
+
+    auto data = reinterpret_cast<TrampolineData*>(
+        trampoline + (ApTrampolineData - ApTrampoline));
+    data->cr3 = GetCR3();
+    data->stack_end = reinterpret_cast<uint64_t>(cpu.stack_frame.Frame())
+      + kAPStackFrames * kBytesPerFrame;
+    data->entry = reinterpret_cast<uint64_t>(ApMain);
+    data->arg = cpu.index;
+
+    const uint32_t start_page = reinterpret_cast<uintptr_t>(trampoline) >> 12;
+    SendIPI(cpu.apic_id, 0x00004500); // INIT, level assert
+    WaitMicroseconds(10000);
+    for (int i = 0; i < 2 && !cpu.started.load(std::memory_order_acquire); ++i) {
+      SendIPI(cpu.apic_id, 0x00004600 | start_page); // Start-up
+      WaitMicroseconds(200);
+    }
+
+    const auto deadline = Clock::Now() + kAPStartTimeout;
+    while (!cpu.started.load(std::memory_order_acquire)) {
+      if (Clock::Now() > deadline) {
+        Log(kWarn, "AP (APIC ID %u) did not start; skipping it\n", cpu.apic_id);
+        SendIPI(cpu.apic_id, 0x00004500); // INIT, level assert
+        memory_manager->Free(cpu.stack_frame, kAPStackFrames);
+        return false;
+      }
+    }
+    return true;
+  }
+}
+
+void SendIPIToOthers(uint8_t vector) {
+  // Destination Shorthand = All Excluding Self, Fixed
+  SendIPI(0, (0b11u << 18) | vector);
+}
+
+void SendIPIToCPU(int cpu_index, uint8_t vector) {
+  // Destination Shorthand = No Shorthand, Fixed
+  SendIPI(cpus[cpu_index]->apic_id, vector);
+}
+
+uint8_t CurrentAPICID() {
+  return lapic_id >> 24;
+}
+
+int CurrentCPUIndex() {
+  const auto apic_id = CurrentAPICID();
+  // 起動途中の AP も引けるよう，num_cpus ではなく登録済みの要素をすべて見る
+  for (int i = 0; i < kMaxCPUs && cpus[i]; ++i) {
+    if (cpus[i]->apic_id == apic_id) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+void InitializeSMP() {
+  auto bsp = new CPU;
+  bsp->index = 0;
+  bsp->apic_id = CurrentAPICID();
+  bsp->started = true;
+  cpus[0] = bsp;
+  num_cpus = 1;
+
+  if (acpi::madt == nullptr) {
+    return;
+  }
+
+  // SIPI で指定できるのは 1 MiB 未満のページだけ
+  const auto frame = memory_manager->Allocate(1);
+  if (frame.error || frame.value.ID() >= 0x100) {
+    Log(kWarn, "no free page below 1 MiB for the AP trampoline\n");
+    if (!frame.error) {
+      memory_manager->Free(frame.value, 1);
+    }
+    return;
+  }
+  auto trampoline = reinterpret_cast<uint8_t*>(frame.value.Frame());
+  memcpy(trampoline, ApTrampoline, ApTrampolineEnd - ApTrampoline);
+
+  for (size_t i = 0; i < acpi::madt->Count(); ++i) {
+    const auto entry = acpi::madt->Entry(i);
+    if (entry->type != acpi::MADTLocalAPIC::kType) {
+      continue;
+    }
+    const auto lapic = reinterpret_cast<const acpi::MADTLocalAPIC*>(entry);
+    if (!lapic->IsEnabled() || lapic->apic_id == bsp->apic_id) {
+      continue;
+    }
+    if (num_cpus == kMaxCPUs) {
+      Log(kWarn, "too many CPUs; ignoring the rest\n");
+      break;
+    }
+
+    // ApMain が cpus から引くので，起動する前に登録しておく
+    auto cpu = new CPU;
+    cpu->index = num_cpus;
+    cpu->apic_id = lapic->apic_id;
+    cpus[num_cpus] = cpu;
+    if (!StartAP(*cpu, trampoline)) {
+      // 起動しなかった AP の番号は次の AP に使う
+      cpus[num_cpus] = nullptr;
+      delete cpu;
+      continue;
+    }
+    ++num_cpus;
+  }
+
+  memory_manager->Free(frame.value, 1);
+  Log(kInfo, "SMP: %d CPUs online\n", num_cpus);
+}
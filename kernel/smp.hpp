@@ -0,0 +1,51 @@
+/**
+ * @file smp.hpp
+ *
+ * マルチプロセッサ（SMP）の起動と CPU ごとの情報を扱うプログラムを集めたファイル．
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
+#include "segment.hpp"
+
+/** @brief 1 つの CPU コアの情報．GDT と IDT はコアごとに持つ． */
+struct CPU {
+  /** @brief cpus 配列での添字．BSP は 0 */
+  int index;
+  uint8_t apic_id;
+  /** @brief AP が起動処理を終えると true になる */
+  std::atomic<bool> started;
+  FrameID stack_frame{kNullFrame};
+  alignas(16) std::array<SegmentDescriptor, 3> gdt;
+  alignas(16) std::array<InterruptDescriptor, 256> idt;
+};
+
+/** @brief 扱える CPU の最大数 */
+const int kMaxCPUs = 64;
+
+/** @brief 起動済みの CPU．[0, num_cpus) が有効で，0 番は BSP */
+extern std::array<CPU*, kMaxCPUs> cpus;
+extern int num_cpus;
+
+/** @brief 実行中のコアの Local APIC ID を返す． */
+uint8_t CurrentAPICID();
+/** @brief 実行中のコアの cpus 配列での添字を返す． */
+int CurrentCPUIndex();
+
+/** @brief 自分以外のすべてのコアに割り込み vector を送る． */
+void SendIPIToOthers(uint8_t vector);
+/** @brief cpus[cpu_index] のコアに割り込み vector を送る． */
+void SendIPIToCPU(int cpu_index, uint8_t vector);
+
+/** @brief MADT に載っている AP を INIT-SIPI-SIPI で順に起動する．
+ *
+ * InitializeClock と InitializeInterrupt の後に呼ぶ．起動した AP は
+ * 自分の GDT, IDT, スタックを設定した後，ジョブを待つ RunJobLoop に入る．
+ */
+void InitializeSMP();
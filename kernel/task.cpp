@@ -0,0 +1,299 @@
+#include "task.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "asmfunc.h"
+#include "fpu.hpp"
+#include "logger.hpp"
+#include "segment.hpp"
+
+namespace {
+  template <class T, class U>
+  void Erase(T& c, const U& value) {
+    auto it = std::remove(c.begin(), c.end(), value);
+    c.erase(it, c.end());
+  }
+
+  void TaskIdle(uint64_t task_id, int64_t data) {
+    while (true) __asm__("hlt");
+  }
+}
+
+Task::Task(uint64_t id) : id_{id} {
+}
+
+Task::~Task() {
+  if (stack_frame_.ID() != kNullFrame.ID()) {
+    memory_manager->Free(stack_frame_, kDefaultStackFrames);
+  }
+  if (fpu_frame_.ID() != kNullFrame.ID()) {
+    FreeFPUArea(fpu_frame_);
+  }
+}
+
+Error Task::InitContext(TaskFunc* f, int64_t data) {
+  const auto stack = memory_manager->Allocate(kDefaultStackFrames);
+  if (stack.error) {
+    return stack.error;
+  }
+  stack_frame_ = stack.value;
+  const uint64_t stack_end = reinterpret_cast<uint64_t>(stack_frame_.Frame())
+    + kDefaultStackFrames * kBytesPerFrame;
+
+  memset(&context_, 0, sizeof(context_));
+  if (auto err = InitFPUArea()) {
+    return err;
+  }
+  context_.rip = reinterpret_cast<uint64_t>(f);
+  context_.rdi = id_;
+  context_.rsi = data;
+
+  context_.cr3 = GetCR3();
+  context_.rflags = 0x202;
+  context_.cs = kKernelCS;
+  context_.ss = kKernelSS;
+  // 関数の入口では RSP + 8 が 16 の倍数になっている必要がある
+  context_.rsp = (stack_end & ~0xflu) - 8;
+
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error Task::InitFPUArea() {
+  const auto area = NewFPUArea();
+  if (area.error) {
+    return area.error;
+  }
+  fpu_frame_ = area.value;
+  context_.fpu_area = reinterpret_cast<uint64_t>(fpu_frame_.Frame());
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+TaskContext& Task::Context() {
+  return context_;
+}
+
+uint64_t Task::ID() const {
+  return id_;
+}
+
+Task& Task::Sleep() {
+  task_manager->Sleep(this);
+  return *this;
+}
+
+Task& Task::Wakeup() {
+  task_manager->Wakeup(this);
+  return *this;
+}
+
+void Task::SendMessage(const Message& msg) {
+  msgs_.push_back(msg);
+  Wakeup();
+}
+
+std::optional<Message> Task::ReceiveMessage() {
+  if (msgs_.empty()) {
+    return std::nullopt;
+  }
+
+  auto m = msgs_.front();
+  msgs_.pop_front();
+  return m;
+}
+
+TaskManager::TaskManager() {
+  Task& task = NewTask()
+    .SetLevel(current_level_)
+    .SetRunning(true);
+  running_[current_level_].push_back(&task);
+  // 今レジスタにある拡張状態はメインタスクのもの
+  if (auto err = task.InitFPUArea()) {
+    Log(kError, "failed to allocate FPU area: %s at %s:%d\n",
+        err.Name(), err.File(), err.Line());
+    exit(1);
+  }
+  SetFPUOwner(task.fpu_frame_);
+
+  // 実行できるタスクが無くなっても切り替え先に困らないよう，最低レベルで休むだけのタスクを置く
+  Task& idle = NewTask();
+  if (auto err = idle.InitContext(TaskIdle, 0)) {
+    Log(kError, "failed to create idle task: %s at %s:%d\n",
+        err.Name(), err.File(), err.Line());
+    exit(1);
+  }
+  idle.SetLevel(0).SetRunning(true);
+  running_[0].push_back(&idle);
+}
+
+Task& TaskManager::NewTask() {
+  ++latest_id_;
+  return *tasks_.emplace_back(new Task{latest_id_});
+}
+
+void TaskManager::SwitchTask(bool current_sleep) {
+  auto& level_queue = running_[current_level_];
+  Task* current_task = level_queue.front();
+  level_queue.pop_front();
+  if (!current_sleep) {
+    level_queue.push_back(current_task);
+  }
+  if (level_queue.empty()) {
+    level_changed_ = true;
+  }
+
+  if (level_changed_) {
+    level_changed_ = false;
+    for (int lv = kMaxLevel; lv >= 0; --lv) {
+      if (!running_[lv].empty()) {
+        current_level_ = lv;
+        break;
+      }
+    }
+  }
+
+  UpdateTaskTimer();
+
+  Task* next_task = running_[current_level_].front();
+  if (next_task != current_task) {
+    SwitchContext(&next_task->Context(), &current_task->Context());
+  }
+}
+
+void TaskManager::Sleep(Task* task) {
+  if (!task->Running()) {
+    return;
+  }
+
+  task->SetRunning(false);
+
+  if (task == running_[current_level_].front()) {
+    SwitchTask(true);
+    return;
+  }
+
+  Erase(running_[task->Level()], task);
+  UpdateTaskTimer();
+}
+
+Error TaskManager::Sleep(uint64_t id) {
+  auto it = std::find_if(tasks_.begin(), tasks_.end(),
+                         [id](const auto& t){ return t->ID() == id; });
+  if (it == tasks_.end()) {
+    return MAKE_ERROR(Error::kNoSuchTask);
+  }
+
+  Sleep(it->get());
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void TaskManager::Wakeup(Task* task, int level) {
+  if (task->Running()) {
+    ChangeLevelRunning(task, level);
+    return;
+  }
+
+  if (level < 0) {
+    level = task->Level();
+  }
+
+  task->SetLevel(level);
+  task->SetRunning(true);
+
+  running_[level].push_back(task);
+  if (level > current_level_) {
+    level_changed_ = true;
+  }
+  UpdateTaskTimer();
+}
+
+Error TaskManager::Wakeup(uint64_t id, int level) {
+  auto it = std::find_if(tasks_.begin(), tasks_.end(),
+                         [id](const auto& t){ return t->ID() == id; });
+  if (it == tasks_.end()) {
+    return MAKE_ERROR(Error::kNoSuchTask);
+  }
+
+  Wakeup(it->get(), level);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error TaskManager::SendMessage(uint64_t id, const Message& msg) {
+  auto it = std::find_if(tasks_.begin(), tasks_.end(),
+                         [id](const auto& t){ return t->ID() == id; });
+  if (it == tasks_.end()) {
+    return MAKE_ERROR(Error::kNoSuchTask);
+  }
+
+  (*it)->SendMessage(msg);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void TaskManager::OnTaskTimerTimeout() {
+  // 満了したタイマは TimerManager が解放済み
+  task_timer_ = kNullTimerHandle;
+  SwitchTask();
+}
+
+void TaskManager::PreemptIfNeeded() {
+  if (level_changed_) {
+    SwitchTask();
+  }
+}
+
+Task& TaskManager::CurrentTask() {
+  return *running_[current_level_].front();
+}
+
+void TaskManager::ChangeLevelRunning(Task* task, int level) {
+  if (level < 0 || level == task->Level()) {
+    return;
+  }
+
+  if (task != running_[current_level_].front()) {
+    // 実行中でないタスクのレベルを変える
+    Erase(running_[task->Level()], task);
+    running_[level].push_back(task);
+    task->SetLevel(level);
+    if (level > current_level_) {
+      level_changed_ = true;
+    }
+    UpdateTaskTimer();
+    return;
+  }
+
+  // 実行中のタスクのレベルを変える．下げた場合は次の切り替えで選び直す
+  running_[current_level_].pop_front();
+  running_[level].push_front(task);
+  task->SetLevel(level);
+  if (level < current_level_) {
+    level_changed_ = true;
+  }
+  current_level_ = level;
+  UpdateTaskTimer();
+}
+
+void TaskManager::UpdateTaskTimer() {
+  if (timer_manager == nullptr) {
+    return;
+  }
+
+  const bool armed = task_timer_.index != kNullTimerHandle.index;
+  const bool needed = running_[current_level_].size() > 1;
+  if (needed && !armed) {
+    const auto timer = timer_manager->AddTimer(
+        Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue});
+    if (!timer.error) {
+      task_timer_ = timer.value;
+    }
+  } else if (!needed && armed) {
+    timer_manager->CancelTimer(task_timer_);
+    task_timer_ = kNullTimerHandle;
+  }
+}
+
+TaskManager* task_manager;
+
+void InitializeTask() {
+  task_manager = new TaskManager;
+}
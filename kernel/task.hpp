@@ -0,0 +1,140 @@
+/**
+ * @file task.hpp
+ *
+ * タスク管理，コンテキスト切り替えのプログラムを集めたファイル．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <vector>
+#include <memory>
+
+#include "error.hpp"
+#include "memory_manager.hpp"
+#include "message.hpp"
+#include "timer.hpp"
+
+/** @brief SwitchContext が保存・復帰するレジスタ．
+ *
+ * 拡張状態（x87/SSE/AVX）はここには含めず，fpu_area の指す領域へ
+ * #NM を契機に遅延して保存・復帰する（fpu.hpp 参照）．
+ */
+struct TaskContext {
+  uint64_t cr3, rip, rflags, fpu_area; // offset 0x00
+  uint64_t cs, ss, fs, gs; // offset 0x20
+  uint64_t rax, rbx, rcx, rdx, rdi, rsi, rsp, rbp; // offset 0x40
+  uint64_t r8, r9, r10, r11, r12, r13, r14, r15; // offset 0x80
+} __attribute__((packed));
+
+using TaskFunc = void (uint64_t, int64_t);
+
+class TaskManager;
+
+/** @brief 1 つの実行の流れ（タスク）を表す．
+ *
+ * スタックはフレーム単位で memory_manager から確保する．
+ * 受け取ったメッセージはタスクごとのキューに溜まり，
+ * メッセージが届くと眠っていたタスクは起こされる．
+ */
+class Task {
+ public:
+  static const int kDefaultLevel = 1;
+  /** @brief スタックに割り当てるフレーム数 */
+  static const size_t kDefaultStackFrames = 16;
+
+  Task(uint64_t id);
+  ~Task();
+  /** @brief f(id, data) から実行を始めるようにコンテキストを設定する．
+   *
+   * スタックや拡張状態の保存領域が確保できなければエラーを返す．
+   */
+  Error InitContext(TaskFunc* f, int64_t data);
+  TaskContext& Context();
+  uint64_t ID() const;
+  Task& Sleep();
+  Task& Wakeup();
+  void SendMessage(const Message& msg);
+  std::optional<Message> ReceiveMessage();
+
+  int Level() const { return level_; }
+  bool Running() const { return running_; }
+
+ private:
+  uint64_t id_;
+  FrameID stack_frame_{kNullFrame};
+  FrameID fpu_frame_{kNullFrame};
+  alignas(16) TaskContext context_;
+  std::deque<Message> msgs_;
+  unsigned int level_{kDefaultLevel};
+  bool running_{false};
+
+  Task& SetLevel(int level) { level_ = level; return *this; }
+  Task& SetRunning(bool running) { running_ = running; return *this; }
+  /** @brief 拡張状態の保存領域を確保し，コンテキストに設定する． */
+  Error InitFPUArea();
+
+  friend TaskManager;
+};
+
+/** @brief タスクを優先度（レベル）ごとのラウンドロビンで切り替える．
+ *
+ * 常に実行可能なタスクのうち最も高いレベルのものだけを実行する．
+ * 入力を処理するメインタスクを高いレベルに置けば，重い処理をするタスクが
+ * 走っていてもメッセージが届いた時点でメインタスクに切り替わる．
+ */
+class TaskManager {
+ public:
+  /** @brief レベルの最大値．メインタスクはこのレベルで動く． */
+  static const int kMaxLevel = 3;
+
+  TaskManager();
+  Task& NewTask();
+  /** @brief 次のタスクへ切り替える．
+   *
+   * @param current_sleep  true なら現在のタスクを実行キューから外す．
+   */
+  void SwitchTask(bool current_sleep = false);
+  /** @brief タスク切り替え用のタイマが満了した．同じレベルの次のタスクへ切り替える． */
+  void OnTaskTimerTimeout();
+
+  void Sleep(Task* task);
+  Error Sleep(uint64_t id);
+  /** @brief タスクを起こす．level が負ならタスクの今のレベルのまま起こす． */
+  void Wakeup(Task* task, int level = -1);
+  Error Wakeup(uint64_t id, int level = -1);
+  /** @brief タスクにメッセージを送り，眠っていれば起こす．割り込みハンドラから呼んでよい． */
+  Error SendMessage(uint64_t id, const Message& msg);
+  /** @brief 現在より高いレベルのタスクが起こされていれば切り替える．
+   *
+   * 割り込みハンドラの最後（EOI の後）に呼ぶと，メッセージを受け取った
+   * タスクが次のタスク切り替えを待たずに動き出す．
+   */
+  void PreemptIfNeeded();
+  Task& CurrentTask();
+
+ private:
+  std::vector<std::unique_ptr<Task>> tasks_{};
+  uint64_t latest_id_{0};
+  std::array<std::deque<Task*>, kMaxLevel + 1> running_{};
+  int current_level_{kMaxLevel};
+  /** @brief 次の SwitchTask でレベルを選び直す必要があれば true */
+  bool level_changed_{false};
+  /** @brief 登録中のタスク切り替え用のタイマ．登録していなければ kNullTimerHandle */
+  TimerHandle task_timer_{kNullTimerHandle};
+
+  void ChangeLevelRunning(Task* task, int level);
+  /** @brief 今のレベルに実行可能なタスクが複数あるときだけタスク切り替え用のタイマを登録する．
+   *
+   * 実行キューを変えたら，割り込みを止めたまま呼ぶ．
+   */
+  void UpdateTaskTimer();
+};
+
+extern TaskManager* task_manager;
+
+/** @brief TaskManager を生成し，呼び出し元をメインタスク（ID 1）にする． */
+void InitializeTask();
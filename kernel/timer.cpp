@@ -1,5 +1,12 @@
 #include "timer.hpp"
+
+#include <algorithm>
 #include "acpi.hpp"
+#include "asmfunc.h"
+#include "clock.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "task.hpp"
 
 namespace {
   const uint32_t kCountMax = 0xffffffffu;
@@ -7,24 +14,109 @@ namespace {
   volatile uint32_t& initial_count = *reinterpret_cast<uint32_t*>(0xfee00380);
   volatile uint32_t& current_count = *reinterpret_cast<uint32_t*>(0xfee00390);
   volatile uint32_t& divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
-}
 
-void InitializeLAPICTimer(std::deque<Message>& msg_queue) {
-    timer_manager = new TimerManager{msg_queue};
+  const uint32_t kMSRTSCDeadline = 0x6e0;
+  const uint64_t kNanosecondsPerSecond = 1000000000;
+  const uint64_t kNanosecondsPerTick = kNanosecondsPerSecond / kTimerFreq;
+
+  bool use_tsc_deadline;
+  /** @brief 満了したタイマの通知．割り込みハンドラの中でメインタスクへ送る． */
+  std::deque<Message>* timer_msgs;
+  /** @brief StartTimerPolling で登録された関数 */
+  TimerPollFunc* timer_poll = nullptr;
+
+  /** @brief CPUID leaf 0x15/0x16 から LAPIC タイマの周波数を求める．分からなければ 0 を返す．
+   *
+   * LAPIC タイマは水晶（leaf 0x15）が報告されていればその周波数で，
+   * そうでなければバス（leaf 0x16）の周波数で進む．
+   * 仮想マシンでは LAPIC がこれらと無関係な周波数で模倣されるので使わない．
+   */
+  unsigned long LAPICTimerFrequencyFromCPUID() {
+    uint32_t regs[4];
+    ReadCPUID(1, 0, regs);
+    if ((regs[2] >> 31) & 1) {
+      return 0;
+    }
+    ReadCPUID(0, 0, regs);
+    const uint32_t max_leaf = regs[0];
+    if (max_leaf >= 0x15) {
+      ReadCPUID(0x15, 0, regs);
+      if (regs[2] != 0) {
+        return regs[2];
+      }
+    }
+    if (max_leaf >= 0x16) {
+      ReadCPUID(0x16, 0, regs);
+      return static_cast<unsigned long>(regs[2] & 0xffffu) * 1000000;
+    }
+    return 0;
+  }
+
+  uint64_t ReadLAPICTimerCount() {
+    return LAPICTimerElapsed();
+  }
+
+  unsigned long CurrentTickFromClock() {
+    return Clock::Now() / kNanosecondsPerTick;
+  }
+
+  void ArmLAPICTimer(unsigned long deadline) {
+    if (use_tsc_deadline) {
+      // 0 を書き込むとタイマは止まる
+      const uint64_t tsc = deadline == TimerManager::kNoDeadline
+        ? 0 : Clock::CounterAt(deadline * kNanosecondsPerTick);
+      WriteMSR(kMSRTSCDeadline, tsc);
+      return;
+    }
 
+    if (deadline == TimerManager::kNoDeadline) {
+      initial_count = 0;
+      return;
+    }
+    const uint64_t target = deadline * kNanosecondsPerTick;
+    const uint64_t now = Clock::Now();
+    const uint64_t ns = target > now ? target - now : 0;
+    // 32 ビットに収まらない遠い時刻は途中で一旦起きて予約し直す
+    const uint64_t count = ns / kNanosecondsPerSecond * lapic_timer_freq
+      + ns % kNanosecondsPerSecond * lapic_timer_freq / kNanosecondsPerSecond;
+    initial_count = std::clamp<uint64_t>(count, 1, kCountMax);
+  }
+}
+
+void InitializeLAPICTimer() {
     divide_config = 0b1011; // divide 1:1
     lvt_timer = 0b001 << 16;
 
-    StartLAPICTimer();
-    acpi::WaitMilliseconds(100);
-    const auto elapsed = LAPICTimerElapsed();
-    StopLAPICTimer();
+    const char* source = "CPUID";
+    lapic_timer_freq = LAPICTimerFrequencyFromCPUID();
+    unsigned long error_ppm = 0;
+    if (lapic_timer_freq == 0) {
+      source = "PM timer";
+      StartLAPICTimer();
+      const auto calib = acpi::CalibrateWithPMTimer(ReadLAPICTimerCount, 4, 1000);
+      StopLAPICTimer();
+      lapic_timer_freq = calib.freq;
+      error_ppm = calib.error_ppm;
+    }
+
+    uint32_t regs[4];
+    ReadCPUID(1, 0, regs);
+    use_tsc_deadline = (regs[2] >> 24) & 1;
+    Log(kInfo, "LAPIC timer: %lu Hz +-%lu ppm (from %s), mode: %s\n",
+        lapic_timer_freq, error_ppm, source,
+        use_tsc_deadline ? "TSC-deadline" : "one-shot");
 
-    lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+    timer_msgs = new std::deque<Message>;
+    timer_manager = new TimerManager{*timer_msgs, CurrentTickFromClock, ArmLAPICTimer};
 
     divide_config = 0b1011;
-    lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer,
-    initial_count = lapic_timer_freq / kTimerFreq;
+    if (use_tsc_deadline) {
+      lvt_timer = (0b100 << 16) | InterruptVector::kLAPICTimer;
+      // LVT の書き込みが IA32_TSC_DEADLINE への書き込みより先に完了するようにする
+      __asm__ volatile("mfence" ::: "memory");
+    } else {
+      lvt_timer = InterruptVector::kLAPICTimer; // one-shot
+    }
 }
 
 void StartLAPICTimer() {
@@ -42,34 +134,255 @@ void StopLAPICTimer() {
 Timer::Timer(unsigned long timeout, int value) : timeout_{timeout}, value_{value} {
 }
 
-TimerManager::TimerManager(std::deque<Message>& msg_queue) : msg_queue_{msg_queue} {
-    timers_.push(Timer{std::numeric_limits<unsigned long>::max(), -1});
+TimerManager::TimerManager(std::deque<Message>& msg_queue,
+                           ClockFunc* clock, ArmFunc* arm)
+    : msg_queue_{msg_queue}, clock_{clock}, arm_{arm} {
+    for (uint32_t i = 0; i < kMaxTimers; ++i) {
+        nodes_[i].next = i + 1 < kMaxTimers ? i + 1 : kNil;
+        nodes_[i].generation = 0;
+        nodes_[i].slot = kNoSlot;
+    }
+    free_head_ = 0;
+    slots_.fill(kNil);
 }
 
-void TimerManager::AddTimer(const Timer& timer){
-    timers_.push(timer);
+WithError<TimerHandle> TimerManager::AddTimer(const Timer& timer){
+    if (free_head_ == kNil) {
+        return {kNullTimerHandle, MAKE_ERROR(Error::kFull)};
+    }
+
+    const auto index = free_head_;
+    auto& node = nodes_[index];
+    free_head_ = node.next;
+
+    node.timeout = timer.Timeout();
+    node.value = timer.Value();
+    Link(index, tick_ + 1);
+    ++num_timers_;
+    Rearm();
+
+    return {TimerHandle{index, node.generation}, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error TimerManager::CancelTimer(TimerHandle handle){
+    if (handle.index >= kMaxTimers) {
+        return MAKE_ERROR(Error::kTimerNotFound);
+    }
+    auto& node = nodes_[handle.index];
+    if (node.slot == kNoSlot || node.generation != handle.generation) {
+        return MAKE_ERROR(Error::kTimerNotFound);
+    }
+
+    Unlink(handle.index);
+    FreeNode(handle.index);
+    return MAKE_ERROR(Error::kSuccess);
 }
 
-void TimerManager::Tick(){
-    ++tick_;
-    while (true){
-        const auto& t = timers_.top();
-        if (t.Timeout() > tick_){
+bool TimerManager::Tick(){
+    const unsigned long t = tick_ + 1;
+    bool task_timer_timeout = false;
+
+    // 最下段が一周したら上段から順に移し替える
+    for (int level = 1; level < kNumLevels; ++level) {
+        if (LevelIndex(level - 1, t) != 0) {
             break;
         }
+        Cascade(level, LevelIndex(level, t), t);
+    }
+
+    auto index = Detach(SlotIndex(0, LevelIndex(0, t)));
+    while (index != kNil) {
+        const auto next = nodes_[index].next;
+        auto& node = nodes_[index];
+
+        if (node.timeout > t) {
+            // 最上段で丸められていたタイマ．本来の位置に繋ぎ直す
+            Link(index, t);
+        } else if (node.value == kTaskTimerValue) {
+            // 登録し直すかは，タスクを切り替えた後に TaskManager が決める
+            task_timer_timeout = true;
+            FreeNode(index);
+        } else if (node.value == kPollTimerValue) {
+            // 割り込みを起こすためだけのタイマ．ポーリングは LAPICTimerOnInterrupt で行う
+            node.timeout = t + kPollTimerPeriod;
+            Link(index, t + 1);
+        } else {
+            Message m{Message::kTimerTimeout};
+            m.arg.timer.timeout = node.timeout;
+            m.arg.timer.value = node.value;
+            msg_queue_.push_back(m);
+            FreeNode(index);
+        }
+        index = next;
+    }
+
+    tick_ = t;
+    return task_timer_timeout;
+}
+
+bool TimerManager::AdvanceTo(unsigned long tick){
+    bool task_timer_timeout = false;
+    while (tick_ < tick) {
+        const auto next = NextEventTick(tick_ + 1);
+        if (next > tick) {
+            tick_ = tick;
+            break;
+        }
+        tick_ = next - 1;
+        task_timer_timeout |= Tick();
+    }
+    return task_timer_timeout;
+}
+
+bool TimerManager::OnInterrupt(){
+    const bool task_timer_timeout = AdvanceTo(CurrentTick());
+    armed_deadline_ = kNoDeadline;
+    Rearm();
+    return task_timer_timeout;
+}
+
+unsigned long TimerManager::NextEventTick(unsigned long base) const {
+    unsigned long next = kNoDeadline;
+    for (int level = 0; level < kNumLevels; ++level) {
+        const int shift = LevelShift(level);
+        const size_t num_slots = level == 0 ? kRootSlots : kLevelSlots;
+        // base 以降で最初にこの段のスロットを処理（カスケード）するティック / 2^shift
+        const unsigned long k = (base + (1ul << shift) - 1) >> shift;
+        const int distance = FindOccupied(level, k & (num_slots - 1));
+        if (distance >= 0) {
+            next = std::min(next, (k + distance) << shift);
+        }
+    }
+    return next;
+}
+
+void TimerManager::Link(uint32_t index, unsigned long base){
+    auto& node = nodes_[index];
+    unsigned long expires = std::max(node.timeout, base);
+
+    int level = 0;
+    while (level < kNumLevels - 1 &&
+           expires - base >= (1ul << LevelShift(level + 1))) {
+        ++level;
+    }
+    const unsigned long max_delta = (1ul << LevelShift(kNumLevels)) - 1;
+    if (expires - base > max_delta) {
+        expires = base + max_delta;
+    }
 
-        Message m{Message::kTimerTimeout};
-        m.arg.timer.timeout = t.Timeout();
-        m.arg.timer.value = t.Value();
-        msg_queue_.push_back(m);
+    const auto slot = SlotIndex(level, LevelIndex(level, expires));
+    node.slot = slot;
+    node.prev = kNil;
+    node.next = slots_[slot];
+    if (node.next != kNil) {
+        nodes_[node.next].prev = index;
+    }
+    slots_[slot] = index;
+    SetOccupied(slot, true);
+}
 
-        timers_.pop();
+void TimerManager::Unlink(uint32_t index){
+    auto& node = nodes_[index];
+    if (node.prev == kNil) {
+        slots_[node.slot] = node.next;
+    } else {
+        nodes_[node.prev].next = node.next;
+    }
+    if (node.next != kNil) {
+        nodes_[node.next].prev = node.prev;
+    }
+    if (slots_[node.slot] == kNil) {
+        SetOccupied(node.slot, false);
+    }
+}
+
+uint32_t TimerManager::Detach(size_t slot){
+    const auto head = slots_[slot];
+    slots_[slot] = kNil;
+    SetOccupied(slot, false);
+    return head;
+}
+
+void TimerManager::FreeNode(uint32_t index){
+    auto& node = nodes_[index];
+    node.slot = kNoSlot;
+    ++node.generation;
+    node.next = free_head_;
+    free_head_ = index;
+    --num_timers_;
+}
+
+void TimerManager::Cascade(int level, size_t index, unsigned long base){
+    auto i = Detach(SlotIndex(level, index));
+    while (i != kNil) {
+        const auto next = nodes_[i].next;
+        Link(i, base);
+        i = next;
+    }
+}
+
+void TimerManager::SetOccupied(size_t slot, bool occupied){
+    const uint64_t bit = 1ul << (slot % 64);
+    if (occupied) {
+        occupied_[slot / 64] |= bit;
+    } else {
+        occupied_[slot / 64] &= ~bit;
+    }
+}
+
+int TimerManager::FindOccupied(int level, size_t start) const {
+    const size_t first_slot = SlotIndex(level, 0);
+    const int num_slots = level == 0 ? kRootSlots : kLevelSlots;
+    for (int distance = 0; distance < num_slots; ) {
+        const size_t i = (start + distance) % num_slots;
+        const uint64_t bits = occupied_[(first_slot + i) / 64] >> (i % 64);
+        if (bits) {
+            const int found = distance + __builtin_ctzl(bits);
+            if (found < num_slots) {
+                return found;
+            }
+        }
+        distance += 64 - i % 64;
+    }
+    return -1;
+}
+
+void TimerManager::Rearm(){
+    if (arm_ == nullptr) {
+        return;
+    }
+    const auto deadline = NextEventTick(tick_ + 1);
+    if (deadline < armed_deadline_) {
+        armed_deadline_ = deadline;
+        arm_(deadline);
     }
 }
 
 TimerManager* timer_manager;
 unsigned long lapic_timer_freq;
 
+void StartTimerPolling(TimerPollFunc* poll) {
+    __asm__("cli");
+    timer_poll = poll;
+    timer_manager->AddTimer(Timer{timer_manager->CurrentTick() + kPollTimerPeriod,
+                                  kPollTimerValue});
+    __asm__("sti");
+}
+
 void LAPICTimerOnInterrupt() {
-    timer_manager->Tick();
+    const bool task_timer_timeout = timer_manager->OnInterrupt();
+    if (timer_poll) {
+        timer_poll();
+    }
+    while (!timer_msgs->empty()) {
+        task_manager->SendMessage(1, timer_msgs->front());
+        timer_msgs->pop_front();
+    }
+    NotifyEndOfInterrupt();
+
+    if (task_timer_timeout) {
+        task_manager->OnTaskTimerTimeout();
+    } else {
+        task_manager->PreemptIfNeeded();
+    }
 }
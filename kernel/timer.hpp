@@ -1,11 +1,13 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
-#include <queue>
-#include <vector>
-#include "interrupt.hpp"
+#include <deque>
+#include <limits>
+#include "error.hpp"
+#include "message.hpp"
 
-void InitializeLAPICTimer(std::deque<Message>& msg_queue);
+void InitializeLAPICTimer();
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
@@ -21,23 +23,164 @@ private:
     int value_;
 };
 
+/** @brief AddTimer が返すタイマの識別子．CancelTimer に渡すと登録を取り消せる． */
+struct TimerHandle {
+    uint32_t index;
+    uint32_t generation;
+};
+
+const TimerHandle kNullTimerHandle{std::numeric_limits<uint32_t>::max(), 0};
+
+/** @brief 階層型タイミングホイールでタイマを管理するクラス．
+ *
+ * 5 段のホイール（256, 64, 64, 64, 64 スロット）にタイマを振り分ける．
+ * 満了まで 256 ティック未満のタイマは最下段に，それより先のものは上段に置き，
+ * 下段が一周するたびに上段の 1 スロット分を下段へ移し替える（カスケード）．
+ * 登録・取り消し・満了処理はタイマの数によらず O(1) で済む．
+ *
+ * タイマの実体は固定長のプールから確保するので，割り込みハンドラから
+ * 呼ばれる Tick の中でヒープを使うことはない．
+ *
+ * clock と arm を与えるとティックレスモードで動作する．現在時刻は clock で
+ * 求め，次に処理すべきティックが決まるたびに arm でその時刻の割り込みを
+ * 予約する．どちらも与えなければ Tick を呼ぶたびに 1 ティック進む．
+ */
 class TimerManager {
 public:
-    TimerManager(std::deque<Message>& msg_queue);
-    void AddTimer(const Timer& timer);
-    void Tick();
-    unsigned long CurrentTick() const { return tick_; }
+    /** @brief 同時に登録できるタイマの最大数 */
+    static const size_t kMaxTimers = 16384;
+    /** @brief 処理すべきタイマが無いことを表す時刻 */
+    static const unsigned long kNoDeadline = std::numeric_limits<unsigned long>::max();
+
+    /** @brief 現在のティックを返す関数 */
+    using ClockFunc = unsigned long ();
+    /** @brief 指定したティックに割り込みを予約する関数．kNoDeadline なら解除する． */
+    using ArmFunc = void (unsigned long deadline);
+
+    TimerManager(std::deque<Message>& msg_queue,
+                 ClockFunc* clock = nullptr, ArmFunc* arm = nullptr);
+    /** @brief タイマを登録する．プールが一杯なら Error::kFull を返す． */
+    WithError<TimerHandle> AddTimer(const Timer& timer);
+    /** @brief 登録済みのタイマを取り消す．
+     *
+     * 既に満了した，あるいは取り消し済みのタイマなら Error::kTimerNotFound を返す．
+     */
+    Error CancelTimer(TimerHandle handle);
+    /** @brief 1 ティック進め，満了したタイマを処理する．
+     *
+     * @return タスク切り替え用のタイマが満了したら true．
+     */
+    bool Tick();
+    /** @brief 指定したティックまで進め，その間に満了したタイマを処理する．
+     *
+     * タイマが無いスロットは飛ばすので，長時間眠った後でも処理は軽い．
+     *
+     * @return タスク切り替え用のタイマが満了したら true．
+     */
+    bool AdvanceTo(unsigned long tick);
+    /** @brief 現在時刻まで進め，次の割り込みを予約する．LAPIC タイマ割り込みから呼ぶ．
+     *
+     * @return タスク切り替え用のタイマが満了したら true．
+     */
+    bool OnInterrupt();
+    /** @brief 指定したティック以降で最初に処理が必要になるティックを返す． */
+    unsigned long NextEventTick(unsigned long base) const;
+    unsigned long CurrentTick() const { return clock_ ? clock_() : tick_; }
+    /** @brief 登録されていて未だ満了していないタイマの数 */
+    size_t NumTimers() const { return num_timers_; }
 
 private:
+    static const int kNumLevels = 5;
+    static const int kRootBits = 8;
+    static const int kLevelBits = 6;
+    static const size_t kRootSlots = 1u << kRootBits;
+    static const size_t kLevelSlots = 1u << kLevelBits;
+    static const size_t kNumSlots = kRootSlots + (kNumLevels - 1) * kLevelSlots;
+    static const uint32_t kNil = std::numeric_limits<uint32_t>::max();
+    static const uint16_t kNoSlot = std::numeric_limits<uint16_t>::max();
+
+    struct Node {
+        unsigned long timeout;
+        int value;
+        uint32_t prev, next;
+        uint32_t generation;
+        /** @brief 繋がれているスロットの番号．空きノードなら kNoSlot */
+        uint16_t slot;
+    };
+
+    /** @brief 処理済みのティック */
     volatile unsigned long tick_{0};
-    std::priority_queue<Timer> timers_{};
+    size_t num_timers_{0};
+    std::array<Node, kMaxTimers> nodes_;
+    /** @brief 各スロットに繋がれたノードの先頭．[0, kRootSlots) が最下段 */
+    std::array<uint32_t, kNumSlots> slots_;
+    /** @brief ノードが繋がれているスロットに対応するビットが 1 になる */
+    std::array<uint64_t, kNumSlots / 64> occupied_{};
+    uint32_t free_head_;
     std::deque<Message>& msg_queue_;
-};
 
-inline bool operator<(const Timer& lhs, const Timer& rhs){
-    return lhs.Timeout() > rhs.Timeout();
-}
+    ClockFunc* const clock_;
+    ArmFunc* const arm_;
+    /** @brief arm_ で予約済みの割り込み時刻 */
+    unsigned long armed_deadline_{kNoDeadline};
+
+    /** @brief level 段目のホイールの 1 スロットが表すティック数の log2 */
+    static int LevelShift(int level) {
+        return level == 0 ? 0 : kRootBits + (level - 1) * kLevelBits;
+    }
+    static size_t SlotIndex(int level, size_t index) {
+        return level == 0 ? index : kRootSlots + (level - 1) * kLevelSlots + index;
+    }
+    static size_t LevelIndex(int level, unsigned long tick) {
+        const auto mask = level == 0 ? kRootSlots - 1 : kLevelSlots - 1;
+        return (tick >> LevelShift(level)) & mask;
+    }
+
+    /** @brief ノードを満了時刻に応じたスロットに繋ぐ．
+     *
+     * @param base  次に処理するティック．
+     */
+    void Link(uint32_t index, unsigned long base);
+    void Unlink(uint32_t index);
+    /** @brief スロットからノードをすべて外し，外したリストの先頭を返す． */
+    uint32_t Detach(size_t slot);
+    void FreeNode(uint32_t index);
+    /** @brief level 段目の指定スロットのノードを下の段へ移し替える． */
+    void Cascade(int level, size_t index, unsigned long base);
+    void SetOccupied(size_t slot, bool occupied);
+    /** @brief level 段目で start 番から数えて最初にノードがあるスロットまでの距離．
+     *
+     * 全スロットが空なら -1 を返す．
+     */
+    int FindOccupied(int level, size_t start) const;
+    /** @brief 次の満了時刻が予約済みの時刻より早ければ予約し直す． */
+    void Rearm();
+};
 
 extern TimerManager* timer_manager;
 extern unsigned long lapic_timer_freq;
-const int kTimerFreq = 100;
+/** @brief 1 秒あたりのティック数．ティックレスなので割り込み頻度とは関係ない． */
+const int kTimerFreq = 10000;
+
+/** @brief タスクを切り替える間隔（ティック） */
+const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
+/** @brief タスク切り替え用のタイマの値．
+ *
+ * 満了してもメッセージは送らない．同じレベルに実行可能なタスクが複数あるときだけ
+ * TaskManager が登録するので，タスクが 1 つなら LAPIC タイマは周期的には鳴らない．
+ */
+const int kTaskTimerValue = std::numeric_limits<int>::min();
+
+/** @brief ポーリングの間隔（ティック）．100 µs */
+const int kPollTimerPeriod = 1;
+/** @brief ポーリング用のタイマの値．満了してもメッセージは送らず，次の周期で登録し直す． */
+const int kPollTimerValue = kTaskTimerValue + 1;
+
+using TimerPollFunc = void ();
+/** @brief LAPIC タイマ割り込みのたびに poll を呼ぶ．
+ *
+ * 割り込みが kPollTimerPeriod ごとに来るよう，ポーリング用のタイマも登録する．
+ * poll は割り込みハンドラの中で呼ばれるので，メッセージを送る程度の短い処理にする．
+ * InitializeLAPICTimer の後に呼ぶ．
+ */
+void StartTimerPolling(TimerPollFunc* poll);
@@ -6,4 +6,24 @@ namespace usb {
 
   ClassDriver::~ClassDriver() {
   }
+
+  Error ClassDriver::SetClassDescriptor(const uint8_t* desc) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error ClassDriver::OnBulkCompleted(EndpointID ep_id, const void* buf, int len) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error ClassDriver::OnBulkFailed(EndpointID ep_id) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error ClassDriver::OnBulkEndpointReset(EndpointID ep_id) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error ClassDriver::OnDeviceRemoved() {
+    return MAKE_ERROR(Error::kSuccess);
+  }
 }
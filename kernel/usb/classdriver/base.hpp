@@ -20,10 +20,31 @@ namespace usb {
 
     virtual Error Initialize() = 0;
     virtual Error SetEndpoint(const EndpointConfig& config) = 0;
+    /** インタフェースに付いたクラス特有のディスクリプタ（HID ディスクリプタなど）を渡す．
+     *
+     * 使わないドライバは実装しなくてよい．
+     */
+    virtual Error SetClassDescriptor(const uint8_t* desc);
     virtual Error OnEndpointsConfigured() = 0;
     virtual Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
                                      const void* buf, int len) = 0;
     virtual Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) = 0;
+    /** バルク転送が完了したときに呼ばれる．バルク転送を使わないドライバは実装しなくてよい． */
+    virtual Error OnBulkCompleted(EndpointID ep_id, const void* buf, int len);
+    /** バルク転送が失敗し，積んであったバルク転送がすべて取り消されたときに呼ばれる．
+     *
+     * ep_id は失敗したエンドポイント．ホスト側のエンドポイントは使える状態に戻っているが，
+     * デバイス側の STALL を解くのはドライバの仕事．
+     */
+    virtual Error OnBulkFailed(EndpointID ep_id);
+    /** Device::ResetBulkEndpoint でホスト側のデータトグルを戻し終えたときに呼ばれる． */
+    virtual Error OnBulkEndpointReset(EndpointID ep_id);
+    /** デバイスが外れ，このドライバが破棄される直前に呼ばれる．
+     *
+     * 未完了の転送は xHC が既に止めており，完了通知は来ない．
+     * 溜めている要求の失敗を知らせるなど，後片付けをする．
+     */
+    virtual Error OnDeviceRemoved();
 
     /** このクラスドライバを保持する USB デバイスを返す． */
     Device* ParentDevice() const { return dev_; }
@@ -1,7 +1,10 @@
 #include "usb/classdriver/hid.hpp"
 
 #include <algorithm>
+#include "usb/descriptor.hpp"
 #include "usb/device.hpp"
+#include "usb/xhci/xhci.hpp"
+#include "clock.hpp"
 #include "logger.hpp"
 
 namespace usb {
@@ -18,24 +21,50 @@ namespace usb {
   Error HIDBaseDriver::SetEndpoint(const EndpointConfig& config) {
     if (config.ep_type == EndpointType::kInterrupt && config.ep_id.IsIn()) {
       ep_interrupt_in_ = config.ep_id;
+      ep_max_packet_size_ = config.max_packet_size;
     } else if (config.ep_type == EndpointType::kInterrupt && !config.ep_id.IsIn()) {
       ep_interrupt_out_ = config.ep_id;
     }
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  Error HIDBaseDriver::SetClassDescriptor(const uint8_t* desc) {
+    auto hid_desc = DescriptorDynamicCast<HIDDescriptor>(desc);
+    if (hid_desc == nullptr) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    for (size_t i = 0; i < hid_desc->num_descriptors; ++i) {
+      auto class_desc = hid_desc->GetClassDescriptor(i);
+      if (class_desc->descriptor_type == descriptor_type::kReport) {
+        report_desc_length_ = class_desc->descriptor_length;
+      }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
   Error HIDBaseDriver::OnEndpointsConfigured() {
+    if (report_desc_length_ == 0 ||
+        report_desc_length_ > static_cast<int>(report_desc_buf_.size())) {
+      // 途中で切れたディスクリプタは解析できないので，最初からブートプロトコルを使う
+      Log(kWarn, "HID report descriptor: %d bytes, using boot protocol\n",
+          report_desc_length_);
+      initialize_phase_ = 2;
+      return SetProtocol();
+    }
+
+    // 先にレポートディスクリプタを読み，ドライバが扱える形式ならレポートプロトコルを使う
     SetupData setup_data{};
-    setup_data.request_type.bits.direction = request_type::kOut;
-    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.direction = request_type::kIn;
+    setup_data.request_type.bits.type = request_type::kStandard;
     setup_data.request_type.bits.recipient = request_type::kInterface;
-    setup_data.request = request::kSetProtocol;
-    setup_data.value = 0; // boot protocol
+    setup_data.request = request::kGetDescriptor;
+    setup_data.value = descriptor_type::kReport << 8;
     setup_data.index = interface_index_;
-    setup_data.length = 0;
+    setup_data.length = report_desc_length_;
 
     initialize_phase_ = 1;
-    return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+    return ParentDevice()->ControlIn(kDefaultControlPipeID, setup_data,
+                                     report_desc_buf_.data(), report_desc_length_, this);
   }
 
   Error HIDBaseDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
@@ -43,8 +72,31 @@ namespace usb {
     Log(kDebug, "HIDBaseDriver::OnControlCompleted: dev %08x, phase = %d, len = %d\n",
         this, initialize_phase_, len);
     if (initialize_phase_ == 1) {
+      if (auto err = layout_.Parse(report_desc_buf_.data(), len)) {
+        Log(kWarn, "HID report descriptor: %s, using boot protocol\n", err.Name());
+      } else {
+        report_protocol_ = OnReportLayoutParsed(layout_);
+      }
+      Log(kDebug, "HID: %d input fields, max report %d bytes, %s protocol\n",
+          layout_.NumFields(), layout_.MaxInputReportBytes(),
+          report_protocol_ ? "report" : "boot");
+
       initialize_phase_ = 2;
-      return ParentDevice()->InterruptIn(ep_interrupt_in_, buf_.data(), in_packet_size_);
+      return SetProtocol();
+    } else if (initialize_phase_ == 2) {
+      initialize_phase_ = 3;
+      if (report_protocol_) {
+        // レポートプロトコルのレポートはブートプロトコルより長いことがある
+        in_packet_size_ = std::min<int>(
+            std::max(ep_max_packet_size_, layout_.MaxInputReportBytes()), kBufferSize);
+      }
+      for (auto& in_buf : in_bufs_) {
+        if (auto err = ParentDevice()->InterruptIn(
+              ep_interrupt_in_, in_buf.data(), in_packet_size_)) {
+          return err;
+        }
+      }
+      return MAKE_ERROR(Error::kSuccess);
     }
 
     return MAKE_ERROR(Error::kNotImplemented);
@@ -52,12 +104,34 @@ namespace usb {
 
   Error HIDBaseDriver::OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) {
     if (ep_id.IsIn()) {
+      // レポートを取り出したら，処理する前に同じバッファを積み直す
+      auto in_buf = reinterpret_cast<uint8_t*>(const_cast<void*>(buf));
+      report_timestamp_ = xhci::CurrentEventSeenCounter();
+      if (report_timestamp_ == 0) {
+        report_timestamp_ = Clock::ReadCounter();
+      }
+      data_len_ = std::min<size_t>(len, kBufferSize);
+      std::copy_n(in_buf, data_len_, buf_.begin());
+      auto err = ParentDevice()->InterruptIn(ep_interrupt_in_, in_buf, in_packet_size_);
+
       OnDataReceived();
       std::copy_n(buf_.begin(), len, previous_buf_.begin());
-      return ParentDevice()->InterruptIn(ep_interrupt_in_, buf_.data(), in_packet_size_);
+      return err;
     }
 
     return MAKE_ERROR(Error::kNotImplemented);
   }
+
+  Error HIDBaseDriver::SetProtocol() {
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kOut;
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient = request_type::kInterface;
+    setup_data.request = request::kSetProtocol;
+    setup_data.value = report_protocol_ ? 1 : 0;
+    setup_data.index = interface_index_;
+    setup_data.length = 0;
+    return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+  }
 }
 
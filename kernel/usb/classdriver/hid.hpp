@@ -7,6 +7,7 @@
 #pragma once
 
 #include "usb/classdriver/base.hpp"
+#include "usb/classdriver/hidreport.hpp"
 
 namespace usb {
   class HIDBaseDriver : public ClassDriver {
@@ -14,23 +15,66 @@ namespace usb {
     HIDBaseDriver(Device* dev, int interface_index, int in_packet_size);
     Error Initialize() override;
     Error SetEndpoint(const EndpointConfig& config) override;
+    /** @brief HID ディスクリプタからレポートディスクリプタのバイト数を読む */
+    Error SetClassDescriptor(const uint8_t* desc) override;
     Error OnEndpointsConfigured() override;
     Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
                              const void* buf, int len) override;
     Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) override;
 
+    /** @brief レポートを 1 つ受け取るたびに呼ばれる．レポートは Buffer() にある． */
     virtual Error OnDataReceived() = 0;
+    /** @brief レポートディスクリプタを解析できたときに呼ばれる．
+     *
+     * ドライバは必要な値の位置を layout から引いて覚えておく．
+     * layout はドライバが生きている間有効．
+     *
+     * @return レポートプロトコルで動くなら true．false ならブートプロトコルを使う．
+     */
+    virtual bool OnReportLayoutParsed(const HIDReportLayout& layout) { return false; }
     const static size_t kBufferSize = 1024;
+    /** @brief インタラプト IN エンドポイントに同時に積んでおく転送の数 */
+    const static size_t kNumInFlight = 4;
     const std::array<uint8_t, kBufferSize>& Buffer() const { return buf_; }
     const std::array<uint8_t, kBufferSize>& PreviousBuffer() const { return previous_buf_; }
+    /** @brief Buffer() にあるレポートのバイト数 */
+    int DataLength() const { return data_len_; }
+    /** @brief Buffer() にあるレポートが届いた時刻（Clock::ReadCounter の値）．
+     *
+     * 見張りのコアが xHC のイベントを最初に見つけた時刻が分かればその時刻，
+     * 分からなければレポートを受け取って処理を始めた時刻．
+     */
+    uint64_t ReportTimestamp() const { return report_timestamp_; }
+    bool IsReportProtocol() const { return report_protocol_; }
 
    private:
     EndpointID ep_interrupt_in_;
     EndpointID ep_interrupt_out_;
     const int interface_index_;
     int in_packet_size_;
+    int ep_max_packet_size_{0};
     int initialize_phase_{0};
+    bool report_protocol_{false};
 
     std::array<uint8_t, kBufferSize> buf_{}, previous_buf_{};
+    int data_len_{0};
+    uint64_t report_timestamp_{0};
+
+    /** @brief レポートディスクリプタと，それを解析した値の位置の表 */
+    std::array<uint8_t, 512> report_desc_buf_{};
+    /** @brief HID ディスクリプタにあるレポートディスクリプタのバイト数．分からなければ 0 */
+    int report_desc_length_{0};
+    HIDReportLayout layout_{};
+
+    /** @brief 積んでいる転送ごとの受信バッファ．
+     *
+     * 転送はリングに積んだ順に完了するので，完了したバッファをそのまま末尾に積み直す．
+     * 受け取ったレポートは buf_ に写してから処理するので，処理している間も
+     * kNumInFlight 個の転送が xHC に積まれたままになる．
+     */
+    std::array<std::array<uint8_t, kBufferSize>, kNumInFlight> in_bufs_{};
+
+    /** @brief report_protocol_ に従って SET_PROTOCOL を発行する */
+    Error SetProtocol();
   };
 }
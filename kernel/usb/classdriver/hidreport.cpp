@@ -0,0 +1,256 @@
+#include "usb/classdriver/hidreport.hpp"
+
+namespace {
+  // item の種類（HID 1.11 6.2.2.2）
+  const int kTypeMain = 0;
+  const int kTypeGlobal = 1;
+  const int kTypeLocal = 2;
+
+  const int kMainInput = 0x8;
+
+  const int kGlobalUsagePage = 0x0;
+  const int kGlobalLogicalMinimum = 0x1;
+  const int kGlobalLogicalMaximum = 0x2;
+  const int kGlobalReportSize = 0x7;
+  const int kGlobalReportID = 0x8;
+  const int kGlobalReportCount = 0x9;
+  const int kGlobalPush = 0xa;
+  const int kGlobalPop = 0xb;
+
+  const int kLocalUsage = 0x0;
+  const int kLocalUsageMinimum = 0x1;
+  const int kLocalUsageMaximum = 0x2;
+
+  const uint32_t kInputConstant = 1u << 0;
+  const uint32_t kInputVariable = 1u << 1;
+  const uint32_t kInputRelative = 1u << 2;
+
+  /** @brief Push で退避できる global item の状態の数 */
+  const int kMaxGlobalStack = 4;
+  /** @brief 1 つの main item に付けられる usage の数 */
+  const int kMaxUsages = 16;
+  /** @brief 使われる report ID の種類の数 */
+  const int kMaxReports = 16;
+
+  struct GlobalState {
+    uint16_t usage_page;
+    int32_t logical_minimum;
+    int32_t logical_maximum;
+    uint32_t report_size;
+    uint32_t report_count;
+    uint8_t report_id;
+  };
+
+  struct LocalState {
+    std::array<uint32_t, kMaxUsages> usages;
+    int num_usages;
+    uint32_t usage_minimum;
+    uint32_t usage_maximum;
+    bool has_range;
+  };
+
+  /** @brief レポートごとの，これまでに数えた入力レポートのビット数 */
+  struct ReportBits {
+    uint8_t report_id;
+    uint32_t bits;
+  };
+
+  uint32_t ReadUnsigned(const uint8_t* data, int size) {
+    uint32_t value = 0;
+    for (int i = size - 1; i >= 0; --i) {
+      value = (value << 8) | data[i];
+    }
+    return value;
+  }
+
+  int32_t ReadSigned(const uint8_t* data, int size) {
+    const uint32_t value = ReadUnsigned(data, size);
+    if (size == 0 || size == 4) {
+      return static_cast<int32_t>(value);
+    }
+    const uint32_t sign = 1u << (8 * size - 1);
+    return static_cast<int32_t>((value ^ sign) - sign);
+  }
+
+  /** @brief 16 ビット以下で書かれた usage に usage page を補う */
+  uint32_t ResolveUsage(uint32_t usage, uint16_t usage_page) {
+    if ((usage >> 16) == 0) {
+      return static_cast<uint32_t>(usage_page) << 16 | usage;
+    }
+    return usage;
+  }
+
+  /** @brief 変数 index 番目の値に割り当てる usage．余った値には最後の usage を使う */
+  uint32_t UsageAt(const LocalState& local, uint32_t index) {
+    if (index < static_cast<uint32_t>(local.num_usages)) {
+      return local.usages[index];
+    }
+    if (local.has_range) {
+      const uint32_t usage = local.usage_minimum + (index - local.num_usages);
+      return usage <= local.usage_maximum ? usage : local.usage_maximum;
+    }
+    return local.num_usages > 0 ? local.usages[local.num_usages - 1] : 0;
+  }
+}
+
+namespace usb {
+  Error HIDReportLayout::Parse(const uint8_t* desc, int len) {
+    num_fields_ = 0;
+    max_input_report_bytes_ = 0;
+
+    GlobalState global{};
+    std::array<GlobalState, kMaxGlobalStack> global_stack;
+    int global_stack_size = 0;
+    LocalState local{};
+    std::array<ReportBits, kMaxReports> reports{};
+    int num_reports = 0;
+
+    for (int i = 0; i < len;) {
+      const uint8_t prefix = desc[i];
+      if (prefix == 0xfe) {  // long item．中身は使わない
+        if (i + 1 >= len) {
+          return MAKE_ERROR(Error::kInvalidDescriptor);
+        }
+        i += 3 + desc[i + 1];
+        continue;
+      }
+
+      const int size = (prefix & 3u) == 3 ? 4 : (prefix & 3u);
+      const int type = (prefix >> 2) & 3u;
+      const int tag = prefix >> 4;
+      if (i + 1 + size > len) {
+        return MAKE_ERROR(Error::kInvalidDescriptor);
+      }
+      const uint8_t* data = &desc[i + 1];
+      const uint32_t value = ReadUnsigned(data, size);
+      i += 1 + size;
+
+      if (type == kTypeMain) {
+        if (tag == kMainInput) {
+          // 入力レポートごとにビット位置を数える
+          ReportBits* report = nullptr;
+          for (int r = 0; r < num_reports; ++r) {
+            if (reports[r].report_id == global.report_id) {
+              report = &reports[r];
+            }
+          }
+          if (report == nullptr) {
+            if (num_reports == kMaxReports) {
+              return MAKE_ERROR(Error::kFull);
+            }
+            report = &reports[num_reports++];
+            report->report_id = global.report_id;
+          }
+
+          const uint32_t base = report->bits + (global.report_id != 0 ? 8 : 0);
+          report->bits += global.report_size * global.report_count;
+          if (base + global.report_size * global.report_count > 0xffffu) {
+            return MAKE_ERROR(Error::kInvalidDescriptor);
+          }
+
+          if ((value & kInputConstant) == 0 &&
+              global.report_size > 0 && global.report_size <= 32) {
+            const bool is_array = (value & kInputVariable) == 0;
+            const uint32_t num_new_fields = is_array ? 1 : global.report_count;
+            if (num_fields_ + num_new_fields > kMaxFields) {
+              return MAKE_ERROR(Error::kFull);
+            }
+            for (uint32_t k = 0; k < num_new_fields; ++k) {
+              auto& field = fields_[num_fields_++];
+              field.usage = ResolveUsage(UsageAt(local, k), global.usage_page);
+              field.bit_offset = base + k * global.report_size;
+              field.bit_size = global.report_size;
+              field.report_id = global.report_id;
+              field.is_signed = global.logical_minimum < 0;
+              field.is_array = is_array;
+              field.is_relative = (value & kInputRelative) != 0;
+              field.count = is_array ? global.report_count : 1;
+            }
+          }
+        }
+        local = LocalState{};
+      } else if (type == kTypeGlobal) {
+        switch (tag) {
+        case kGlobalUsagePage: global.usage_page = value; break;
+        case kGlobalLogicalMinimum: global.logical_minimum = ReadSigned(data, size); break;
+        case kGlobalLogicalMaximum: global.logical_maximum = ReadSigned(data, size); break;
+        case kGlobalReportSize: global.report_size = value; break;
+        case kGlobalReportID: global.report_id = value; break;
+        case kGlobalReportCount: global.report_count = value; break;
+        case kGlobalPush:
+          if (global_stack_size == kMaxGlobalStack) {
+            return MAKE_ERROR(Error::kFull);
+          }
+          global_stack[global_stack_size++] = global;
+          break;
+        case kGlobalPop:
+          if (global_stack_size == 0) {
+            return MAKE_ERROR(Error::kInvalidDescriptor);
+          }
+          global = global_stack[--global_stack_size];
+          break;
+        }
+      } else if (type == kTypeLocal) {
+        // 4 バイトの usage は usage page を含む．それ以外は main item の時点の page を使う
+        const uint32_t usage = size == 4 ? value : value & 0xffffu;
+        switch (tag) {
+        case kLocalUsage:
+          if (local.num_usages < kMaxUsages) {
+            local.usages[local.num_usages++] = usage;
+          }
+          break;
+        case kLocalUsageMinimum:
+          local.usage_minimum = usage;
+          local.has_range = true;
+          break;
+        case kLocalUsageMaximum:
+          local.usage_maximum = usage;
+          local.has_range = true;
+          break;
+        }
+      }
+    }
+
+    for (int r = 0; r < num_reports; ++r) {
+      const int bytes = (reports[r].bits + 7) / 8 + (reports[r].report_id != 0 ? 1 : 0);
+      if (bytes > max_input_report_bytes_) {
+        max_input_report_bytes_ = bytes;
+      }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  const HIDField* HIDReportLayout::Find(uint16_t usage_page, uint16_t usage) const {
+    const uint32_t full_usage = static_cast<uint32_t>(usage_page) << 16 | usage;
+    for (int i = 0; i < num_fields_; ++i) {
+      if (!fields_[i].is_array && fields_[i].usage == full_usage) {
+        return &fields_[i];
+      }
+    }
+    return nullptr;
+  }
+
+  int32_t ExtractHIDField(const uint8_t* report, int len, const HIDField& field) {
+    if (field.report_id != 0 && (len < 1 || report[0] != field.report_id)) {
+      return 0;
+    }
+    const int first_byte = field.bit_offset / 8;
+    const int last_byte = (field.bit_offset + field.bit_size - 1) / 8;
+    if (field.bit_size == 0 || last_byte >= len) {
+      return 0;
+    }
+
+    uint64_t bits = 0;
+    for (int i = last_byte; i >= first_byte; --i) {
+      bits = (bits << 8) | report[i];
+    }
+    bits >>= field.bit_offset % 8;
+    const uint64_t mask = (uint64_t{1} << field.bit_size) - 1;
+    bits &= mask;
+
+    if (field.is_signed && (bits >> (field.bit_size - 1)) & 1) {
+      bits |= ~mask;
+    }
+    return static_cast<int32_t>(bits);
+  }
+}
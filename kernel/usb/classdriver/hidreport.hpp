@@ -0,0 +1,78 @@
+/**
+ * @file usb/classdriver/hidreport.hpp
+ *
+ * HID レポートディスクリプタの解析と，レポートからの値の取り出し．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include "error.hpp"
+
+namespace usb {
+  namespace hid_usage {
+    const uint16_t kPageGenericDesktop = 0x01;
+    const uint16_t kPageKeyboard = 0x07;
+    const uint16_t kPageButton = 0x09;
+
+    const uint16_t kX = 0x30;
+    const uint16_t kY = 0x31;
+    const uint16_t kWheel = 0x38;
+  }
+
+  /** @brief 入力レポートの中の 1 つの値の位置と形式 */
+  struct HIDField {
+    /** @brief 上位 16 ビットが usage page，下位 16 ビットが usage ID．配列なら usage minimum */
+    uint32_t usage;
+    /** @brief レポート先頭（report ID のバイトを含む）からのビット位置 */
+    uint16_t bit_offset;
+    uint8_t bit_size;
+    /** @brief この値を含むレポートの ID．report ID を使わないディスクリプタなら 0 */
+    uint8_t report_id;
+    /** @brief logical minimum が負なら true．取り出すときに符号拡張する */
+    bool is_signed;
+    /** @brief 配列（押されているキーの usage を並べるもの）なら true．要素数は count */
+    bool is_array;
+    /** @brief 前回からの変化量（Relative）なら true，位置そのもの（Absolute）なら false */
+    bool is_relative;
+    uint8_t count;
+  };
+
+  /** @brief レポートディスクリプタを解析した結果．入力レポートの値の位置の表．
+   *
+   * 解析はデバイスの設定時に 1 度だけ行い，レポートを受け取るたびには
+   * この表を引いて ExtractHIDField で値を取り出す．
+   */
+  class HIDReportLayout {
+   public:
+    static const size_t kMaxFields = 64;
+
+    /** @brief レポートディスクリプタを解析する．
+     *
+     * Input の main item だけを表にする．Output と Feature はビット位置を数えない．
+     *
+     * @return 解析できなければ kInvalidDescriptor．表が足りなければ kFull．
+     */
+    Error Parse(const uint8_t* desc, int len);
+
+    /** @brief usage_page の usage を持つ値を探す．無ければ nullptr */
+    const HIDField* Find(uint16_t usage_page, uint16_t usage) const;
+
+    int NumFields() const { return num_fields_; }
+    const HIDField& FieldAt(int index) const { return fields_[index]; }
+    /** @brief 入力レポートの最大のバイト数（report ID のバイトを含む） */
+    int MaxInputReportBytes() const { return max_input_report_bytes_; }
+
+   private:
+    std::array<HIDField, kMaxFields> fields_{};
+    int num_fields_{0};
+    int max_input_report_bytes_{0};
+  };
+
+  /** @brief report から field の値を取り出す．
+   *
+   * report ID が一致しない，またはレポートが短くて値を含まなければ 0 を返す．
+   */
+  int32_t ExtractHIDField(const uint8_t* report, int len, const HIDField& field);
+}
@@ -0,0 +1,315 @@
+#include "usb/classdriver/hub.hpp"
+
+#include <algorithm>
+#include "timer.hpp"
+#include "usb/memory.hpp"
+#include "usb/device.hpp"
+#include "logger.hpp"
+
+namespace {
+  // ハブのポートの機能選択子（USB 2.0 Table 11-17）
+  const uint16_t kPortReset = 4;
+  const uint16_t kPortPower = 8;
+  const uint16_t kCPortConnection = 16;
+  const uint16_t kCPortReset = 20;
+
+  /** @brief リセットの終わったポートのデバイスが要求に応えられるようになるまでの時間（TRSTRCY） */
+  const int kResetRecoveryMilliseconds = 10;
+
+  /** @brief タイマを使っているハブ．添字はタイマの値から HubDriver::kTimerValueBase を引いたもの */
+  std::array<usb::HubDriver*, usb::HubDriver::kMaxHubs> timer_hubs{};
+
+  // wPortStatus のビット
+  const uint16_t kStatusConnection = 1u << 0;
+  const uint16_t kStatusEnable = 1u << 1;
+  const uint16_t kStatusLowSpeed = 1u << 9;
+  const uint16_t kStatusHighSpeed = 1u << 10;
+
+  usb::SetupData MakePortRequest(int direction, int request, uint16_t value,
+                                 int port, uint16_t length) {
+    usb::SetupData setup_data{};
+    setup_data.request_type.bits.direction = direction;
+    setup_data.request_type.bits.type = usb::request_type::kClass;
+    setup_data.request_type.bits.recipient = usb::request_type::kOther;
+    setup_data.request = request;
+    setup_data.value = value;
+    setup_data.index = port;
+    setup_data.length = length;
+    return setup_data;
+  }
+}
+
+namespace usb {
+  HubDriver::HubDriver(Device* dev, int interface_index)
+      : ClassDriver{dev}, interface_index_{interface_index} {
+    for (size_t i = 0; i < timer_hubs.size(); ++i) {
+      if (timer_hubs[i] == nullptr) {
+        timer_hubs[i] = this;
+        timer_value_ = kTimerValueBase + i;
+        return;
+      }
+    }
+    Log(kWarn, "USB hub: more than %lu hubs, power-on and reset delays are skipped\n", kMaxHubs);
+  }
+
+  HubDriver::~HubDriver() {
+    if (timer_value_ >= 0) {
+      timer_hubs[timer_value_ - kTimerValueBase] = nullptr;
+    }
+  }
+
+  bool HubDriver::IsTimerValue(int value) {
+    return kTimerValueBase <= value && value < kTimerValueBase + static_cast<int>(kMaxHubs);
+  }
+
+  Error HubDriver::OnTimerTimeout(int value) {
+    if (!IsTimerValue(value)) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    // 待っている間に外されたハブなら何もしない
+    if (auto hub = timer_hubs[value - kTimerValueBase]) {
+      return hub->OnWaitFinished();
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void* HubDriver::operator new(size_t size) {
+    return AllocMem(sizeof(HubDriver), 64, 0);
+  }
+
+  void HubDriver::operator delete(void* ptr) noexcept {
+    FreeMem(ptr);
+  }
+
+  Error HubDriver::Initialize() {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error HubDriver::SetEndpoint(const EndpointConfig& config) {
+    if (config.ep_type == EndpointType::kInterrupt && config.ep_id.IsIn()) {
+      ep_interrupt_in_ = config.ep_id;
+      in_packet_size_ = std::min<int>(config.max_packet_size, status_change_buf_.size());
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error HubDriver::OnEndpointsConfigured() {
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kIn;
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient = request_type::kDevice;
+    setup_data.request = request::kGetDescriptor;
+    setup_data.value = static_cast<uint16_t>(HubDescriptor::kType) << 8;
+    setup_data.index = 0;
+    setup_data.length = desc_buf_.size();
+
+    phase_ = Phase::kGettingHubDescriptor;
+    control_in_flight_ = true;
+    return ParentDevice()->ControlIn(
+        kDefaultControlPipeID, setup_data, desc_buf_.data(), desc_buf_.size(), this);
+  }
+
+  Error HubDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                                      const void* buf, int len) {
+    control_in_flight_ = false;
+    const int port = setup_data.index;
+
+    switch (setup_data.request) {
+    case request::kGetDescriptor:
+      return OnHubDescriptorReceived(reinterpret_cast<const uint8_t*>(buf), len);
+    case request::kGetStatus:
+      if (len < 4) {
+        return MAKE_ERROR(Error::kBufferTooSmall);
+      }
+      return OnPortStatusReceived(
+          port,
+          port_status_buf_[0] | (port_status_buf_[1] << 8),
+          port_status_buf_[2] | (port_status_buf_[3] << 8));
+    case request::kSetFeature:
+      if (setup_data.value == kPortPower) {
+        if (++powered_ports_ < num_ports_) {
+          return SetPortFeature(powered_ports_ + 1, kPortPower);
+        }
+        // 電源を入れたポートは bPwrOn2PwrGood の間は使えない．最後のポートの分だけ待てば足りる
+        return Wait(Waiting::kPowerGood, power_on_to_power_good_ms_);
+      }
+      // リセットの完了はステータス変化エンドポイントから届く
+      return ContinueWork();
+    case request::kClearFeature: {
+      // 変化ビットを消したら状態を読み直し，残りの変化を処理する
+      const uint16_t status = port_status_buf_[0] | (port_status_buf_[1] << 8);
+      auto err = GetPortStatus(port);
+      if (setup_data.value == kCPortConnection) {
+        if (status & kStatusConnection) {
+          Log(kDebug, "USB hub: device connected to port %d\n", port);
+          if (auto notify_err = ParentDevice()->OnHubPortConnected(port)) {
+            return notify_err;
+          }
+        } else {
+          Log(kWarn, "USB hub: device on port %d was disconnected\n", port);
+          reset_requested_ports_ &= ~(1u << port);
+          if (auto notify_err = ParentDevice()->OnHubPortDisconnected(port)) {
+            return notify_err;
+          }
+        }
+      } else if (setup_data.value == kCPortReset) {
+        const bool enabled = status & kStatusEnable;
+        const PortSpeed speed =
+          (status & kStatusLowSpeed) ? PortSpeed::kLow
+          : (status & kStatusHighSpeed) ? PortSpeed::kHigh
+          : PortSpeed::kFull;
+        if (enabled) {
+          // リセットからの回復を待ってからアドレスを割り当てさせる．その間も状態の読み出しは続ける
+          reset_port_ = ResetPortState{port, speed};
+          if (auto wait_err = Wait(Waiting::kResetRecovery, kResetRecoveryMilliseconds)) {
+            return wait_err;
+          }
+        } else if (auto notify_err = ParentDevice()->OnHubPortReset(port, false, speed)) {
+          return notify_err;
+        }
+      }
+      return err;
+    }
+    default:
+      return MAKE_ERROR(Error::kNotImplemented);
+    }
+  }
+
+  Error HubDriver::OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) {
+    interrupt_in_flight_ = false;
+
+    // ビット 0 はハブ自身の変化．過電流などはここでは扱わない
+    uint32_t bitmap = 0;
+    for (int i = 0; i < std::min<int>(len, sizeof(bitmap)); ++i) {
+      bitmap |= static_cast<uint32_t>(status_change_buf_[i]) << (8 * i);
+    }
+    const uint32_t port_mask = ((1u << num_ports_) - 1) << 1;
+    changed_ports_ |= bitmap & port_mask;
+    return ContinueWork();
+  }
+
+  Error HubDriver::ResetPort(int port) {
+    if (port < 1 || port > num_ports_) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    reset_requested_ports_ |= 1u << port;
+    return ContinueWork();
+  }
+
+  Error HubDriver::GetPortStatus(int port) {
+    control_in_flight_ = true;
+    return ParentDevice()->ControlIn(
+        kDefaultControlPipeID,
+        MakePortRequest(request_type::kIn, request::kGetStatus, 0, port,
+                        port_status_buf_.size()),
+        port_status_buf_.data(), port_status_buf_.size(), this);
+  }
+
+  Error HubDriver::SetPortFeature(int port, uint16_t feature) {
+    control_in_flight_ = true;
+    return ParentDevice()->ControlOut(
+        kDefaultControlPipeID,
+        MakePortRequest(request_type::kOut, request::kSetFeature, feature, port, 0),
+        nullptr, 0, this);
+  }
+
+  Error HubDriver::ClearPortFeature(int port, uint16_t feature) {
+    control_in_flight_ = true;
+    return ParentDevice()->ControlOut(
+        kDefaultControlPipeID,
+        MakePortRequest(request_type::kOut, request::kClearFeature, feature, port, 0),
+        nullptr, 0, this);
+  }
+
+  Error HubDriver::OnHubDescriptorReceived(const uint8_t* buf, int len) {
+    if (len < static_cast<int>(sizeof(HubDescriptor)) ||
+        buf[1] != HubDescriptor::kType) {
+      return MAKE_ERROR(Error::kInvalidDescriptor);
+    }
+    const auto hub_desc = reinterpret_cast<const HubDescriptor*>(buf);
+    num_ports_ = hub_desc->num_ports;
+    power_on_to_power_good_ms_ = 2 * hub_desc->power_on_to_power_good;
+    if (num_ports_ > kMaxPorts) {
+      Log(kWarn, "USB hub: only %d of %d ports are used\n", kMaxPorts, num_ports_);
+      num_ports_ = kMaxPorts;
+    }
+
+    if (auto err = ParentDevice()->ConfigureHub(
+          this, num_ports_, hub_desc->hub_characteristics.bits.tt_think_time)) {
+      return err;
+    }
+
+    if (num_ports_ == 0) {
+      phase_ = Phase::kRunning;
+      return ContinueWork();
+    }
+    phase_ = Phase::kPoweringPorts;
+    powered_ports_ = 0;
+    return SetPortFeature(1, kPortPower);
+  }
+
+  Error HubDriver::OnPortStatusReceived(int port, uint16_t status, uint16_t change) {
+    Log(kDebug, "USB hub: port %d status 0x%04x change 0x%04x\n", port, status, change);
+    if (change == 0) {
+      return ContinueWork();
+    }
+
+    // 変化ビット n は機能選択子 16 + n で消す
+    const int change_bit = __builtin_ctz(change);
+    return ClearPortFeature(port, kCPortConnection + change_bit);
+  }
+
+  Error HubDriver::Wait(Waiting what, int msec) {
+    waiting_ = what;
+    if (msec == 0 || timer_value_ < 0) {
+      // タイマを使えないハブは待たずに進める
+      return OnWaitFinished();
+    }
+
+    const unsigned long ticks = (static_cast<unsigned long>(msec) * kTimerFreq + 999) / 1000;
+    __asm__("cli");
+    auto timer = timer_manager->AddTimer(Timer{timer_manager->CurrentTick() + ticks, timer_value_});
+    __asm__("sti");
+    return timer.error;
+  }
+
+  Error HubDriver::OnWaitFinished() {
+    const auto what = waiting_;
+    waiting_ = Waiting::kNone;
+
+    switch (what) {
+    case Waiting::kPowerGood:
+      Log(kInfo, "USB hub: %d ports powered\n", num_ports_);
+      phase_ = Phase::kRunning;
+      return ContinueWork();
+    case Waiting::kResetRecovery:
+      return ParentDevice()->OnHubPortReset(reset_port_.port, true, reset_port_.speed);
+    default:
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+  }
+
+  Error HubDriver::ContinueWork() {
+    if (control_in_flight_ || phase_ != Phase::kRunning) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    if (reset_requested_ports_) {
+      const int port = __builtin_ctz(reset_requested_ports_);
+      reset_requested_ports_ &= ~(1u << port);
+      Log(kDebug, "USB hub: resetting port %d\n", port);
+      return SetPortFeature(port, kPortReset);
+    }
+    if (changed_ports_) {
+      const int port = __builtin_ctz(changed_ports_);
+      changed_ports_ &= ~(1u << port);
+      return GetPortStatus(port);
+    }
+    if (!interrupt_in_flight_) {
+      interrupt_in_flight_ = true;
+      return ParentDevice()->InterruptIn(
+          ep_interrupt_in_, status_change_buf_.data(), in_packet_size_);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+}
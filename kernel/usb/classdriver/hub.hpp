@@ -0,0 +1,137 @@
+/**
+ * @file usb/classdriver/hub.hpp
+ *
+ * USB hub class driver.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include "usb/classdriver/base.hpp"
+#include "usb/device.hpp"
+
+namespace usb {
+  /** @brief ハブディスクリプタ（USB 2.0 11.23.2.1）の先頭部分 */
+  struct HubDescriptor {
+    static const uint8_t kType = 0x29;
+
+    uint8_t length;                 // offset 0
+    uint8_t descriptor_type;        // offset 1
+    uint8_t num_ports;              // offset 2
+    union {
+      uint16_t data;
+      struct {
+        uint16_t power_switching_mode : 2;
+        uint16_t compound_device : 1;
+        uint16_t over_current_protection_mode : 2;
+        uint16_t tt_think_time : 2;  // 0: 8 FS bit times .. 3: 32 FS bit times
+        uint16_t port_indicators : 1;
+        uint16_t : 8;
+      } __attribute__((packed)) bits;
+    } hub_characteristics;          // offset 3
+    uint8_t power_on_to_power_good; // offset 5，2 ms 単位
+    uint8_t hub_controller_current; // offset 6
+  } __attribute__((packed));
+
+  /** @brief USB 2.0 ハブのクラスドライバ．
+   *
+   * ステータス変化エンドポイント（インタラプト IN）でポートの変化を知り，
+   * Get Port Status と Clear Port Feature で 1 ポートずつ変化を処理する．
+   * デバイスがつながったポートは，ホストコントローラ（Device::OnHubPortConnected）が
+   * デフォルトアドレスを使える順番になってから ResetPort でリセットする．
+   * ハブへのコントロール転送は同時に 1 つだけ発行する．
+   */
+  class HubDriver : public ClassDriver {
+   public:
+    /** @brief 扱える下流ポートの数．route string の 1 段は 4 ビット */
+    static const int kMaxPorts = 15;
+    /** @brief 待ち時間にタイマを使えるハブの数 */
+    static const size_t kMaxHubs = 16;
+    /** @brief ハブの待ち時間に使うタイマの値．kTimerValueBase + ハブの番号 */
+    static const int kTimerValueBase = 0x10000;
+
+    HubDriver(Device* dev, int interface_index);
+    ~HubDriver() override;
+
+    void* operator new(size_t size);
+    void operator delete(void* ptr) noexcept;
+
+    Error Initialize() override;
+    Error SetEndpoint(const EndpointConfig& config) override;
+    Error OnEndpointsConfigured() override;
+    Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                             const void* buf, int len) override;
+    Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) override;
+
+    /** @brief 下流ポート port をリセットする．リセットが終わると Device::OnHubPortReset を呼ぶ */
+    Error ResetPort(int port);
+
+    int NumPorts() const { return num_ports_; }
+
+    /** @brief value がハブの待ち時間のタイマなら true */
+    static bool IsTimerValue(int value);
+    /** @brief ハブの待ち時間のタイマが満了した．メインタスクが kTimerTimeout を受け取ったら呼ぶ */
+    static Error OnTimerTimeout(int value);
+
+   private:
+    enum class Phase {
+      kNotConfigured,
+      kGettingHubDescriptor,
+      kPoweringPorts,
+      kRunning,
+    };
+
+    EndpointID ep_interrupt_in_;
+    int in_packet_size_{1};
+    const int interface_index_;
+    Phase phase_{Phase::kNotConfigured};
+    int num_ports_{0};
+    /** @brief ポートの電源を入れてから使えるようになるまでの時間（ミリ秒） */
+    int power_on_to_power_good_ms_{0};
+
+    /** @brief タイマで待っていること．イベントの処理の中では busy wait しない */
+    enum class Waiting {
+      kNone,
+      kPowerGood,
+      kResetRecovery,
+    };
+    Waiting waiting_{Waiting::kNone};
+    /** @brief このハブのタイマの値．kMaxHubs を超えて使えなければ -1 */
+    int timer_value_{-1};
+    /** @brief リセットからの回復を待っているポート */
+    struct ResetPortState {
+      int port;
+      PortSpeed speed;
+    } reset_port_{};
+
+    /** @brief 発行中のコントロール転送があれば true */
+    bool control_in_flight_{false};
+    /** @brief ステータス変化エンドポイントに転送を積んでいれば true */
+    bool interrupt_in_flight_{false};
+    /** @brief 電源を入れ終えたポートの数 */
+    int powered_ports_{0};
+    /** @brief 状態を読むべきポートと，リセットを頼まれたポート．ビット番号がポート番号 */
+    uint32_t changed_ports_{0};
+    uint32_t reset_requested_ports_{0};
+
+    alignas(64) std::array<uint8_t, 64> desc_buf_{};
+    alignas(64) std::array<uint8_t, 4> port_status_buf_{};
+    alignas(64) std::array<uint8_t, 8> status_change_buf_{};
+
+    Error GetPortStatus(int port);
+    Error SetPortFeature(int port, uint16_t feature);
+    Error ClearPortFeature(int port, uint16_t feature);
+    Error OnHubDescriptorReceived(const uint8_t* buf, int len);
+    Error OnPortStatusReceived(int port, uint16_t status, uint16_t change);
+    /** @brief コントロール転送が空いていれば次の仕事を始める．
+     *
+     * リセットの要求，状態の読み出しの順に処理し，何も無ければ
+     * ステータス変化エンドポイントに転送を積み直す．
+     */
+    Error ContinueWork();
+    /** @brief msec ミリ秒後に OnWaitFinished を呼ぶタイマを登録する */
+    Error Wait(Waiting what, int msec);
+    Error OnWaitFinished();
+  };
+}
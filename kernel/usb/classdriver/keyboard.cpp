@@ -3,13 +3,27 @@
 #include <algorithm>
 #include "usb/memory.hpp"
 #include "usb/device.hpp"
+#include "input.hpp"
+#include "logger.hpp"
 
 namespace usb {
   HIDKeyboardDriver::HIDKeyboardDriver(Device* dev, int interface_index)
       : HIDBaseDriver{dev, interface_index, 8} {
+    auto device = RegisterInputDevice();
+    if (device.error) {
+      Log(kWarn, "HID keyboard: failed to register input device: %s\n", device.error.Name());
+    }
+    input_device_ = device.value;
+  }
+
+  HIDKeyboardDriver::~HIDKeyboardDriver() {
+    if (input_device_ >= 0) {
+      UnregisterInputDevice(input_device_);
+    }
   }
 
   Error HIDKeyboardDriver::OnDataReceived() {
+    auto err = MAKE_ERROR(Error::kSuccess);
     for (int i = 2; i < 8; ++i) {
       const uint8_t key = Buffer()[i];
       if (key == 0) {
@@ -19,9 +33,16 @@ namespace usb {
       if (std::find(prev_buf.begin() + 2, prev_buf.end(), key) != prev_buf.end()) {
         continue;
       }
-      NotifyKeyPush(Buffer()[0], key);
+
+      InputEvent event{InputEvent::kKeyPush};
+      event.timestamp = ReportTimestamp();
+      event.arg.keyboard.modifier = Buffer()[0];
+      event.arg.keyboard.keycode = key;
+      if (auto publish_err = PublishInputEvent(input_device_, event)) {
+        err = publish_err;
+      }
     }
-    return MAKE_ERROR(Error::kSuccess);
+    return err;
   }
 
   void* HIDKeyboardDriver::operator new(size_t size) {
@@ -31,17 +52,4 @@ namespace usb {
   void HIDKeyboardDriver::operator delete(void* ptr) noexcept {
     FreeMem(ptr);
   }
-
-  void HIDKeyboardDriver::SubscribeKeyPush(
-      std::function<ObserverType> observer) {
-    observers_[num_observers_++] = observer;
-  }
-
-  std::function<HIDKeyboardDriver::ObserverType> HIDKeyboardDriver::default_observer;
-
-  void HIDKeyboardDriver::NotifyKeyPush(uint8_t modifier, uint8_t keycode) {
-    for (int i = 0; i < num_observers_; ++i) {
-      observers_[i](modifier, keycode);
-    }
-  }
 }
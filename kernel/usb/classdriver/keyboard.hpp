@@ -6,27 +6,26 @@
 
 #pragma once
 
-#include <functional>
 #include "usb/classdriver/hid.hpp"
 
 namespace usb {
+  /** @brief HID キーボードのクラスドライバ．
+   *
+   * 新しく押されたキーごとに入力イベント（InputEvent::kKeyPush）を 1 つ書く．
+   */
   class HIDKeyboardDriver : public HIDBaseDriver {
    public:
     HIDKeyboardDriver(Device* dev, int interface_index);
+    /** @brief 入力デバイスの番号を返す */
+    ~HIDKeyboardDriver() override;
 
     void* operator new(size_t size);
     void operator delete(void* ptr) noexcept;
 
     Error OnDataReceived() override;
 
-    using ObserverType = void (uint8_t modifier, uint8_t keycode);
-    void SubscribeKeyPush(std::function<ObserverType> observer);
-    static std::function<ObserverType> default_observer;
-
    private:
-    std::array<std::function<ObserverType>, 4> observers_;
-    int num_observers_ = 0;
-
-    void NotifyKeyPush(uint8_t modifier, uint8_t keycode);
+    /** @brief RegisterInputDevice で得た番号．登録できなければ -1 */
+    int input_device_ = -1;
   };
 }
@@ -3,20 +3,84 @@
 #include <algorithm>
 #include "usb/memory.hpp"
 #include "usb/device.hpp"
+#include "input.hpp"
 #include "logger.hpp"
 
 namespace usb {
   HIDMouseDriver::HIDMouseDriver(Device* dev, int interface_index)
       : HIDBaseDriver{dev, interface_index, 3} {
+    auto device = RegisterInputDevice();
+    if (device.error) {
+      Log(kWarn, "HID mouse: failed to register input device: %s\n", device.error.Name());
+    }
+    input_device_ = device.value;
+  }
+
+  HIDMouseDriver::~HIDMouseDriver() {
+    if (input_device_ >= 0) {
+      UnregisterInputDevice(input_device_);
+    }
   }
 
   Error HIDMouseDriver::OnDataReceived() {
-    uint8_t buttons = Buffer()[0];
-    int8_t displacement_x = Buffer()[1];
-    int8_t displacement_y = Buffer()[2];
-    NotifyMouseMove(buttons, displacement_x, displacement_y);
-    Log(kDebug, "%02x,(%3d,%3d)\n", buttons, displacement_x, displacement_y);
-    return MAKE_ERROR(Error::kSuccess);
+    uint8_t buttons = 0;
+    int displacement_x, displacement_y, wheel = 0;
+    if (IsReportProtocol()) {
+      const uint8_t* report = Buffer().data();
+      const int len = DataLength();
+      if (x_field_->report_id != 0 && (len < 1 || report[0] != x_field_->report_id)) {
+        // 移動量を含まないレポート
+        return MAKE_ERROR(Error::kSuccess);
+      }
+      for (size_t i = 0; i < button_fields_.size(); ++i) {
+        if (button_fields_[i] && ExtractHIDField(report, len, *button_fields_[i])) {
+          buttons |= 1u << i;
+        }
+      }
+      displacement_x = ExtractHIDField(report, len, *x_field_);
+      displacement_y = ExtractHIDField(report, len, *y_field_);
+      if (wheel_field_) {
+        wheel = ExtractHIDField(report, len, *wheel_field_);
+      }
+    } else {
+      buttons = Buffer()[0];
+      displacement_x = static_cast<int8_t>(Buffer()[1]);
+      displacement_y = static_cast<int8_t>(Buffer()[2]);
+    }
+    Log(kDebug, "%02x,(%3d,%3d),%d\n", buttons, displacement_x, displacement_y, wheel);
+
+    InputEvent event{InputEvent::kMouseMove};
+    event.timestamp = ReportTimestamp();
+    event.arg.mouse.buttons = buttons;
+    event.arg.mouse.displacement_x = displacement_x;
+    event.arg.mouse.displacement_y = displacement_y;
+    event.arg.mouse.wheel = wheel;
+    return PublishInputEvent(input_device_, event);
+  }
+
+  bool HIDMouseDriver::OnReportLayoutParsed(const HIDReportLayout& layout) {
+    x_field_ = layout.Find(hid_usage::kPageGenericDesktop, hid_usage::kX);
+    y_field_ = layout.Find(hid_usage::kPageGenericDesktop, hid_usage::kY);
+    if (x_field_ == nullptr || y_field_ == nullptr ||
+        x_field_->report_id != y_field_->report_id) {
+      return false;
+    }
+    if (!x_field_->is_relative || !y_field_->is_relative) {
+      // タブレットなどの絶対座標は移動量として扱えないので，ブートプロトコルに任せる
+      return false;
+    }
+
+    // 移動量と別のレポートにある値は使わない
+    const auto report_id = x_field_->report_id;
+    auto find_in_report = [&](uint16_t usage_page, uint16_t usage) -> const HIDField* {
+      auto field = layout.Find(usage_page, usage);
+      return field && field->report_id == report_id ? field : nullptr;
+    };
+    wheel_field_ = find_in_report(hid_usage::kPageGenericDesktop, hid_usage::kWheel);
+    for (size_t i = 0; i < button_fields_.size(); ++i) {
+      button_fields_[i] = find_in_report(hid_usage::kPageButton, i + 1);
+    }
+    return true;
   }
 
   void* HIDMouseDriver::operator new(size_t size) {
@@ -26,18 +90,4 @@ namespace usb {
   void HIDMouseDriver::operator delete(void* ptr) noexcept {
     FreeMem(ptr);
   }
-
-  void HIDMouseDriver::SubscribeMouseMove(
-      std::function<ObserverType> observer) {
-    observers_[num_observers_++] = observer;
-  }
-
-
-  std::function<HIDMouseDriver::ObserverType> HIDMouseDriver::default_observer;
-
-  void HIDMouseDriver::NotifyMouseMove(uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
-    for (int i = 0; i < num_observers_; ++i) {
-      observers_[i](buttons, displacement_x, displacement_y);
-    }
-  }
 }
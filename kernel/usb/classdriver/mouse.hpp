@@ -6,27 +6,35 @@
 
 #pragma once
 
-#include <functional>
 #include "usb/classdriver/hid.hpp"
 
 namespace usb {
+  /** @brief HID マウスのクラスドライバ．
+   *
+   * レポートを受け取るたびに入力イベント（InputEvent::kMouseMove）を 1 つ書く．
+   * 移動量はレポートの値そのまま（ブートプロトコルなら 8 ビット，それ以外は最大 32 ビット）．
+   */
   class HIDMouseDriver : public HIDBaseDriver {
    public:
     HIDMouseDriver(Device* dev, int interface_index);
+    /** @brief 入力デバイスの番号を返す */
+    ~HIDMouseDriver() override;
 
     void* operator new(size_t size);
     void operator delete(void* ptr) noexcept;
 
     Error OnDataReceived() override;
-
-    using ObserverType = void (uint8_t buttons, int8_t displacement_x, int8_t displacement_y);
-    void SubscribeMouseMove(std::function<ObserverType> observer);
-    static std::function<ObserverType> default_observer;
+    /** @brief X と Y があればレポートプロトコルを使う．ボタンは 8 個まで，ホイールは任意 */
+    bool OnReportLayoutParsed(const HIDReportLayout& layout) override;
 
    private:
-    std::array<std::function<ObserverType>, 4> observers_;
-    int num_observers_ = 0;
-
-    void NotifyMouseMove(uint8_t buttons, int8_t displacement_x, int8_t displacement_y);
+    /** @brief RegisterInputDevice で得た番号．登録できなければ -1 */
+    int input_device_ = -1;
+
+    /** @brief レポートプロトコルで使う値の位置．無いものは nullptr */
+    const HIDField* x_field_ = nullptr;
+    const HIDField* y_field_ = nullptr;
+    const HIDField* wheel_field_ = nullptr;
+    std::array<const HIDField*, 8> button_fields_{};
   };
 }
@@ -0,0 +1,336 @@
+#include "usb/classdriver/msc.hpp"
+
+#include <cstring>
+#include "usb/memory.hpp"
+#include "usb/device.hpp"
+#include "logger.hpp"
+
+namespace {
+  const uint8_t kSCSIReadCapacity10 = 0x25;
+  const uint8_t kSCSIRead10 = 0x28;
+  /** @brief Bulk-Only Mass Storage Reset（クラス固有のリクエスト） */
+  const int kBulkOnlyMassStorageReset = 0xff;
+  /** @brief CLEAR_FEATURE で解くフィーチャ */
+  const int kEndpointHalt = 0;
+  /** @brief 起動直後の UNIT ATTENTION などで失敗した READ CAPACITY をやり直す回数 */
+  const int kMaxCapacityRetries = 3;
+
+  uint32_t ReadBE32(const uint8_t* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16)
+      | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+  }
+
+  void WriteBE32(uint8_t* p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+  }
+}
+
+namespace usb {
+  MassStorageDriver::MassStorageDriver(Device* dev, int interface_index)
+      : ClassDriver{dev}, interface_index_{interface_index} {
+  }
+
+  void* MassStorageDriver::operator new(size_t size) {
+    return AllocMem(sizeof(MassStorageDriver), 64, 0);
+  }
+
+  void MassStorageDriver::operator delete(void* ptr) noexcept {
+    FreeMem(ptr);
+  }
+
+  Error MassStorageDriver::Initialize() {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error MassStorageDriver::SetEndpoint(const EndpointConfig& config) {
+    if (config.ep_type == EndpointType::kBulk && config.ep_id.IsIn()) {
+      ep_bulk_in_ = config.ep_id;
+    } else if (config.ep_type == EndpointType::kBulk && !config.ep_id.IsIn()) {
+      ep_bulk_out_ = config.ep_id;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error MassStorageDriver::OnEndpointsConfigured() {
+    phase_ = Phase::kReadingCapacity;
+    capacity_retries_ = 0;
+    return ReadCapacity();
+  }
+
+  Error MassStorageDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                                              const void* buf, int len) {
+    if (!recovering_) {
+      return MAKE_ERROR(Error::kNotImplemented);
+    }
+
+    // Reset Recovery は Mass Storage Reset，Bulk-In の HALT 解除，Bulk-Out の HALT 解除の順．
+    // HALT を解いたエンドポイントはホスト側も戻し，OnBulkEndpointReset で次に進む
+    if (setup_data.request == kBulkOnlyMassStorageReset) {
+      return AbandonRecoveryIfFailed(ClearEndpointHalt(ep_bulk_in_));
+    }
+    if (setup_data.request == request::kClearFeature) {
+      const EndpointID ep_id =
+        (setup_data.index & 0x80u) ? ep_bulk_in_ : ep_bulk_out_;
+      return AbandonRecoveryIfFailed(ParentDevice()->ResetBulkEndpoint(ep_id));
+    }
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+
+  Error MassStorageDriver::OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error MassStorageDriver::OnBulkCompleted(EndpointID ep_id, const void* buf, int len) {
+    if (!ep_id.IsIn()) {
+      // CBW を送り終えた．データと CSW の TD は既に積んである
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    if (buf != &csw_) {
+      data_received_ = len;
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    return OnCommandCompleted();
+  }
+
+  Error MassStorageDriver::OnBulkFailed(EndpointID ep_id) {
+    // 積んであった TD はすべて捨てられた．デバイスは CBW を待つ状態に戻すまで使えない
+    command_in_flight_ = false;
+    recovering_ = true;
+
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kOut;
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient = request_type::kInterface;
+    setup_data.request = kBulkOnlyMassStorageReset;
+    setup_data.value = 0;
+    setup_data.index = interface_index_;
+    setup_data.length = 0;
+    auto err = ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+
+    if (phase_ == Phase::kReady && num_requests_ > 0) {
+      const Request req = requests_[head_];
+      head_ = (head_ + 1) % kMaxRequests;
+      --num_requests_;
+      if (req.callback) {
+        req.callback(req.arg, MAKE_ERROR(Error::kTransferFailed), 0);
+      }
+    }
+    return AbandonRecoveryIfFailed(err);
+  }
+
+  Error MassStorageDriver::OnBulkEndpointReset(EndpointID ep_id) {
+    if (!recovering_) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    if (ep_id.IsIn()) {
+      return AbandonRecoveryIfFailed(ClearEndpointHalt(ep_bulk_out_));
+    }
+    recovering_ = false;
+    return OnRecovered();
+  }
+
+  Error MassStorageDriver::OnDeviceRemoved() {
+    // 以降の Read は IsReady でない扱いで断る
+    phase_ = Phase::kNotConfigured;
+    command_in_flight_ = false;
+    recovering_ = false;
+    FailAllRequests(MAKE_ERROR(Error::kPortNotConnected));
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error MassStorageDriver::Read(uint64_t lba, size_t num_blocks, void* buf,
+                                ReadCallback* callback, void* arg) {
+    if (!IsReady()) {
+      return MAKE_ERROR(Error::kNotImplemented);
+    }
+    if (lba + num_blocks > num_blocks_ || lba > 0xffffffffu ||
+        num_blocks * block_size_ > kMaxTransferBytes) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    if (num_requests_ == kMaxRequests) {
+      return MAKE_ERROR(Error::kFull);
+    }
+
+    requests_[(head_ + num_requests_) % kMaxRequests] = Request{
+      static_cast<uint32_t>(lba), static_cast<uint32_t>(num_blocks), buf, callback, arg
+    };
+    ++num_requests_;
+    if (!command_in_flight_ && !recovering_) {
+      // 積んだ要求の失敗はすべて callback で知らせる
+      if (auto err = StartNextRequest()) {
+        Log(kWarn, "MassStorageDriver: failed to start a read: %s\n", err.Name());
+      }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error MassStorageDriver::SubscribeReady(std::function<ObserverType> observer) {
+    if (num_observers_ == static_cast<int>(observers_.size())) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    observers_[num_observers_++] = observer;
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  std::function<MassStorageDriver::ObserverType> MassStorageDriver::default_observer;
+
+  Error MassStorageDriver::SendCommand(const uint8_t* cb, int cb_length,
+                                       void* buf, uint32_t len) {
+    cbw_ = CommandBlockWrapper{};
+    cbw_.signature = CommandBlockWrapper::kSignature;
+    cbw_.tag = ++tag_;
+    cbw_.data_transfer_length = len;
+    cbw_.flags = 0x80;  // 読み込みのコマンドだけを使う
+    cbw_.lun = 0;
+    cbw_.cb_length = cb_length;
+    memcpy(cbw_.cb, cb, cb_length);
+    csw_ = CommandStatusWrapper{};
+    data_received_ = 0;
+
+    if (auto err = ParentDevice()->BulkOut(ep_bulk_out_, &cbw_, sizeof(cbw_))) {
+      // 何も積んでいない
+      return err;
+    }
+    command_in_flight_ = true;
+
+    Error err = MAKE_ERROR(Error::kSuccess);
+    if (len > 0) {
+      err = ParentDevice()->BulkIn(ep_bulk_in_, buf, len);
+    }
+    if (!err) {
+      err = ParentDevice()->BulkIn(ep_bulk_in_, &csw_, sizeof(csw_));
+    }
+    if (err) {
+      // CBW は既に積んだので，デバイスは残りの段階を待っている．積んだ TD を捨てて
+      // Reset Recovery を行い，要求は OnBulkFailed で失敗させる
+      if (auto abort_err = ParentDevice()->AbortBulkTransfers(ep_bulk_out_)) {
+        command_in_flight_ = false;
+        return abort_err;
+      }
+    }
+    return err;
+  }
+
+  Error MassStorageDriver::ReadCapacity() {
+    uint8_t cb[10]{};
+    cb[0] = kSCSIReadCapacity10;
+    return SendCommand(cb, sizeof(cb), capacity_buf_.data(), capacity_buf_.size());
+  }
+
+  Error MassStorageDriver::StartNextRequest() {
+    Error err = MAKE_ERROR(Error::kSuccess);
+    // コールバックの中の Read が次のコマンドを発行したら，そちらに任せる
+    while (num_requests_ > 0 && !command_in_flight_ && !recovering_) {
+      const Request req = requests_[head_];
+      uint8_t cb[10]{};
+      cb[0] = kSCSIRead10;
+      WriteBE32(&cb[2], req.lba);
+      cb[7] = req.num_blocks >> 8;
+      cb[8] = req.num_blocks;
+      err = SendCommand(cb, sizeof(cb), req.buf, req.num_blocks * block_size_);
+      if (!err || command_in_flight_) {
+        // 発行できたか，途中まで積んだ分を OnBulkFailed が片付けて要求を失敗させる
+        return err;
+      }
+
+      // 何も積めなかったので，この要求はここで失敗させて次を試す
+      head_ = (head_ + 1) % kMaxRequests;
+      --num_requests_;
+      if (req.callback) {
+        req.callback(req.arg, err, 0);
+      }
+    }
+    return err;
+  }
+
+  Error MassStorageDriver::ClearEndpointHalt(EndpointID ep_id) {
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kOut;
+    setup_data.request_type.bits.type = request_type::kStandard;
+    setup_data.request_type.bits.recipient = request_type::kEndpoint;
+    setup_data.request = request::kClearFeature;
+    setup_data.value = kEndpointHalt;
+    setup_data.index = ep_id.Number() | (ep_id.IsIn() ? 0x80u : 0);
+    setup_data.length = 0;
+    return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+  }
+
+  Error MassStorageDriver::OnRecovered() {
+    if (phase_ == Phase::kReadingCapacity) {
+      if (++capacity_retries_ > kMaxCapacityRetries) {
+        Log(kError, "MassStorageDriver: READ CAPACITY failed after reset recovery\n");
+        return MAKE_ERROR(Error::kTransferFailed);
+      }
+      return ReadCapacity();
+    }
+    return StartNextRequest();
+  }
+
+  Error MassStorageDriver::AbandonRecoveryIfFailed(Error err) {
+    if (!err) {
+      return err;
+    }
+    Log(kError, "MassStorageDriver: reset recovery failed: %s\n", err.Name());
+    recovering_ = false;
+    FailAllRequests(MAKE_ERROR(Error::kTransferFailed));
+    return err;
+  }
+
+  void MassStorageDriver::FailAllRequests(Error err) {
+    // コールバックの中の Read が積む要求は失敗させない
+    std::array<Request, kMaxRequests> failed;
+    const size_t num_failed = num_requests_;
+    for (size_t i = 0; i < num_failed; ++i) {
+      failed[i] = requests_[(head_ + i) % kMaxRequests];
+    }
+    head_ = (head_ + num_failed) % kMaxRequests;
+    num_requests_ = 0;
+    for (size_t i = 0; i < num_failed; ++i) {
+      if (failed[i].callback) {
+        failed[i].callback(failed[i].arg, err, 0);
+      }
+    }
+  }
+
+  Error MassStorageDriver::OnCommandCompleted() {
+    command_in_flight_ = false;
+    const bool passed = csw_.signature == CommandStatusWrapper::kSignature &&
+      csw_.tag == cbw_.tag && csw_.status == 0;
+
+    if (phase_ == Phase::kReadingCapacity) {
+      if (!passed) {
+        if (++capacity_retries_ > kMaxCapacityRetries) {
+          Log(kError, "MassStorageDriver: READ CAPACITY failed (status %d)\n", csw_.status);
+          return MAKE_ERROR(Error::kTransferFailed);
+        }
+        return ReadCapacity();
+      }
+
+      num_blocks_ = static_cast<uint64_t>(ReadBE32(&capacity_buf_[0])) + 1;
+      block_size_ = ReadBE32(&capacity_buf_[4]);
+      phase_ = Phase::kReady;
+      Log(kInfo, "MassStorageDriver: %lu blocks x %u bytes\n", num_blocks_, block_size_);
+      for (int i = 0; i < num_observers_; ++i) {
+        observers_[i](this);
+      }
+      return StartNextRequest();
+    }
+
+    const Request req = requests_[head_];
+    const int received = data_received_;
+    head_ = (head_ + 1) % kMaxRequests;
+    --num_requests_;
+
+    // 次のコマンドを先に積んでから完了を通知する
+    auto err = StartNextRequest();
+    if (req.callback) {
+      req.callback(req.arg,
+                   passed ? MAKE_ERROR(Error::kSuccess) : MAKE_ERROR(Error::kTransferFailed),
+                   received);
+    }
+    return err;
+  }
+}
@@ -0,0 +1,149 @@
+/**
+ * @file usb/classdriver/msc.hpp
+ *
+ * USB mass storage (Bulk-Only Transport, SCSI) class driver.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include "usb/classdriver/base.hpp"
+
+namespace usb {
+  /** @brief Bulk-Only Transport の Command Block Wrapper */
+  struct CommandBlockWrapper {
+    static const uint32_t kSignature = 0x43425355;  // "USBC"
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_transfer_length;
+    uint8_t flags;  // ビット 7 が 1 ならデータはデバイスからホストへ
+    uint8_t lun;
+    uint8_t cb_length;
+    uint8_t cb[16];
+  } __attribute__((packed));
+
+  /** @brief Bulk-Only Transport の Command Status Wrapper */
+  struct CommandStatusWrapper {
+    static const uint32_t kSignature = 0x53425355;  // "USBS"
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_residue;
+    uint8_t status;
+  } __attribute__((packed));
+
+  /** @brief USB メモリなどのマスストレージを読むクラスドライバ．
+   *
+   * 1 つのコマンドは CBW の送信，データの受信，CSW の受信から成る．
+   * 3 つの TD は CBW を送る時点でまとめて積み，コマンドの間の往復を省く．
+   * Bulk-Only Transport は同時に 1 コマンドしか扱えないので，Read の要求は
+   * キューに溜めて順に発行する．LUN は 0 だけを使う．
+   *
+   * 転送が失敗したら実行中の要求を kTransferFailed で完了させ，Reset Recovery
+   * （Bulk-Only Mass Storage Reset と両方のバルクエンドポイントの CLEAR_FEATURE(ENDPOINT_HALT)）
+   * を済ませてから次の要求に進む．CLEAR_FEATURE でデバイス側のデータトグルが戻るので，
+   * そのたびにホスト側のエンドポイントも ResetBulkEndpoint で戻す．
+   * Reset Recovery の要求を発行できなければ，溜めている要求をすべて失敗させる．
+   */
+  class MassStorageDriver : public ClassDriver {
+   public:
+    /** @brief 読み込みの完了通知．bytes は実際に読めたバイト数 */
+    using ReadCallback = void (void* arg, Error err, size_t bytes);
+    /** @brief 容量を読み終え，Read を受け付けられるようになったときの通知 */
+    using ObserverType = void (MassStorageDriver* msc);
+
+    /** @brief 1 回の Read で読める最大のバイト数 */
+    static const size_t kMaxTransferBytes = 512 * 1024;
+    /** @brief 溜めておける Read の要求の数 */
+    static const size_t kMaxRequests = 8;
+
+    MassStorageDriver(Device* dev, int interface_index);
+
+    void* operator new(size_t size);
+    void operator delete(void* ptr) noexcept;
+
+    Error Initialize() override;
+    Error SetEndpoint(const EndpointConfig& config) override;
+    Error OnEndpointsConfigured() override;
+    Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                             const void* buf, int len) override;
+    Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) override;
+    Error OnBulkCompleted(EndpointID ep_id, const void* buf, int len) override;
+    Error OnBulkFailed(EndpointID ep_id) override;
+    Error OnBulkEndpointReset(EndpointID ep_id) override;
+    /** @brief 溜めている要求をすべて失敗させる */
+    Error OnDeviceRemoved() override;
+
+    bool IsReady() const { return phase_ == Phase::kReady; }
+    uint64_t NumBlocks() const { return num_blocks_; }
+    uint32_t BlockSize() const { return block_size_; }
+
+    /** @brief lba から num_blocks ブロックを buf へ読み込む要求を積む．
+     *
+     * データは buf へ直接 DMA される．buf はフレーム（4 KiB）境界に揃えると
+     * TRB の数が最小になる．callback が呼ばれるまで buf を使ってはいけない．
+     * callback は xHCI のイベントを処理する中で（発行できなければこの中で）呼ばれる．
+     * 要求を積めたら，その後の失敗はエラーを返さず callback で知らせる．
+     */
+    Error Read(uint64_t lba, size_t num_blocks, void* buf,
+               ReadCallback* callback, void* arg);
+
+    /** @brief 準備ができたときに呼ぶ関数を登録する．4 つを超えたら kFull */
+    Error SubscribeReady(std::function<ObserverType> observer);
+    static std::function<ObserverType> default_observer;
+
+   private:
+    enum class Phase {
+      kNotConfigured,
+      kReadingCapacity,
+      kReady,
+    };
+
+    struct Request {
+      uint32_t lba;
+      uint32_t num_blocks;
+      void* buf;
+      ReadCallback* callback;
+      void* arg;
+    };
+
+    EndpointID ep_bulk_in_;
+    EndpointID ep_bulk_out_;
+    const int interface_index_;
+    Phase phase_{Phase::kNotConfigured};
+    int capacity_retries_{0};
+
+    uint64_t num_blocks_{0};
+    uint32_t block_size_{0};
+
+    /** @brief requests_[head_] から num_requests_ 個が未完了．先頭を発行中 */
+    std::array<Request, kMaxRequests> requests_{};
+    size_t head_{0};
+    size_t num_requests_{0};
+    bool command_in_flight_{false};
+    /** @brief Reset Recovery の制御転送やエンドポイントの設定し直しを待っている間 true */
+    bool recovering_{false};
+    uint32_t tag_{0};
+    int data_received_{0};
+
+    alignas(64) CommandBlockWrapper cbw_{};
+    alignas(64) CommandStatusWrapper csw_{};
+    alignas(64) std::array<uint8_t, 8> capacity_buf_{};
+
+    std::array<std::function<ObserverType>, 4> observers_;
+    int num_observers_ = 0;
+
+    Error SendCommand(const uint8_t* cb, int cb_length, void* buf, uint32_t len);
+    Error ReadCapacity();
+    Error StartNextRequest();
+    Error OnCommandCompleted();
+    Error ClearEndpointHalt(EndpointID ep_id);
+    /** @brief Reset Recovery を終え，中断していたコマンドの発行を再開する */
+    Error OnRecovered();
+    /** @brief err なら Reset Recovery をあきらめ，溜めている要求をすべて失敗させる．err を返す */
+    Error AbandonRecoveryIfFailed(Error err);
+    /** @brief 溜めている要求をすべて err で完了させる */
+    void FailAllRequests(Error err);
+  };
+}
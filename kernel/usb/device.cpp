@@ -3,8 +3,10 @@
 #include "usb/descriptor.hpp"
 #include "usb/setupdata.hpp"
 #include "usb/classdriver/base.hpp"
+#include "usb/classdriver/hub.hpp"
 #include "usb/classdriver/keyboard.hpp"
 #include "usb/classdriver/mouse.hpp"
+#include "usb/classdriver/msc.hpp"
 
 #include "logger.hpp"
 
@@ -54,20 +56,24 @@ namespace {
   }
 
   usb::ClassDriver* NewClassDriver(usb::Device* dev, const usb::InterfaceDescriptor& if_desc) {
+    if (if_desc.interface_class == 8 &&
+        if_desc.interface_sub_class == 6 &&  // SCSI transparent command set
+        if_desc.interface_protocol == 0x50) {  // Bulk-Only Transport
+      auto msc_driver = new usb::MassStorageDriver{dev, if_desc.interface_number};
+      if (usb::MassStorageDriver::default_observer) {
+        msc_driver->SubscribeReady(usb::MassStorageDriver::default_observer);
+      }
+      return msc_driver;
+    }
+    if (if_desc.interface_class == 9) {  // hub
+      return new usb::HubDriver{dev, if_desc.interface_number};
+    }
     if (if_desc.interface_class == 3 &&
         if_desc.interface_sub_class == 1) {  // HID boot interface
       if (if_desc.interface_protocol == 1) {  // keyboard
-        auto keyboard_driver = new usb::HIDKeyboardDriver{dev, if_desc.interface_number};
-        if (usb::HIDKeyboardDriver::default_observer) {
-          keyboard_driver->SubscribeKeyPush(usb::HIDKeyboardDriver::default_observer);
-        }
-        return keyboard_driver;
+        return new usb::HIDKeyboardDriver{dev, if_desc.interface_number};
       } else if (if_desc.interface_protocol == 2) {  // mouse
-        auto mouse_driver = new usb::HIDMouseDriver{dev, if_desc.interface_number};
-        if (usb::HIDMouseDriver::default_observer) {
-          mouse_driver->SubscribeMouseMove(usb::HIDMouseDriver::default_observer);
-        }
-        return mouse_driver;
+        return new usb::HIDMouseDriver{dev, if_desc.interface_number};
       }
     }
     return nullptr;
@@ -107,7 +113,7 @@ namespace usb {
   Error Device::ControlIn(EndpointID ep_id, SetupData setup_data,
                           void* buf, int len, ClassDriver* issuer) {
     if (issuer) {
-      event_waiters_.Put(setup_data, issuer);
+      return event_waiters_.Put(setup_data, issuer);
     }
     return MAKE_ERROR(Error::kSuccess);
   }
@@ -115,7 +121,7 @@ namespace usb {
   Error Device::ControlOut(EndpointID ep_id, SetupData setup_data,
                            const void* buf, int len, ClassDriver* issuer) {
     if (issuer) {
-      event_waiters_.Put(setup_data, issuer);
+      return event_waiters_.Put(setup_data, issuer);
     }
     return MAKE_ERROR(Error::kSuccess);
   }
@@ -128,6 +134,38 @@ namespace usb {
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  Error Device::BulkIn(EndpointID ep_id, void* buf, int len) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::BulkOut(EndpointID ep_id, const void* buf, int len) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::AbortBulkTransfers(EndpointID ep_id) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error Device::ResetBulkEndpoint(EndpointID ep_id) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error Device::ConfigureHub(HubDriver* hub, int num_ports, int think_time) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error Device::OnHubPortConnected(int port) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error Device::OnHubPortReset(int port, bool enabled, PortSpeed speed) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error Device::OnHubPortDisconnected(int port) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
   Error Device::StartInitialize() {
     is_initialized_ = false;
     initialize_phase_ = 1;
@@ -152,6 +190,7 @@ namespace usb {
         buf, len, setup_data.request_type.bits.direction);
     if (is_initialized_) {
       if (auto w = event_waiters_.Get(setup_data)) {
+        event_waiters_.Delete(setup_data);
         return w.value()->OnControlCompleted(ep_id, setup_data, buf, len);
       }
       return MAKE_ERROR(Error::kNoWaiter);
@@ -188,6 +227,49 @@ namespace usb {
     return MAKE_ERROR(Error::kNoWaiter);
   }
 
+  Error Device::OnBulkCompleted(EndpointID ep_id, const void* buf, int len) {
+    Log(kDebug, "Device::OnBulkCompleted: ep addr %d, len %d\n", ep_id.Address(), len);
+    if (auto w = class_drivers_[ep_id.Number()]) {
+      return w->OnBulkCompleted(ep_id, buf, len);
+    }
+    return MAKE_ERROR(Error::kNoWaiter);
+  }
+
+  Error Device::OnBulkFailed(EndpointID ep_id) {
+    Log(kDebug, "Device::OnBulkFailed: ep addr %d\n", ep_id.Address());
+    if (auto w = class_drivers_[ep_id.Number()]) {
+      return w->OnBulkFailed(ep_id);
+    }
+    return MAKE_ERROR(Error::kNoWaiter);
+  }
+
+  Error Device::OnBulkEndpointReset(EndpointID ep_id) {
+    if (auto w = class_drivers_[ep_id.Number()]) {
+      return w->OnBulkEndpointReset(ep_id);
+    }
+    return MAKE_ERROR(Error::kNoWaiter);
+  }
+
+  void Device::RemoveClassDrivers() {
+    for (size_t i = 0; i < class_drivers_.size(); ++i) {
+      auto class_driver = class_drivers_[i];
+      if (class_driver == nullptr) {
+        continue;
+      }
+      // 複数のエンドポイントに割り当てたドライバも 1 回だけ破棄する
+      for (size_t j = i; j < class_drivers_.size(); ++j) {
+        if (class_drivers_[j] == class_driver) {
+          class_drivers_[j] = nullptr;
+        }
+      }
+      if (auto err = class_driver->OnDeviceRemoved()) {
+        Log(kWarn, "Device::RemoveClassDrivers: %s at %s:%d\n",
+            err.Name(), err.File(), err.Line());
+      }
+      delete class_driver;
+    }
+  }
+
   Error Device::InitializePhase1(const uint8_t* buf, int len) {
     const auto device_desc = DescriptorDynamicCast<DeviceDescriptor>(buf);
     num_configurations_ = device_desc->num_configurations;
@@ -229,6 +311,7 @@ namespace usb {
           class_drivers_[conf.ep_id.Number()] = class_driver;
         } else if (auto hid_desc = DescriptorDynamicCast<HIDDescriptor>(desc)) {
           Log(kDebug, *hid_desc);
+          class_driver->SetClassDescriptor(desc);
         }
       }
 
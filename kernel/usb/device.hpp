@@ -11,10 +11,18 @@
 #include "error.hpp"
 #include "usb/setupdata.hpp"
 #include "usb/endpoint.hpp"
-#include "usb/arraymap.hpp"
+#include "usb/hashmap.hpp"
 
 namespace usb {
   class ClassDriver;
+  class HubDriver;
+
+  /** @brief ハブの下流ポートにつながったデバイスの速度 */
+  enum class PortSpeed {
+    kLow,
+    kFull,
+    kHigh,
+  };
 
   class Device {
    public:
@@ -25,6 +33,43 @@ namespace usb {
                              const void* buf, int len, ClassDriver* issuer);
     virtual Error InterruptIn(EndpointID ep_id, void* buf, int len);
     virtual Error InterruptOut(EndpointID ep_id, void* buf, int len);
+    /** @brief バルク転送を発行する．完了するとクラスドライバの OnBulkCompleted が呼ばれる． */
+    virtual Error BulkIn(EndpointID ep_id, void* buf, int len);
+    virtual Error BulkOut(EndpointID ep_id, const void* buf, int len);
+    /** @brief 積んであるバルク転送をすべて取り消し，ホスト側のエンドポイントを使える状態に戻す．
+     *
+     * 戻し終えるとクラスドライバの OnBulkFailed が呼ばれる．
+     * 転送が失敗したときはホストコントローラが自らこれを行う．
+     *
+     * @param ep_id  失敗の原因になったエンドポイント
+     */
+    virtual Error AbortBulkTransfers(EndpointID ep_id);
+    /** @brief ホスト側のバルクエンドポイントのデータトグルを初期値に戻す．
+     *
+     * CLEAR_FEATURE(ENDPOINT_HALT) でデバイス側のトグルが戻ったら呼ぶ．
+     * 戻し終えるとクラスドライバの OnBulkEndpointReset が呼ばれる．
+     */
+    virtual Error ResetBulkEndpoint(EndpointID ep_id);
+
+    /** @brief このデバイスがハブであることをホストコントローラに伝える．
+     *
+     * HubDriver がハブディスクリプタを読んだら呼ぶ．
+     *
+     * @param think_time  TT の think time（ハブディスクリプタの値，0 - 3）
+     */
+    virtual Error ConfigureHub(HubDriver* hub, int num_ports, int think_time);
+    /** @brief ハブの下流ポート port にデバイスがつながった．
+     *
+     * ホストコントローラは，デフォルトアドレスを使える順番が来たら HubDriver::ResetPort を呼ぶ．
+     */
+    virtual Error OnHubPortConnected(int port);
+    /** @brief ハブの下流ポート port のリセットが終わった．
+     *
+     * enabled なら speed のデバイスにスロットとアドレスを割り当てる．
+     */
+    virtual Error OnHubPortReset(int port, bool enabled, PortSpeed speed);
+    /** @brief ハブの下流ポート port からデバイスが外れた．そのデバイスのスロットを解放する． */
+    virtual Error OnHubPortDisconnected(int port);
 
     Error StartInitialize();
     bool IsInitialized() { return is_initialized_; }
@@ -38,6 +83,14 @@ namespace usb {
     Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
                              const void* buf, int len);
     Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len);
+    Error OnBulkCompleted(EndpointID ep_id, const void* buf, int len);
+    Error OnBulkFailed(EndpointID ep_id);
+    Error OnBulkEndpointReset(EndpointID ep_id);
+    /** @brief クラスドライバにデバイスが外れたことを伝えて破棄する．
+     *
+     * ドライバが ParentDevice をまだ使えるよう，派生クラスのデストラクタの先頭で呼ぶ．
+     */
+    void RemoveClassDrivers();
 
    private:
     /** @brief エンドポイントに割り当て済みのクラスドライバ．
@@ -69,7 +122,7 @@ namespace usb {
     /** OnControlCompleted の中で要求の発行元を特定するためのマップ構造．
      * ControlOut または ControlIn を発行したときに発行元が登録される．
      */
-    ArrayMap<SetupData, ClassDriver*, 4> event_waiters_{};
+    HashMap<SetupData, ClassDriver*, 8> event_waiters_{};
   };
 
   Error GetDescriptor(Device& dev, EndpointID ep_id,
@@ -0,0 +1,139 @@
+/**
+ * @file usb/hashmap.hpp
+ *
+ * 固定長配列を用いたオープンアドレス法のハッシュマップ実装．
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <type_traits>
+
+#include "error.hpp"
+
+namespace usb {
+  /** @brief HashMap の占有状況の統計 */
+  struct HashMapStats {
+    /** @brief 現在の要素数と，これまでの最大値 */
+    size_t size;
+    size_t peak_size;
+    /** @brief Put で空きを見つけるまでに進んだ距離の最大値 */
+    size_t max_probe;
+    /** @brief 一杯で Put できなかった回数 */
+    uint64_t full;
+  };
+
+  /** @brief 8 バイト以下のキーのハッシュ値を計算する（Fibonacci hashing）．
+   *
+   * 結果の上位ビットを使えば，TRB のアドレスのように下位ビットが揃った値でも散らばる．
+   */
+  template <class K>
+  uint64_t HashKey(const K& key) {
+    static_assert(sizeof(K) <= 8 && std::is_trivially_copyable_v<K>,
+                  "key must be a trivially copyable value of at most 8 bytes");
+    uint64_t x = 0;
+    memcpy(&x, &key, sizeof(K));
+    return x * 0x9e3779b97f4a7c15ull;
+  }
+
+  /** @brief 線形探査のハッシュマップ．
+   *
+   * Get, Put, Delete は表が極端に埋まっていなければ定数時間で終わる．
+   * Delete は後ろの要素を詰め直すので，削除済みの印は残らない．
+   *
+   * @tparam N  容量．2 のべき乗．
+   */
+  template <class K, class V, size_t N = 16>
+  class HashMap {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "N must be a power of 2");
+
+   public:
+    std::optional<V> Get(const K& key) const {
+      if (auto i = Find(key)) {
+        return slots_[*i].value;
+      }
+      return std::nullopt;
+    }
+
+    /** @brief key に value を対応付ける．既にあれば上書きする．
+     *
+     * @return 一杯で追加できなければ Error::kFull
+     */
+    Error Put(const K& key, const V& value) {
+      size_t i = Home(key);
+      for (size_t probe = 0; probe < N; ++probe, i = Next(i)) {
+        if (!slots_[i].used) {
+          slots_[i] = Slot{key, value, true};
+          ++stats_.size;
+          stats_.peak_size = std::max(stats_.peak_size, stats_.size);
+          stats_.max_probe = std::max(stats_.max_probe, probe);
+          return MAKE_ERROR(Error::kSuccess);
+        }
+        if (slots_[i].key == key) {
+          slots_[i].value = value;
+          return MAKE_ERROR(Error::kSuccess);
+        }
+      }
+      ++stats_.full;
+      return MAKE_ERROR(Error::kFull);
+    }
+
+    void Delete(const K& key) {
+      auto found = Find(key);
+      if (!found) {
+        return;
+      }
+
+      size_t hole = *found;
+      slots_[hole].used = false;
+      --stats_.size;
+      // 穴より後ろにあり，本来の位置が穴以前の要素を穴へ詰める
+      for (size_t j = Next(hole); slots_[j].used; j = Next(j)) {
+        const size_t home = Home(slots_[j].key);
+        if (((j - home) & (N - 1)) >= ((j - hole) & (N - 1))) {
+          slots_[hole] = slots_[j];
+          slots_[j].used = false;
+          hole = j;
+        }
+      }
+    }
+
+    size_t Size() const { return stats_.size; }
+    static constexpr size_t Capacity() { return N; }
+    const HashMapStats& Stats() const { return stats_; }
+
+   private:
+    struct Slot {
+      K key;
+      V value;
+      bool used;
+    };
+
+    static constexpr int kIndexBits = __builtin_ctzll(N);
+
+    std::array<Slot, N> slots_{};
+    HashMapStats stats_{};
+
+    static size_t Home(const K& key) {
+      return HashKey(key) >> (64 - kIndexBits);
+    }
+
+    static size_t Next(size_t i) {
+      return (i + 1) & (N - 1);
+    }
+
+    std::optional<size_t> Find(const K& key) const {
+      size_t i = Home(key);
+      for (size_t probe = 0; probe < N && slots_[i].used; ++probe, i = Next(i)) {
+        if (slots_[i].key == key) {
+          return i;
+        }
+      }
+      return std::nullopt;
+    }
+  };
+}
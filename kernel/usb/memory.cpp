@@ -1,6 +1,8 @@
 #include "usb/memory.hpp"
 
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 
 namespace {
   template <class T>
@@ -12,32 +14,85 @@ namespace {
   T MaskBits(T value, U mask) {
     return value & ~static_cast<T>(mask - 1);
   }
+
+  /** @brief 確保の単位（バイト）．xHC が読み書きする構造はどれも 64 バイト境界を要求する */
+  const size_t kGranuleSize = 64;
+  const size_t kNumGranules = usb::kMemoryPoolSize / kGranuleSize;
+
+  /** @brief 1 ビットが 1 単位に対応するビットマップ */
+  class GranuleBitmap {
+   public:
+    bool Test(size_t i) const { return bits_[i / 64] & (1ull << (i % 64)); }
+    void Set(size_t i) { bits_[i / 64] |= 1ull << (i % 64); }
+    void Clear(size_t i) { bits_[i / 64] &= ~(1ull << (i % 64)); }
+
+   private:
+    uint64_t bits_[kNumGranules / 64]{};
+  };
+
+  /** @brief 使用中の単位 */
+  GranuleBitmap used_granules;
+  /** @brief 確保した領域の先頭の単位．FreeMem はここから次の先頭か空きまでを解放する */
+  GranuleBitmap head_granules;
 }
 
 namespace usb {
   alignas(64) uint8_t memory_pool[kMemoryPoolSize];
-  uintptr_t alloc_ptr = reinterpret_cast<uintptr_t>(memory_pool);
 
   void* AllocMem(size_t size, unsigned int alignment, unsigned int boundary) {
-    if (alignment > 0) {
-      alloc_ptr = Ceil(alloc_ptr, alignment);
-    }
-    if (boundary > 0) {
-      auto next_boundary = Ceil(alloc_ptr, boundary);
-      if (next_boundary < alloc_ptr + size) {
-        alloc_ptr = next_boundary;
+    const auto pool = reinterpret_cast<uintptr_t>(memory_pool);
+    const size_t num_granules = (std::max<size_t>(size, 1) + kGranuleSize - 1) / kGranuleSize;
+
+    // 条件を満たす最初の空きを探す
+    size_t i = 0;
+    while (i + num_granules <= kNumGranules) {
+      const uintptr_t p = pool + i * kGranuleSize;
+      if (alignment > 0 && Ceil(p, alignment) != p) {
+        i = (Ceil(p, alignment) - pool) / kGranuleSize;
+        continue;
+      }
+      if (boundary > 0) {
+        auto next_boundary = Ceil(p, boundary);
+        if (next_boundary != p && next_boundary < p + size) {
+          i = (next_boundary - pool) / kGranuleSize;
+          continue;
+        }
+      }
+
+      size_t used = i;
+      while (used < i + num_granules && !used_granules.Test(used)) {
+        ++used;
+      }
+      if (used < i + num_granules) {
+        i = used + 1;
+        continue;
+      }
+
+      for (size_t j = i; j < i + num_granules; ++j) {
+        used_granules.Set(j);
       }
+      head_granules.Set(i);
+      memset(reinterpret_cast<void*>(p), 0, num_granules * kGranuleSize);
+      return reinterpret_cast<void*>(p);
     }
+    return nullptr;
+  }
 
-    if (reinterpret_cast<uintptr_t>(memory_pool) + kMemoryPoolSize
-        < alloc_ptr + size) {
-      return nullptr;
+  void FreeMem(void* p) {
+    const auto pool = reinterpret_cast<uintptr_t>(memory_pool);
+    const auto addr = reinterpret_cast<uintptr_t>(p);
+    if (addr < pool || pool + kMemoryPoolSize <= addr) {
+      return;
+    }
+    const size_t head = (addr - pool) / kGranuleSize;
+    if (!head_granules.Test(head)) {
+      return;
     }
 
-    auto p = alloc_ptr;
-    alloc_ptr += size;
-    return reinterpret_cast<void*>(p);
+    head_granules.Clear(head);
+    for (size_t i = head;
+         i < kNumGranules && used_granules.Test(i) && !head_granules.Test(i); ++i) {
+      used_granules.Clear(i);
+    }
   }
-
-  void FreeMem(void* p) {}
 }
@@ -10,13 +10,14 @@
 
 namespace usb {
   /** @brief 動的メモリ確保のためのメモリプールの最大容量（バイト） */
-  static const size_t kMemoryPoolSize = 4096 * 32;
+  static const size_t kMemoryPoolSize = 4096 * 64;
 
   /** @brief 指定されたバイト数のメモリ領域を確保して先頭ポインタを返す．
    *
    * 先頭アドレスが alignment に揃ったメモリ領域を確保する．
    * size <= boundary ならメモリ領域が boundary を跨がないことを保証する．
    * boundary は典型的にはページ境界を跨がないように 4096 を指定する．
+   * 確保した領域は 0 で埋めてある．
    *
    * @param size        確保するメモリ領域のサイズ（バイト単位）
    * @param alignment   メモリ領域のアライメント制約．0 なら制約しない．
@@ -31,7 +32,10 @@ namespace usb {
         AllocMem(sizeof(T) * num_obj, alignment, boundary));
   }
 
-  /** @brief 指定されたメモリ領域を解放する．本当に解放することは保証されない． */
+  /** @brief AllocMem で確保したメモリ領域を解放する．
+   *
+   * p は AllocMem が返した先頭ポインタでなければならない．nullptr なら何もしない．
+   */
   void FreeMem(void* p);
 
   /** @brief 標準コンテナ用のメモリアロケータ */
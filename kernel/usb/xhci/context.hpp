@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include "usb/endpoint.hpp"
 
 namespace usb::xhci {
@@ -82,10 +84,40 @@ namespace usb::xhci {
     DeviceContextIndex& operator =(const DeviceContextIndex& rhs) = default;
   };
 
-  struct DeviceContext {
-    SlotContext slot_context;
-    EndpointContext ep_contexts[31];
-  } __attribute__((packed));
+  /** @brief Device Context（スロットと 31 個のエンドポイントのコンテキスト）を指すビュー．
+   *
+   * HCCPARAMS1 の Context Size が 1 の xHC では各コンテキストが 64 バイトになる．
+   * 先頭 32 バイトの形式は同じで残りは予約なので，コンテキストの間隔（stride）だけを
+   * 実行時に持ち，どちらの xHC でも同じ型で xHC が読み書きするメモリを直接扱う．
+   */
+  class DeviceContext {
+   public:
+    static const size_t kNumContexts = 32;
+
+    /** @brief stride バイト間隔のコンテキストを並べるのに要るバイト数 */
+    static size_t SizeOf(size_t stride) { return kNumContexts * stride; }
+
+    DeviceContext() = default;
+    DeviceContext(void* buf, size_t stride)
+        : buf_{reinterpret_cast<uint8_t*>(buf)}, stride_{stride} {}
+
+    SlotContext& Slot() const {
+      return *reinterpret_cast<SlotContext*>(buf_);
+    }
+
+    /** @param dci Device Context Index (1 .. 31) */
+    EndpointContext& Endpoint(DeviceContextIndex dci) const {
+      return *reinterpret_cast<EndpointContext*>(buf_ + stride_ * dci.value);
+    }
+
+    /** @brief DCBAA に登録する先頭アドレス */
+    void* Buffer() const { return buf_; }
+    size_t Stride() const { return stride_; }
+
+   private:
+    uint8_t* buf_ = nullptr;
+    size_t stride_ = sizeof(SlotContext);
+  };
 
   struct InputControlContext {
     uint32_t drop_context_flags;
@@ -97,18 +129,41 @@ namespace usb::xhci {
     uint8_t reserved2;
   } __attribute__((packed));
 
-  struct InputContext {
-    InputControlContext input_control_context;
-    SlotContext slot_context;
-    EndpointContext ep_contexts[31];
+  /** @brief Input Context（入力制御コンテキストの後に Device Context と同じ並び）を指すビュー．
+   *
+   * コンテキストの間隔は DeviceContext と同じく xHC の Context Size に従う．
+   */
+  class InputContext {
+   public:
+    static const size_t kNumContexts = 33;
+
+    /** @brief stride バイト間隔のコンテキストを並べるのに要るバイト数 */
+    static size_t SizeOf(size_t stride) { return kNumContexts * stride; }
+
+    InputContext() = default;
+    InputContext(void* buf, size_t stride)
+        : buf_{reinterpret_cast<uint8_t*>(buf)}, stride_{stride} {}
+
+    InputControlContext& Control() const {
+      return *reinterpret_cast<InputControlContext*>(buf_);
+    }
+
+    SlotContext& Slot() const {
+      return *reinterpret_cast<SlotContext*>(buf_ + stride_);
+    }
+
+    /** @param dci Device Context Index (1 .. 31) */
+    EndpointContext& Endpoint(DeviceContextIndex dci) const {
+      return *reinterpret_cast<EndpointContext*>(buf_ + stride_ * (dci.value + 1));
+    }
 
     /** @brief Enable the slot context.
      *
      * @return Pointer to the slot context enabled.
      */
     SlotContext* EnableSlotContext() {
-      input_control_context.add_context_flags |= 1;
-      return &slot_context;
+      Control().add_context_flags |= 1;
+      return &Slot();
     }
 
     /** @brief Enable an endpoint.
@@ -117,8 +172,15 @@ namespace usb::xhci {
      * @return Pointer to the endpoint context enabled.
      */
     EndpointContext* EnableEndpoint(DeviceContextIndex dci) {
-      input_control_context.add_context_flags |= 1u << dci.value;
-      return &ep_contexts[dci.value - 1];
+      Control().add_context_flags |= 1u << dci.value;
+      return &Endpoint(dci);
     }
-  } __attribute__((packed));
+
+    /** @brief Address Device や Configure Endpoint のコマンドに渡す先頭アドレス */
+    void* Buffer() const { return buf_; }
+
+   private:
+    uint8_t* buf_ = nullptr;
+    size_t stride_ = sizeof(SlotContext);
+  };
 }
@@ -1,8 +1,13 @@
 #include "usb/xhci/device.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <new>
 #include "logger.hpp"
 #include "usb/memory.hpp"
 #include "usb/xhci/ring.hpp"
+#include "usb/xhci/speed.hpp"
+#include "usb/xhci/xhci.hpp"
 
 namespace {
   using namespace usb::xhci;
@@ -77,8 +82,21 @@ namespace {
 }
 
 namespace usb::xhci {
-  Device::Device(uint8_t slot_id, DoorbellRegister* dbreg)
-      : slot_id_{slot_id}, dbreg_{dbreg} {
+  Device::Device(uint8_t slot_id, DoorbellRegister* dbreg,
+                 const struct DeviceContext& ctx, const struct InputContext& input_ctx)
+      : ctx_{ctx}, input_ctx_{input_ctx}, slot_id_{slot_id}, dbreg_{dbreg} {
+  }
+
+  Device::~Device() {
+    // 完了待ちの転送はもう完了しないので，ドライバに失敗として片付けさせる
+    RemoveClassDrivers();
+    for (auto& tr : transfer_rings_) {
+      if (tr) {
+        tr->~Ring();
+        FreeMem(tr);
+        tr = nullptr;
+      }
+    }
   }
 
   Error Device::Initialize() {
@@ -94,11 +112,21 @@ namespace usb::xhci {
     state_ = State::kSlotAssigning;
   }
 
-  Ring* Device::AllocTransferRing(DeviceContextIndex index, size_t buf_size) {
+  Ring* Device::AllocTransferRing(DeviceContextIndex index, size_t buf_size,
+                                  size_t max_segments) {
     int i = index.value - 1;
+    if (auto old_tr = transfer_rings_[i]) {
+      old_tr->~Ring();
+      FreeMem(old_tr);
+    }
     auto tr = AllocArray<Ring>(1, 64, 4096);
     if (tr) {
-      tr->Initialize(buf_size);
+      new(tr) Ring;
+      if (tr->Initialize(buf_size, max_segments)) {
+        tr->~Ring();
+        FreeMem(tr);
+        tr = nullptr;
+      }
     }
     transfer_rings_[i] = tr;
     return tr;
@@ -127,6 +155,14 @@ namespace usb::xhci {
 
     auto status = StatusStageTRB{};
 
+    if (setup_stage_map_.Size() == setup_stage_map_.Capacity()) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    if (auto err = tr->Reserve(buf ? 3 : 2)) {
+      return err;
+    }
+
+    tr->BeginBatch();
     if (buf) {
       auto setup_trb_position = TRBDynamicCast<SetupStageTRB>(tr->Push(
             MakeSetupStageTRB(setup_data, SetupStageTRB::kInDataStage)));
@@ -145,8 +181,9 @@ namespace usb::xhci {
 
       setup_stage_map_.Put(status_trb_position, setup_trb_position);
     }
+    tr->CommitBatch();
 
-    dbreg_->Ring(dci.value);
+    RingDoorbell(dci);
 
     return MAKE_ERROR(Error::kSuccess);
   }
@@ -175,6 +212,14 @@ namespace usb::xhci {
     auto status = StatusStageTRB{};
     status.bits.direction = true;
 
+    if (setup_stage_map_.Size() == setup_stage_map_.Capacity()) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    if (auto err = tr->Reserve(buf ? 3 : 2)) {
+      return err;
+    }
+
+    tr->BeginBatch();
     if (buf) {
       auto setup_trb_position = TRBDynamicCast<SetupStageTRB>(tr->Push(
             MakeSetupStageTRB(setup_data, SetupStageTRB::kOutDataStage)));
@@ -192,8 +237,9 @@ namespace usb::xhci {
 
       setup_stage_map_.Put(status_trb_position, setup_trb_position);
     }
+    tr->CommitBatch();
 
-    dbreg_->Ring(dci.value);
+    RingDoorbell(dci);
 
     return MAKE_ERROR(Error::kSuccess);
   }
@@ -216,9 +262,12 @@ namespace usb::xhci {
     normal.bits.trb_transfer_length = len;
     normal.bits.interrupt_on_short_packet = true;
     normal.bits.interrupt_on_completion = true;
+    normal.bits.interrupter_target = interrupter_targets_[dci.value - 1];
 
-    tr->Push(normal);
-    dbreg_->Ring(dci.value);
+    if (tr->Push(normal) == nullptr) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    RingDoorbell(dci);
     return MAKE_ERROR(Error::kSuccess);
   }
 
@@ -232,9 +281,300 @@ namespace usb::xhci {
     return MAKE_ERROR(Error::kNotImplemented);
   }
 
+  Error Device::BulkIn(EndpointID ep_id, void* buf, int len) {
+    if (auto err = usb::Device::BulkIn(ep_id, buf, len)) {
+      return err;
+    }
+    return PushBulkTD(DeviceContextIndex{ep_id}, buf, len);
+  }
+
+  Error Device::BulkOut(EndpointID ep_id, const void* buf, int len) {
+    if (auto err = usb::Device::BulkOut(ep_id, buf, len)) {
+      return err;
+    }
+    return PushBulkTD(DeviceContextIndex{ep_id}, buf, len);
+  }
+
+  Error Device::PushBulkTD(DeviceContextIndex dci, const void* buf, int len) {
+    Ring* tr = transfer_rings_[dci.value - 1];
+    if (tr == nullptr) {
+      return MAKE_ERROR(Error::kTransferRingNotSet);
+    }
+
+    auto td = std::find_if(bulk_tds_.begin(), bulk_tds_.end(),
+                           [](const BulkTD& td) { return td.first == nullptr; });
+    if (td == bulk_tds_.end()) {
+      return MAKE_ERROR(Error::kFull);
+    }
+
+    const int max_packet_size =
+      std::max<int>(1, input_ctx_.Endpoint(dci).bits.max_packet_size);
+    auto p = reinterpret_cast<uintptr_t>(buf);
+    int remaining = len;
+
+    // バッファが跨ぐ 64 KiB 境界の数より 1 つ多い TRB を使う
+    const size_t num_trbs = 1 + ((p & 0xffffu) + std::max(len, 1) - 1) / 0x10000;
+    if (auto err = tr->Reserve(num_trbs)) {
+      return err;
+    }
+
+    tr->BeginBatch();
+    TRB* first = nullptr;
+    TRB* last = nullptr;
+    do {
+      // 1 つの TRB のバッファは 64 KiB 境界を跨いではいけない
+      const int trb_len = std::min<int>(remaining, 0x10000 - (p & 0xffffu));
+      remaining -= trb_len;
+
+      NormalTRB normal{};
+      normal.SetPointer(reinterpret_cast<const void*>(p));
+      normal.bits.trb_transfer_length = trb_len;
+      // TD Size はこの TRB より後に残っているパケット数
+      normal.bits.td_size = std::min(31, (remaining + max_packet_size - 1) / max_packet_size);
+      normal.bits.interrupter_target = interrupter_targets_[dci.value - 1];
+      normal.bits.interrupt_on_short_packet = true;
+      normal.bits.chain_bit = remaining > 0;
+      normal.bits.interrupt_on_completion = remaining == 0;
+
+      last = tr->Push(normal);
+      if (first == nullptr) {
+        first = last;
+      }
+      p += trb_len;
+    } while (remaining > 0);
+    tr->CommitBatch();
+
+    *td = BulkTD{first, last, buf, dci.value};
+    bulk_dcis_ |= 1u << dci.value;
+    RingDoorbell(dci);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::OnBulkTransferEvent(const TransferEventTRB& trb) {
+    const TRB* issuer_trb = trb.Pointer();
+    const Ring* tr = transfer_rings_[DeviceContextIndex{trb.EndpointID()}.value - 1];
+    auto in_td = [tr, issuer_trb](const BulkTD& td) {
+      // TD は Link TRB を挟んで別のセグメントに続いていることがある
+      return td.first != nullptr && tr->InSpan(td.first, td.last, issuer_trb);
+    };
+    auto td = std::find_if(bulk_tds_.begin(), bulk_tds_.end(), in_td);
+    if (td == bulk_tds_.end()) {
+      // TD の途中でショートパケットになり，既に完了させた TD の最後の TRB のイベント
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    const BulkTD completed = *td;
+    td->first = nullptr;
+    if (trb.bits.completion_code != 1 /* Success */ &&
+        trb.bits.completion_code != 13 /* Short Packet */) {
+      Log(kWarn, "bulk transfer failed: %s (slot %d, dci %d)\n",
+          kTRBCompletionCodeToName[trb.bits.completion_code],
+          slot_id_, completed.dci);
+      // エンドポイントは Halted になり，後ろの TD も進まない．捨ててクラスドライバに知らせる
+      return AbortBulkTransfers(trb.EndpointID());
+    }
+
+    // issuer_trb より前の TRB は全部転送し終えている
+    int transfer_length = 0;
+    for (const TRB* t = completed.first; t != issuer_trb;) {
+      if (auto link = TRBDynamicCast<const LinkTRB>(t)) {
+        t = link->Pointer();
+        continue;
+      }
+      transfer_length += TRBDynamicCast<const NormalTRB>(t)->bits.trb_transfer_length;
+      ++t;
+    }
+    transfer_length += TRBDynamicCast<const NormalTRB>(issuer_trb)->bits.trb_transfer_length
+      - trb.bits.trb_transfer_length;
+
+    return this->OnBulkCompleted(trb.EndpointID(), completed.buf, transfer_length);
+  }
+
+  Error Device::AbortBulkTransfers(EndpointID ep_id) {
+    if (aborting_dcis_ != 0) {
+      // 既に止めている途中．同じ失敗が別のエンドポイントでも起きた
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    uint32_t dcis = 1u << DeviceContextIndex{ep_id}.value;
+    for (auto& td : bulk_tds_) {
+      if (td.first != nullptr) {
+        dcis |= 1u << td.dci;
+        td.first = nullptr;
+      }
+    }
+    failed_ep_ = ep_id;
+    aborting_dcis_ = dcis;
+
+    for (uint32_t rest = dcis; rest; rest &= rest - 1) {
+      const DeviceContextIndex dci{__builtin_ctz(rest)};
+      const auto ep_state = ctx_.Endpoint(dci).bits.ep_state;
+      TRB* cmd_trb;
+      if (ep_state == 2 /* Halted */) {
+        cmd_trb = controller->CommandRing()->Push(
+            ResetEndpointCommandTRB{EndpointID{dci.value}, slot_id_});
+      } else if (ep_state == 1 /* Running */) {
+        cmd_trb = controller->CommandRing()->Push(
+            StopEndpointCommandTRB{EndpointID{dci.value}, slot_id_});
+      } else {
+        // 既に止まっているので，すぐにデキュー位置を移せる
+        if (auto err = PushSetTRDequeue(dci)) {
+          return err;
+        }
+        continue;
+      }
+      if (cmd_trb == nullptr) {
+        return MAKE_ERROR(Error::kFull);
+      }
+    }
+    controller->RingCommandDoorbell();
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::OnEndpointCommandCompleted(unsigned int issuer_type, DeviceContextIndex dci,
+                                           int completion_code) {
+    const uint32_t bit = 1u << dci.value;
+    if ((aborting_dcis_ & bit) == 0) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+
+    if (issuer_type == StopEndpointCommandTRB::Type && completion_code != 1 /* Success */ &&
+        ctx_.Endpoint(dci).bits.ep_state == 2 /* Halted */) {
+      // 止める前に自分も STALL した
+      if (controller->CommandRing()->Push(
+            ResetEndpointCommandTRB{EndpointID{dci.value}, slot_id_}) == nullptr) {
+        return MAKE_ERROR(Error::kFull);
+      }
+      controller->RingCommandDoorbell();
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    if (issuer_type != SetTRDequeuePointerCommandTRB::Type) {
+      // エンドポイントは Stopped になった
+      if (auto err = PushSetTRDequeue(dci)) {
+        return err;
+      }
+      controller->RingCommandDoorbell();
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    if (completion_code != 1 /* Success */) {
+      Log(kError, "Set TR Dequeue Pointer failed: %s (slot %d, dci %d)\n",
+          kTRBCompletionCodeToName[completion_code], slot_id_, dci.value);
+    }
+    aborting_dcis_ &= ~bit;
+    if (aborting_dcis_ != 0) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    return this->OnBulkFailed(failed_ep_);
+  }
+
+  Error Device::ResetBulkEndpoint(EndpointID ep_id) {
+    const DeviceContextIndex dci{ep_id};
+    Ring* tr = transfer_rings_[dci.value - 1];
+    if (tr == nullptr) {
+      return MAKE_ERROR(Error::kTransferRingNotSet);
+    }
+    if (aborting_dcis_ != 0 || reconfiguring_dci_ != 0) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+
+    memset(&input_ctx_.Control(), 0, sizeof(InputControlContext));
+    memcpy(&input_ctx_.Slot(), &ctx_.Slot(), sizeof(SlotContext));
+    input_ctx_.EnableSlotContext();
+    input_ctx_.Control().drop_context_flags = 1u << dci.value;
+
+    // 設定は今のものを引き継ぎ，デキュー位置だけ次に積む TRB に合わせる
+    auto ep_ctx = input_ctx_.EnableEndpoint(dci);
+    memcpy(ep_ctx, &ctx_.Endpoint(dci), sizeof(EndpointContext));
+    ep_ctx->bits.ep_state = 0;
+    tr->DiscardPending();
+    ep_ctx->SetTransferRingBuffer(tr->EnqueuePointer());
+    ep_ctx->bits.dequeue_cycle_state = tr->CycleBit();
+
+    if (controller->CommandRing()->Push(
+          ConfigureEndpointCommandTRB{input_ctx_, slot_id_}) == nullptr) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    reconfiguring_dci_ = dci.value;
+    controller->RingCommandDoorbell();
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::OnEndpointReconfigured(int completion_code) {
+    const EndpointID ep_id{reconfiguring_dci_};
+    reconfiguring_dci_ = 0;
+    if (completion_code != 1 /* Success */) {
+      // トグルがずれたままなら，次の転送が失敗して Reset Recovery がやり直される
+      Log(kError, "Configure Endpoint failed: %s (slot %d, dci %d)\n",
+          kTRBCompletionCodeToName[completion_code], slot_id_, ep_id.Address());
+    }
+    return this->OnBulkEndpointReset(ep_id);
+  }
+
+  Error Device::PushSetTRDequeue(DeviceContextIndex dci) {
+    // 捨てた TD の TRB は xHC に読ませない．次に積む TRB から再開させる
+    Ring* tr = transfer_rings_[dci.value - 1];
+    tr->DiscardPending();
+    SetTRDequeuePointerCommandTRB cmd{
+      EndpointID{dci.value}, slot_id_, tr->EnqueuePointer(), tr->CycleBit()};
+    if (controller->CommandRing()->Push(cmd) == nullptr) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void Device::FlushDoorbells() {
+    defer_doorbells_ = false;
+    while (pending_doorbells_) {
+      const int dci = __builtin_ctz(pending_doorbells_);
+      pending_doorbells_ &= pending_doorbells_ - 1;
+      dbreg_->Ring(dci);
+    }
+  }
+
+  void Device::RingDoorbell(DeviceContextIndex dci) {
+    if (defer_doorbells_) {
+      pending_doorbells_ |= 1u << dci.value;
+    } else {
+      dbreg_->Ring(dci.value);
+    }
+  }
+
+  Error Device::ConfigureHub(usb::HubDriver* hub, int num_ports, int think_time) {
+    hub_ = hub;
+    return ConfigureHubSlot(*controller, *this, num_ports, think_time);
+  }
+
+  Error Device::OnHubPortConnected(int port) {
+    return ResetHubPort(*controller, *this, port);
+  }
+
+  Error Device::OnHubPortReset(int port, bool enabled, usb::PortSpeed speed) {
+    int speed_id = kFullSpeed;
+    if (speed == usb::PortSpeed::kLow) {
+      speed_id = kLowSpeed;
+    } else if (speed == usb::PortSpeed::kHigh) {
+      speed_id = kHighSpeed;
+    }
+    return OnHubPortResetCompleted(*controller, *this, port, enabled, speed_id);
+  }
+
+  Error Device::OnHubPortDisconnected(int port) {
+    return xhci::OnHubPortDisconnected(*controller, *this, port);
+  }
+
   Error Device::OnTransferEventReceived(const TransferEventTRB& trb) {
     const auto residual_length = trb.bits.trb_transfer_length;
 
+    // イベントの指す TRB までは xHC が処理し終えたので，リングのその分を再び使える
+    if (auto tr = transfer_rings_[DeviceContextIndex{trb.EndpointID()}.value - 1]) {
+      tr->UpdateDequeue(trb.Pointer());
+    }
+
+    if (bulk_dcis_ & (1u << DeviceContextIndex{trb.EndpointID()}.value)) {
+      return OnBulkTransferEvent(trb);
+    }
+
     if (trb.bits.completion_code != 1 /* Success */ &&
         trb.bits.completion_code != 13 /* Short Packet */) {
       Log(kDebug, trb);
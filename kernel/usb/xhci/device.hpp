@@ -11,7 +11,7 @@
 
 #include "error.hpp"
 #include "usb/device.hpp"
-#include "usb/arraymap.hpp"
+#include "usb/hashmap.hpp"
 #include "usb/xhci/context.hpp"
 #include "usb/xhci/trb.hpp"
 #include "usb/xhci/registers.hpp"
@@ -33,7 +33,14 @@ namespace usb::xhci {
         int trb_transfer_length,
         TRB* issue_trb);
 
-    Device(uint8_t slot_id, DoorbellRegister* dbreg);
+    /** @param ctx, input_ctx  xHC の Context Size に合わせて確保したコンテキストの領域 */
+    Device(uint8_t slot_id, DoorbellRegister* dbreg,
+           const struct DeviceContext& ctx, const struct InputContext& input_ctx);
+    /** @brief クラスドライバと転送リングを破棄する．
+     *
+     * Disable Slot の完了後に呼ぶ．xHC はもうこのスロットのリングを読み書きしない．
+     */
+    ~Device() override;
 
     Error Initialize();
 
@@ -46,7 +53,14 @@ namespace usb::xhci {
     uint8_t SlotID() const { return slot_id_; }
 
     void SelectForSlotAssignment();
-    Ring* AllocTransferRing(DeviceContextIndex index, size_t buf_size);
+    /** @brief 転送リングを確保する．
+     *
+     * @param buf_size  1 セグメントの TRB 数
+     * @param max_segments  TD を積み過ぎたときに広げてよいセグメント数の上限
+     * @return 確保できなければ nullptr
+     */
+    Ring* AllocTransferRing(DeviceContextIndex index, size_t buf_size,
+                            size_t max_segments = 1);
 
     Error ControlIn(EndpointID ep_id, SetupData setup_data,
                     void* buf, int len, ClassDriver* issuer) override;
@@ -54,23 +68,106 @@ namespace usb::xhci {
                      const void* buf, int len, ClassDriver* issuer) override;
     Error InterruptIn(EndpointID ep_id, void* buf, int len) override;
     Error InterruptOut(EndpointID ep_id, void* buf, int len) override;
+    /** @brief バルク転送を 1 つの TD として積む．
+     *
+     * バッファは 64 KiB 境界ごとに Normal TRB に分けてチェインし，まとめて公開して
+     * ドアベルを 1 回鳴らす．データはバッファへ直接 DMA される．
+     */
+    Error BulkIn(EndpointID ep_id, void* buf, int len) override;
+    Error BulkOut(EndpointID ep_id, const void* buf, int len) override;
+    /** @brief 積んであるバルク転送の TD をすべて捨て，使っていたエンドポイントを止める．
+     *
+     * Halted なら Reset Endpoint，Running なら Stop Endpoint を発行し，
+     * 続けて Set TR Dequeue Pointer で xHC のデキュー位置を書き込み位置に移す．
+     * すべてのエンドポイントで終わったら OnBulkFailed(ep_id) を呼ぶ．
+     */
+    Error AbortBulkTransfers(EndpointID ep_id) override;
+    /** @brief Drop と Add を両方立てた Configure Endpoint でエンドポイントを設定し直す．
+     *
+     * Reset Endpoint は Halted のエンドポイントにしか使えないため，Stopped や Running の
+     * エンドポイントのデータトグルはこの方法で戻す．
+     */
+    Error ResetBulkEndpoint(EndpointID ep_id) override;
+
+    Error ConfigureHub(usb::HubDriver* hub, int num_ports, int think_time) override;
+    Error OnHubPortConnected(int port) override;
+    Error OnHubPortReset(int port, bool enabled, usb::PortSpeed speed) override;
+    Error OnHubPortDisconnected(int port) override;
+    /** @brief このデバイスがハブならそのクラスドライバ．ハブでなければ nullptr */
+    usb::HubDriver* Hub() const { return hub_; }
 
     Error OnTransferEventReceived(const TransferEventTRB& trb);
+    /** @brief AbortBulkTransfers が発行したエンドポイントのコマンドが完了した． */
+    Error OnEndpointCommandCompleted(unsigned int issuer_type, DeviceContextIndex dci,
+                                     int completion_code);
+    /** @brief ResetBulkEndpoint の Configure Endpoint の完了を待っているか */
+    bool IsReconfiguringEndpoint() const { return reconfiguring_dci_ != 0; }
+    /** @brief ResetBulkEndpoint が発行した Configure Endpoint が完了した． */
+    Error OnEndpointReconfigured(int completion_code);
+
+    /** @brief これ以降のドアベルを FlushDoorbells まで溜める． */
+    void DeferDoorbells() { defer_doorbells_ = true; }
+    /** @brief 溜めたドアベルをエンドポイントごとに 1 回ずつ鳴らし，溜めるのをやめる． */
+    void FlushDoorbells();
+
+    /** @brief SetupStageTRB を引くマップの統計．溢れるとコントロール転送の完了を取りこぼす */
+    const HashMapStats& SetupStageMapStats() const { return setup_stage_map_.Stats(); }
+
+    /** @brief dci のエンドポイントの転送完了イベントを受け取るインタラプタを設定する． */
+    void SetInterrupterTarget(DeviceContextIndex dci, uint8_t interrupter) {
+      interrupter_targets_[dci.value - 1] = interrupter;
+    }
 
    private:
-    alignas(64) struct DeviceContext ctx_;
-    alignas(64) struct InputContext input_ctx_;
+    struct DeviceContext ctx_;
+    struct InputContext input_ctx_;
 
     const uint8_t slot_id_;
     DoorbellRegister* const dbreg_;
 
     enum State state_;
-    std::array<Ring*, 31> transfer_rings_; // index = dci - 1
+    std::array<Ring*, 31> transfer_rings_{}; // index = dci - 1
+    std::array<uint8_t, 31> interrupter_targets_{}; // index = dci - 1
+
+    usb::HubDriver* hub_ = nullptr;
+
+    bool defer_doorbells_ = false;
+    /** @brief 溜めているドアベル．ビット dci が立っていれば鳴らす */
+    uint32_t pending_doorbells_ = 0;
+
+    void RingDoorbell(DeviceContextIndex dci);
+
+    /** @brief 完了を待っているバルク転送の TD */
+    struct BulkTD {
+      /** @brief TD の最初と最後の TRB．nullptr なら空き */
+      const TRB* first;
+      const TRB* last;
+      const void* buf;
+      int dci;
+    };
+    /** @brief 同時に完了を待てるバルク転送の TD の数 */
+    static const size_t kMaxBulkTDs = 8;
+    std::array<BulkTD, kMaxBulkTDs> bulk_tds_{};
+    /** @brief バルク転送に使ったエンドポイント．ビット dci が立つ */
+    uint32_t bulk_dcis_ = 0;
+
+    Error PushBulkTD(DeviceContextIndex dci, const void* buf, int len);
+    Error OnBulkTransferEvent(const TransferEventTRB& trb);
+
+    /** @brief AbortBulkTransfers で止めている途中のエンドポイント．ビット dci が立つ */
+    uint32_t aborting_dcis_ = 0;
+    /** @brief AbortBulkTransfers を引き起こしたエンドポイント */
+    EndpointID failed_ep_;
+
+    Error PushSetTRDequeue(DeviceContextIndex dci);
+
+    /** @brief ResetBulkEndpoint で設定し直している途中のエンドポイント．0 なら無し */
+    int reconfiguring_dci_ = 0;
 
     /** コントロール転送が完了した際に DataStageTRB や StatusStageTRB
      * から対応する SetupStageTRB を検索するためのマップ．
      */
-    ArrayMap<const void*, const SetupStageTRB*, 16> setup_stage_map_{};
+    HashMap<const void*, const SetupStageTRB*, 16> setup_stage_map_{};
 
     //usb::Device* usb_device_;
   };
@@ -1,17 +1,19 @@
 #include "usb/xhci/devmgr.hpp"
 
+#include <cstring>
 #include "usb/memory.hpp"
 
 namespace usb::xhci {
-  Error DeviceManager::Initialize(size_t max_slots) {
+  Error DeviceManager::Initialize(size_t max_slots, size_t context_size) {
     max_slots_ = max_slots;
+    context_size_ = context_size;
 
     devices_ = AllocArray<Device*>(max_slots_ + 1, 0, 0);
     if (devices_ == nullptr) {
       return MAKE_ERROR(Error::kNoEnoughMemory);
     }
 
-    device_context_pointers_ = AllocArray<DeviceContext*>(max_slots_ + 1, 64, 4096);
+    device_context_pointers_ = AllocArray<void*>(max_slots_ + 1, 64, 4096);
     if (device_context_pointers_ == nullptr) {
       FreeMem(devices_);
       return MAKE_ERROR(Error::kNoEnoughMemory);
@@ -25,7 +27,7 @@ namespace usb::xhci {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  DeviceContext** DeviceManager::DeviceContexts() const {
+  void** DeviceManager::DeviceContexts() const {
     return device_context_pointers_;
   }
 
@@ -33,7 +35,9 @@ namespace usb::xhci {
     for (size_t i = 1; i <= max_slots_; ++i) {
       auto dev = devices_[i];
       if (dev == nullptr) continue;
-      if (dev->DeviceContext()->slot_context.bits.root_hub_port_num == port_num) {
+      const auto& slot_ctx = dev->DeviceContext()->Slot();
+      if (slot_ctx.bits.root_hub_port_num == port_num &&
+          slot_ctx.bits.route_string == route_string) {
         return dev;
       }
     }
@@ -76,8 +80,31 @@ namespace usb::xhci {
       return MAKE_ERROR(Error::kAlreadyAllocated);
     }
 
-    devices_[slot_id] = AllocArray<Device>(1, 64, 4096);
-    new(devices_[slot_id]) Device(slot_id, dbreg);
+    // コンテキストの領域は xHC が直接読み書きする．どちらも 4 KiB 以下なのでページを跨がせない
+    const size_t ctx_bytes = DeviceContext::SizeOf(context_size_);
+    const size_t input_ctx_bytes = InputContext::SizeOf(context_size_);
+    auto ctx_buf = AllocMem(ctx_bytes, 64, 4096);
+    auto input_ctx_buf = AllocMem(input_ctx_bytes, 64, 4096);
+    auto dev = AllocArray<Device>(1, 64, 4096);
+    if (ctx_buf == nullptr || input_ctx_buf == nullptr || dev == nullptr) {
+      // 確保できた分を返す
+      if (ctx_buf) {
+        FreeMem(ctx_buf);
+      }
+      if (input_ctx_buf) {
+        FreeMem(input_ctx_buf);
+      }
+      if (dev) {
+        FreeMem(dev);
+      }
+      return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+    memset(ctx_buf, 0, ctx_bytes);
+    memset(input_ctx_buf, 0, input_ctx_bytes);
+
+    devices_[slot_id] = new(dev) Device(
+        slot_id, dbreg,
+        DeviceContext{ctx_buf, context_size_}, InputContext{input_ctx_buf, context_size_});
     return MAKE_ERROR(Error::kSuccess);
   }
 
@@ -87,14 +114,45 @@ namespace usb::xhci {
     }
 
     auto dev = devices_[slot_id];
-    device_context_pointers_[slot_id] = dev->DeviceContext();
+    device_context_pointers_[slot_id] = dev->DeviceContext()->Buffer();
     return MAKE_ERROR(Error::kSuccess);
   }
 
   Error DeviceManager::Remove(uint8_t slot_id) {
+    if (slot_id > max_slots_) {
+      return MAKE_ERROR(Error::kInvalidSlotID);
+    }
+
     device_context_pointers_[slot_id] = nullptr;
-    FreeMem(devices_[slot_id]);
+    auto dev = devices_[slot_id];
+    if (dev == nullptr) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    // 破棄の途中で届いたイベントからは見つからないようにしておく
     devices_[slot_id] = nullptr;
+
+    void* ctx_buf = dev->DeviceContext()->Buffer();
+    void* input_ctx_buf = dev->InputContext()->Buffer();
+    dev->~Device();
+    FreeMem(ctx_buf);
+    FreeMem(input_ctx_buf);
+    FreeMem(dev);
     return MAKE_ERROR(Error::kSuccess);
   }
+
+  void DeviceManager::DeferDoorbells() {
+    for (size_t i = 1; i <= max_slots_; ++i) {
+      if (devices_[i]) {
+        devices_[i]->DeferDoorbells();
+      }
+    }
+  }
+
+  void DeviceManager::FlushDoorbells() {
+    for (size_t i = 1; i <= max_slots_; ++i) {
+      if (devices_[i]) {
+        devices_[i]->FlushDoorbells();
+      }
+    }
+  }
 }
@@ -17,21 +17,32 @@ namespace usb::xhci {
   class DeviceManager {
 
    public:
-    Error Initialize(size_t max_slots);
-    DeviceContext** DeviceContexts() const;
+    /** @param context_size  xHC のコンテキスト 1 つのバイト数（32 か 64） */
+    Error Initialize(size_t max_slots, size_t context_size);
+    void** DeviceContexts() const;
     Device* FindByPort(uint8_t port_num, uint32_t route_string) const;
     Device* FindByState(enum Device::State state) const;
     Device* FindBySlot(uint8_t slot_id) const;
     //WithError<Device*> Get(uint8_t device_id) const;
     Error AllocDevice(uint8_t slot_id, DoorbellRegister* dbreg);
     Error LoadDCBAA(uint8_t slot_id);
+    /** @brief Disable Slot を終えたスロットのデバイスを破棄し，メモリを返す．
+     *
+     * デバイスのクラスドライバには，破棄する前にデバイスが外れたことを伝える．
+     */
     Error Remove(uint8_t slot_id);
 
+    /** @brief 各デバイスのドアベルを FlushDoorbells まで溜めさせる． */
+    void DeferDoorbells();
+    /** @brief 各デバイスが溜めたドアベルを鳴らす． */
+    void FlushDoorbells();
+
    private:
     // device_context_pointers_ can be used as DCBAAP's value.
     // The number of elements is max_slots_ + 1.
-    DeviceContext** device_context_pointers_;
+    void** device_context_pointers_;
     size_t max_slots_;
+    size_t context_size_;
 
     // The number of elements is max_slots_ + 1.
     Device** devices_;
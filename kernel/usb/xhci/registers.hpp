@@ -420,4 +420,22 @@ namespace usb::xhci {
       uint32_t : 7;
     } __attribute__((packed)) bits;
   } __attribute__((packed));
+
+  /** @brief Supported Protocol Capability（ID 2）の先頭 3 ダブルワード */
+  union SupportedProtocol_Bitmap {
+    static const uint8_t kCapabilityID = 2;
+    uint32_t data[3];
+    struct {
+      uint32_t capability_id : 8;
+      uint32_t next_pointer : 8;
+      uint32_t minor_revision : 8;
+      uint32_t major_revision : 8;
+
+      uint32_t name_string : 32;
+
+      uint32_t compatible_port_offset : 8;
+      uint32_t compatible_port_count : 8;
+      uint32_t : 16;
+    } __attribute__((packed)) bits;
+  } __attribute__((packed));
 }
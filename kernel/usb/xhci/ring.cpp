@@ -1,90 +1,232 @@
 #include "usb/xhci/ring.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
 #include "usb/memory.hpp"
+#include "logger.hpp"
 
 namespace usb::xhci {
   Ring::~Ring() {
-    if (buf_ != nullptr) {
-      FreeMem(buf_);
+    for (auto segment : segments_) {
+      FreeMem(segment);
     }
   }
 
-  Error Ring::Initialize(size_t buf_size) {
-    if (buf_ != nullptr) {
-      FreeMem(buf_);
+  Error Ring::Initialize(size_t buf_size, size_t max_segments) {
+    for (auto segment : segments_) {
+      FreeMem(segment);
     }
+    segments_.clear();
 
     cycle_bit_ = true;
+    enqueue_segment_ = 0;
     write_index_ = 0;
-    buf_size_ = buf_size;
+    dequeue_segment_ = 0;
+    dequeue_index_ = 0;
+    segment_size_ = buf_size;
+    max_segments_ = std::max<size_t>(1, max_segments);
 
-    buf_ = AllocArray<TRB>(buf_size_, 64, 64 * 1024);
-    if (buf_ == nullptr) {
+    auto segment = AllocArray<TRB>(segment_size_, 64, 64 * 1024);
+    if (segment == nullptr) {
       return MAKE_ERROR(Error::kNoEnoughMemory);
     }
-    memset(buf_, 0, buf_size_ * sizeof(TRB));
+    memset(segment, 0, segment_size_ * sizeof(TRB));
+    segments_.push_back(segment);
 
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  Error Ring::Reserve(size_t num_trbs) {
+    while (NumFreeTRBs() < num_trbs) {
+      if (!Grow()) {
+        return MAKE_ERROR(Error::kFull);
+      }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
   void Ring::CopyToLast(const std::array<uint32_t, 4>& data) {
+    TRB* const dest = &segments_[enqueue_segment_][write_index_];
+    bool cycle_bit = cycle_bit_;
+    if (batching_ && batch_head_ == nullptr) {
+      // 先頭は CommitBatch まで xHC に所有権を渡さない
+      batch_head_ = dest;
+      batch_head_cycle_ = cycle_bit_;
+      cycle_bit = !cycle_bit_;
+    }
+
     for (int i = 0; i < 3; ++i) {
       // data[0..2] must be written prior to data[3].
-      buf_[write_index_].data[i] = data[i];
+      dest->data[i] = data[i];
+    }
+    dest->data[3] = (data[3] & 0xfffffffeu) | static_cast<uint32_t>(cycle_bit);
+  }
+
+  void Ring::BeginBatch() {
+    batching_ = true;
+    batch_head_ = nullptr;
+  }
+
+  void Ring::CommitBatch() {
+    batching_ = false;
+    if (batch_head_ == nullptr) {
+      return;
+    }
+
+    // 後続の TRB の書き込みが先頭の cycle bit より先に見えるようにする
+    std::atomic_thread_fence(std::memory_order_release);
+    volatile uint32_t& head_dword3 = batch_head_->data[3];
+    head_dword3 = (head_dword3 & 0xfffffffeu) | static_cast<uint32_t>(batch_head_cycle_);
+    batch_head_ = nullptr;
+  }
+
+  void Ring::UpdateDequeue(const TRB* completed) {
+    const long pos = Position(completed);
+    if (pos < 0) {
+      return;
+    }
+    dequeue_segment_ = pos / segment_size_;
+    dequeue_index_ = pos % segment_size_ + 1;
+    if (dequeue_index_ == segment_size_ - 1) {
+      // 次は Link TRB なので，その先のセグメントの先頭
+      dequeue_segment_ = (dequeue_segment_ + 1) % segments_.size();
+      dequeue_index_ = 0;
+    }
+  }
+
+  size_t Ring::NumFreeTRBs() const {
+    // 各セグメントの末尾は Link TRB なので数えない
+    const size_t usable = segment_size_ - 1;
+    const size_t num_segments = segments_.size();
+    size_t used;
+    if (enqueue_segment_ == dequeue_segment_ && write_index_ >= dequeue_index_) {
+      used = write_index_ - dequeue_index_;
+    } else {
+      const size_t between =
+        (enqueue_segment_ + num_segments - dequeue_segment_ - 1) % num_segments;
+      used = (usable - dequeue_index_) + between * usable + write_index_;
+    }
+    // 書き込み位置がデキュー位置に追いつくと空と区別できないので 1 つ空けておく
+    return usable * num_segments - used - 1;
+  }
+
+  bool Ring::InSpan(const TRB* first, const TRB* last, const TRB* trb) const {
+    const long first_pos = Position(first);
+    const long last_pos = Position(last);
+    const long pos = Position(trb);
+    if (first_pos < 0 || last_pos < 0 || pos < 0) {
+      return false;
     }
-    buf_[write_index_].data[3]
-      = (data[3] & 0xfffffffeu) | static_cast<uint32_t>(cycle_bit_);
+    const long ring_len = segments_.size() * segment_size_;
+    return (pos - first_pos + ring_len) % ring_len <= (last_pos - first_pos + ring_len) % ring_len;
   }
 
   TRB* Ring::Push(const std::array<uint32_t, 4>& data) {
-    auto trb_ptr = &buf_[write_index_];
+    if (NumFreeTRBs() == 0 && !Grow()) {
+      return nullptr;
+    }
+
+    auto trb_ptr = &segments_[enqueue_segment_][write_index_];
     CopyToLast(data);
 
     ++write_index_;
-    if (write_index_ == buf_size_ - 1) {
-      LinkTRB link{buf_};
-      link.bits.toggle_cycle = true;
+    if (write_index_ == segment_size_ - 1) {
+      const size_t next = (enqueue_segment_ + 1) % segments_.size();
+      LinkTRB link{segments_[next]};
+      link.bits.toggle_cycle = next == 0;
       CopyToLast(link.data);
 
+      enqueue_segment_ = next;
       write_index_ = 0;
-      cycle_bit_ = !cycle_bit_;
+      if (next == 0) {
+        cycle_bit_ = !cycle_bit_;
+      }
     }
 
     return trb_ptr;
   }
 
-  Error EventRing::Initialize(size_t buf_size,
+  bool Ring::Grow() {
+    if (segments_.size() >= max_segments_) {
+      return false;
+    }
+    if (dequeue_segment_ == enqueue_segment_ && dequeue_index_ > write_index_) {
+      return false;
+    }
+
+    auto segment = AllocArray<TRB>(segment_size_, 64, 64 * 1024);
+    if (segment == nullptr) {
+      return false;
+    }
+    // 書き込み位置が来るまで xHC に所有権を渡さないよう，cycle bit を今の逆にしておく
+    memset(segment, 0, segment_size_ * sizeof(TRB));
+    if (!cycle_bit_) {
+      for (size_t i = 0; i < segment_size_; ++i) {
+        segment[i].data[3] = 1;
+      }
+    }
+
+    // 差し込む位置のセグメントの Link TRB はまだ書いていない（書き込み位置より先にある）ので，
+    // Push がそこに達したときに新しいセグメントを指すように書けばよい
+    segments_.insert(segments_.begin() + enqueue_segment_ + 1, segment);
+    if (dequeue_segment_ > enqueue_segment_) {
+      ++dequeue_segment_;
+    }
+    Log(kDebug, "Ring: grown to %lu segments of %lu TRBs\n", segments_.size(), segment_size_);
+    return true;
+  }
+
+  long Ring::Position(const TRB* trb) const {
+    for (size_t i = 0; i < segments_.size(); ++i) {
+      if (segments_[i] <= trb && trb < segments_[i] + segment_size_) {
+        return i * segment_size_ + (trb - segments_[i]);
+      }
+    }
+    return -1;
+  }
+
+  Error EventRing::Initialize(size_t segment_size, size_t num_segments,
                               InterrupterRegisterSet* interrupter) {
-    if (buf_ != nullptr) {
-      FreeMem(buf_);
+    for (auto segment : segments_) {
+      FreeMem(segment);
     }
+    segments_.clear();
 
+    segment_size_ = segment_size;
+    segment_index_ = 0;
     cycle_bit_ = true;
-    buf_size_ = buf_size;
+    batch_size_ = 0;
     interrupter_ = interrupter;
 
-    buf_ = AllocArray<TRB>(buf_size_, 64, 64 * 1024);
-    if (buf_ == nullptr) {
-      return MAKE_ERROR(Error::kNoEnoughMemory);
+    // セグメントは 64 KiB 境界を跨いではいけない
+    for (size_t i = 0; i < num_segments; ++i) {
+      auto segment = AllocArray<TRB>(segment_size_, 64, 64 * 1024);
+      if (segment == nullptr) {
+        return MAKE_ERROR(Error::kNoEnoughMemory);
+      }
+      memset(segment, 0, segment_size_ * sizeof(TRB));
+      segments_.push_back(segment);
     }
-    memset(buf_, 0, buf_size_ * sizeof(TRB));
 
-    erst_ = AllocArray<EventRingSegmentTableEntry>(1, 64, 64 * 1024);
+    erst_ = AllocArray<EventRingSegmentTableEntry>(num_segments, 64, 64 * 1024);
     if (erst_ == nullptr) {
-      FreeMem(buf_);
       return MAKE_ERROR(Error::kNoEnoughMemory);
     }
-    memset(erst_, 0, 1 * sizeof(EventRingSegmentTableEntry));
+    memset(erst_, 0, num_segments * sizeof(EventRingSegmentTableEntry));
 
-    erst_[0].bits.ring_segment_base_address = reinterpret_cast<uint64_t>(buf_);
-    erst_[0].bits.ring_segment_size = buf_size_;
+    for (size_t i = 0; i < num_segments; ++i) {
+      erst_[i].bits.ring_segment_base_address = reinterpret_cast<uint64_t>(segments_[i]);
+      erst_[i].bits.ring_segment_size = segment_size_;
+    }
 
     ERSTSZ_Bitmap erstsz = interrupter_->ERSTSZ.Read();
-    erstsz.SetSize(1);
+    erstsz.SetSize(num_segments);
     interrupter_->ERSTSZ.Write(erstsz);
 
-    WriteDequeuePointer(&buf_[0]);
+    dequeue_ = segments_[0];
+    PublishFront();
+    WriteDequeuePointer(false);
 
     ERSTBA_Bitmap erstba = interrupter_->ERSTBA.Read();
     erstba.SetPointer(reinterpret_cast<uint64_t>(erst_));
@@ -93,24 +235,47 @@ namespace usb::xhci {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  void EventRing::WriteDequeuePointer(TRB* p) {
-    auto erdp = interrupter_->ERDP.Read();
-    erdp.SetPointer(reinterpret_cast<uint64_t>(p));
+  void EventRing::WriteDequeuePointer(bool clear_busy) {
+    // ERDP を読むとその分 MMIO アクセスが増えるので，値はすべてここで作る
+    ERDP_Bitmap erdp{};
+    erdp.SetPointer(reinterpret_cast<uint64_t>(dequeue_));
+    erdp.bits.dequeue_erst_segment_index = segment_index_;
+    erdp.bits.event_handler_busy = clear_busy;  // 1 を書くと 0 になる
     interrupter_->ERDP.Write(erdp);
   }
 
-  void EventRing::Pop() {
-    auto p = ReadDequeuePointer() + 1;
-
-    TRB* segment_begin
-      = reinterpret_cast<TRB*>(erst_[0].bits.ring_segment_base_address);
-    TRB* segment_end = segment_begin + erst_[0].bits.ring_segment_size;
+  void EventRing::UpdateDequeuePointer() {
+    ++stats_.interrupts;
+    if (batch_size_ > 0) {
+      ++stats_.batches;
+      if (batch_size_ > stats_.max_batch) {
+        stats_.max_batch = batch_size_;
+      }
+      batch_size_ = 0;
+    }
+    WriteDequeuePointer(true);
+  }
 
-    if (p == segment_end) {
-      p = segment_begin;
-      cycle_bit_ = !cycle_bit_;
+  void EventRing::Pop() {
+    auto hc_event = TRBDynamicCast<HostControllerEventTRB>(dequeue_);
+    if (hc_event && hc_event->bits.completion_code
+                    == HostControllerEventTRB::kEventRingFullError) {
+      ++stats_.ring_full;
     }
+    ++stats_.events;
+    ++batch_size_;
 
-    WriteDequeuePointer(p);
+    ++dequeue_;
+    if (dequeue_ == segments_[segment_index_] + segment_size_) {
+      ++segment_index_;
+      if (segment_index_ == segments_.size()) {
+        segment_index_ = 0;
+        cycle_bit_ = !cycle_bit_;
+      }
+      dequeue_ = segments_[segment_index_];
+      // 読み終えたセグメントをすぐに xHC へ返す．Busy は処理を終えるまで下ろさない
+      WriteDequeuePointer(false);
+    }
+    PublishFront();
   }
 }
@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <vector>
 
@@ -15,7 +16,13 @@
 #include "usb/xhci/trb.hpp"
 
 namespace usb::xhci {
-  /** @brief Command/Transfer Ring を表すクラス． */
+  /** @brief Command/Transfer Ring を表すクラス．
+   *
+   * 1 つ以上のセグメントを Link TRB でつないだ環で，最後のセグメントの Link TRB だけが
+   * cycle bit を反転させる．xHC が読み終えた位置（デキュー位置）を UpdateDequeue で
+   * 教えてもらい，未処理の TRB を上書きしないよう空きを数える．空きが足りなければ
+   * max_segments 個までセグメントを足して広げる．
+   */
   class Ring {
    public:
     Ring() = default;
@@ -23,28 +30,96 @@ namespace usb::xhci {
     ~Ring();
     Ring& operator=(const Ring&) = delete;
 
-    /** @brief リングのメモリ領域を割り当て，メンバを初期化する． */
-    Error Initialize(size_t buf_size);
+    /** @brief リングのメモリ領域を割り当て，メンバを初期化する．
+     *
+     * @param buf_size  1 セグメントの TRB 数（末尾の Link TRB を含む）
+     * @param max_segments  空きが足りないときに広げてよいセグメント数の上限
+     */
+    Error Initialize(size_t buf_size, size_t max_segments = 1);
 
     /** @brief TRB に cycle bit を設定した上でリング末尾に追加する．
      *
-     * @return 追加された（リング上の）TRB を指すポインタ．
+     * @return 追加された（リング上の）TRB を指すポインタ．空きが無ければ nullptr．
      */
     template <typename TRBType>
     TRB* Push(const TRBType& trb) {
       return Push(trb.data);
     }
 
-    TRB* Buffer() const { return buf_; }
+    /** @brief num_trbs 個の TRB を Push できるだけの空きを用意する．
+     *
+     * 空きが足りなければセグメントを足す．足せなければ何もせずに kFull を返すので，
+     * 呼び出し側は TD を積むのを後回しにする．複数の TRB から成る TD は
+     * 途中で空きが尽きないよう，BeginBatch の前にこれを呼ぶ．
+     */
+    Error Reserve(size_t num_trbs);
+
+    /** @brief 複数の TRB をまとめて公開する区間を始める．
+     *
+     * CommitBatch までに Push した TRB のうち，先頭だけは cycle bit を逆にして書く．
+     * xHC は先頭で止まるので，続く TRB を書き終える前に読み始めることはない．
+     */
+    void BeginBatch();
+
+    /** @brief BeginBatch 以降に Push した TRB を公開する．
+     *
+     * 書き込みがすべて見えるようにしてから先頭の cycle bit を反転させる．
+     * ドアベルは呼び出し側が 1 回だけ鳴らす．
+     */
+    void CommitBatch();
+
+    /** @brief xHC が completed まで処理し終えたことを記録する．
+     *
+     * 転送イベントやコマンド完了イベントが指す TRB を渡す．このリングの TRB でなければ無視する．
+     */
+    void UpdateDequeue(const TRB* completed);
+
+    /** @brief あと何個の TRB を（セグメントを足さずに）Push できるか */
+    size_t NumFreeTRBs() const;
+
+    /** @brief リング上の順で first から last までの間に trb があれば true */
+    bool InSpan(const TRB* first, const TRB* last, const TRB* trb) const;
+
+    /** @brief 先頭のセグメント．エンドポイントコンテキストや CRCR に設定する */
+    TRB* Buffer() const { return segments_.empty() ? nullptr : segments_[0]; }
+    size_t NumSegments() const { return segments_.size(); }
+
+    /** @brief 次に書き込む TRB と，そこに書く cycle bit．
+     *
+     * 積んだ TRB を捨てるときに Set TR Dequeue Pointer コマンドで xHC に教える．
+     */
+    TRB* EnqueuePointer() const { return &segments_[enqueue_segment_][write_index_]; }
+    bool CycleBit() const { return cycle_bit_; }
+
+    /** @brief 積んだがまだ処理されていない TRB をすべて処理済みとみなす．
+     *
+     * xHC のデキュー位置を EnqueuePointer() に移したときに呼ぶ．
+     */
+    void DiscardPending() {
+      dequeue_segment_ = enqueue_segment_;
+      dequeue_index_ = write_index_;
+    }
 
    private:
-    TRB* buf_ = nullptr;
-    size_t buf_size_ = 0;
+    /** @brief セグメントの並び．i 番の Link TRB は i + 1 番（最後は 0 番）を指す */
+    std::vector<TRB*> segments_;
+    size_t segment_size_ = 0;
+    size_t max_segments_ = 1;
 
     /** @brief プロデューサ・サイクル・ステートを表すビット */
     bool cycle_bit_;
     /** @brief リング上で次に書き込む位置 */
+    size_t enqueue_segment_;
     size_t write_index_;
+    /** @brief xHC がまだ処理し終えていない最初の TRB の位置 */
+    size_t dequeue_segment_;
+    size_t dequeue_index_;
+
+    /** @brief BeginBatch から CommitBatch までの間 true */
+    bool batching_ = false;
+    /** @brief まとめて公開する TRB の先頭と，そこに書くべき cycle bit */
+    TRB* batch_head_ = nullptr;
+    bool batch_head_cycle_;
 
     /** @brief TRB に cycle bit を設定した上でリング末尾に書き込む．
      *
@@ -54,13 +129,25 @@ namespace usb::xhci {
 
     /** @brief TRB に cycle bit を設定した上でリング末尾に追加する．
      *
-     * write_index_ をインクリメントする．その結果 write_index_ がリング末尾
-     * に達したら LinkTRB を適切に配置して write_index_ を 0 に戻し，
-     * cycle bit を反転させる．
+     * write_index_ をインクリメントする．その結果 write_index_ がセグメント末尾
+     * に達したら次のセグメントへの LinkTRB を配置して次のセグメントの先頭に移る．
+     * 最後のセグメントなら LinkTRB で cycle bit を反転させる．
      *
-     * @return 追加された（リング上の）TRB を指すポインタ．
+     * @return 追加された（リング上の）TRB を指すポインタ．空きが無ければ nullptr．
      */
     TRB* Push(const std::array<uint32_t, 4>& data);
+
+    /** @brief 書き込み中のセグメントの直後に新しいセグメントを差し込む．
+     *
+     * デキュー位置が同じセグメントの書き込み位置より先にあると，xHC は
+     * そのセグメントの Link TRB を辿って新しいセグメントに入ってしまうので差し込まない．
+     *
+     * @return 差し込めたら true
+     */
+    bool Grow();
+
+    /** @brief リングの先頭からの通し番号．このリングの TRB でなければ -1 */
+    long Position(const TRB* trb) const;
   };
 
   union EventRingSegmentTableEntry {
@@ -75,32 +162,88 @@ namespace usb::xhci {
     } __attribute__((packed)) bits;
   };
 
+  /** @brief イベントリングの統計． */
+  struct EventRingStats {
+    /** @brief 取り出したイベントの数 */
+    uint64_t events;
+    /** @brief UpdateDequeuePointer を呼んだ回数．ポーリングやビジーループで処理した回も含む */
+    uint64_t interrupts;
+    /** @brief UpdateDequeuePointer で取り出したイベントの塊を書き戻した回数 */
+    uint64_t batches;
+    /** @brief 1 回の書き戻しまでに取り出したイベント数の最大値 */
+    uint64_t max_batch;
+    /** @brief リングが一杯になったこと（Event Ring Full Error）を通知された回数 */
+    uint64_t ring_full;
+  };
+
+  /** @brief 複数のセグメントから成る Event Ring を表すクラス．
+   *
+   * 取り出し位置はソフトウェア側で保持し，Pop の度には ERDP を書き換えない．
+   * 取り出したイベントの塊を処理し終えたら UpdateDequeuePointer で
+   * まとめて書き戻す．ただしセグメントを読み終えた時点でも書き戻し，
+   * 長く取り出し続けている間も xHC が読み終えたセグメントを使えるようにする．
+   */
   class EventRing {
    public:
-    Error Initialize(size_t buf_size, InterrupterRegisterSet* interrupter);
-
-    TRB* ReadDequeuePointer() const {
-      return reinterpret_cast<TRB*>(interrupter_->ERDP.Read().Pointer());
-    }
-
-    void WriteDequeuePointer(TRB* p);
+    /** @brief segment_size 個の TRB から成るセグメントを num_segments 個確保し，
+     * interrupter に登録する．
+     */
+    Error Initialize(size_t segment_size, size_t num_segments,
+                     InterrupterRegisterSet* interrupter);
 
     bool HasFront() const {
       return Front()->bits.cycle_bit == cycle_bit_;
     }
 
     TRB* Front() const {
-      return ReadDequeuePointer();
+      return dequeue_;
     }
 
+    /** @brief イベントを取り出すコア以外（見張りのコアやタイマ割り込み）から HasFront を調べる．
+     *
+     * Pop は取り出し位置と cycle bit を順に書き換えるので，途中ではセグメントの外を指したり
+     * cycle bit だけが反転していたりする．ここでは Pop が書き終えた組（front_snapshot_）だけを読む．
+     */
+    bool HasFrontSnapshot() const {
+      const auto snapshot = front_snapshot_.load(std::memory_order_acquire);
+      auto front = reinterpret_cast<const volatile TRB*>(snapshot & ~uintptr_t{1});
+      return front->bits.cycle_bit == (snapshot & 1);
+    }
+
+    /** @brief 先頭のイベントを取り除く．ERDP にはまだ書き戻さない． */
     void Pop();
 
+    /** @brief 取り出した位置を ERDP に書き戻し，Event Handler Busy を下ろす．
+     *
+     * イベントを処理し終える度（割り込み 1 回につき 1 回）に呼ぶ．
+     * イベントが無くても Event Handler Busy を下ろすために呼ぶ．
+     */
+    void UpdateDequeuePointer();
+
+    const EventRingStats& Stats() const { return stats_; }
+
    private:
-    TRB* buf_;
-    size_t buf_size_;
+    std::vector<TRB*> segments_;
+    size_t segment_size_;
 
+    /** @brief 次に読むセグメントの番号と TRB */
+    size_t segment_index_;
+    TRB* dequeue_;
     bool cycle_bit_;
+    /** @brief dequeue_ と cycle_bit_ の組．TRB は 16 バイト境界にあるので，ビット 0 に cycle bit を入れる */
+    std::atomic<uintptr_t> front_snapshot_{0};
+    /** @brief 最後に ERDP を書き戻してから取り出したイベントの数 */
+    size_t batch_size_;
+
     EventRingSegmentTableEntry* erst_;
     InterrupterRegisterSet* interrupter_;
+    EventRingStats stats_{};
+
+    void WriteDequeuePointer(bool clear_busy);
+    /** @brief dequeue_ と cycle_bit_ が揃ったところで front_snapshot_ に書く */
+    void PublishFront() {
+      front_snapshot_.store(reinterpret_cast<uintptr_t>(dequeue_) | cycle_bit_,
+                            std::memory_order_release);
+    }
   };
 }
@@ -240,6 +240,29 @@ namespace usb::xhci {
     }
   };
 
+  union DisableSlotCommandTRB {
+    static const unsigned int Type = 10;
+    std::array<uint32_t, 4> data{};
+    struct {
+      uint32_t : 32;
+
+      uint32_t : 32;
+
+      uint32_t : 32;
+
+      uint32_t cycle_bit : 1;
+      uint32_t : 9;
+      uint32_t trb_type : 6;
+      uint32_t : 8;
+      uint32_t slot_id : 8;
+    } __attribute__((packed)) bits;
+
+    DisableSlotCommandTRB(uint8_t slot_id) {
+      bits.trb_type = Type;
+      bits.slot_id = slot_id;
+    }
+  };
+
   union AddressDeviceCommandTRB {
     static const unsigned int Type = 11;
     std::array<uint32_t, 4> data{};
@@ -257,17 +280,17 @@ namespace usb::xhci {
       uint32_t slot_id : 8;
     } __attribute__((packed)) bits;
 
-    AddressDeviceCommandTRB(const InputContext* input_context, uint8_t slot_id) {
+    AddressDeviceCommandTRB(const InputContext& input_context, uint8_t slot_id) {
       bits.trb_type = Type;
       bits.slot_id = slot_id;
-      SetPointer(input_context);
+      SetPointer(input_context.Buffer());
     }
 
-    InputContext* Pointer() const {
-      return reinterpret_cast<InputContext*>(bits.input_context_pointer << 4);
+    void* Pointer() const {
+      return reinterpret_cast<void*>(bits.input_context_pointer << 4);
     }
 
-    void SetPointer(const InputContext* p) {
+    void SetPointer(const void* p) {
       bits.input_context_pointer = reinterpret_cast<uint64_t>(p) >> 4;
     }
   };
@@ -289,21 +312,51 @@ namespace usb::xhci {
       uint32_t slot_id : 8;
     } __attribute__((packed)) bits;
 
-    ConfigureEndpointCommandTRB(const InputContext* input_context, uint8_t slot_id) {
+    ConfigureEndpointCommandTRB(const InputContext& input_context, uint8_t slot_id) {
       bits.trb_type = Type;
       bits.slot_id = slot_id;
-      SetPointer(input_context);
+      SetPointer(input_context.Buffer());
     }
 
-    InputContext* Pointer() const {
-      return reinterpret_cast<InputContext*>(bits.input_context_pointer << 4);
+    void* Pointer() const {
+      return reinterpret_cast<void*>(bits.input_context_pointer << 4);
     }
 
-    void SetPointer(const InputContext* p) {
+    void SetPointer(const void* p) {
       bits.input_context_pointer = reinterpret_cast<uint64_t>(p) >> 4;
     }
   };
 
+  union ResetEndpointCommandTRB {
+    static const unsigned int Type = 14;
+    std::array<uint32_t, 4> data{};
+    struct {
+      uint32_t : 32;
+
+      uint32_t : 32;
+
+      uint32_t : 32;
+
+      uint32_t cycle_bit : 1;
+      uint32_t : 8;
+      uint32_t transfer_state_preserve : 1;
+      uint32_t trb_type : 6;
+      uint32_t endpoint_id : 5;
+      uint32_t : 3;
+      uint32_t slot_id : 8;
+    } __attribute__((packed)) bits;
+
+    ResetEndpointCommandTRB(EndpointID endpoint_id, uint8_t slot_id) {
+      bits.trb_type = Type;
+      bits.endpoint_id = endpoint_id.Address();
+      bits.slot_id = slot_id;
+    }
+
+    EndpointID EndpointID() const {
+      return usb::EndpointID{bits.endpoint_id};
+    }
+  };
+
   union StopEndpointCommandTRB {
     static const unsigned int Type = 15;
     std::array<uint32_t, 4> data{};
@@ -334,6 +387,39 @@ namespace usb::xhci {
     }
   };
 
+  union SetTRDequeuePointerCommandTRB {
+    static const unsigned int Type = 16;
+    std::array<uint32_t, 4> data{};
+    struct {
+      uint64_t dequeue_cycle_state : 1;
+      uint64_t stream_context_type : 3;
+      uint64_t dequeue_pointer : 60;
+
+      uint32_t : 16;
+      uint32_t stream_id : 16;
+
+      uint32_t cycle_bit : 1;
+      uint32_t : 9;
+      uint32_t trb_type : 6;
+      uint32_t endpoint_id : 5;
+      uint32_t : 3;
+      uint32_t slot_id : 8;
+    } __attribute__((packed)) bits;
+
+    SetTRDequeuePointerCommandTRB(EndpointID endpoint_id, uint8_t slot_id,
+                                  const TRB* dequeue, bool cycle_state) {
+      bits.trb_type = Type;
+      bits.endpoint_id = endpoint_id.Address();
+      bits.slot_id = slot_id;
+      bits.dequeue_pointer = reinterpret_cast<uint64_t>(dequeue) >> 4;
+      bits.dequeue_cycle_state = cycle_state;
+    }
+
+    EndpointID EndpointID() const {
+      return usb::EndpointID{bits.endpoint_id};
+    }
+  };
+
   union NoOpCommandTRB {
     static const unsigned int Type = 23;
     std::array<uint32_t, 4> data{};
@@ -443,6 +529,28 @@ namespace usb::xhci {
     }
   };
 
+  union HostControllerEventTRB {
+    static const unsigned int Type = 37;
+    /** @brief Event Ring Full Error の Completion Code */
+    static const unsigned int kEventRingFullError = 21;
+    std::array<uint32_t, 4> data{};
+    struct {
+      uint64_t : 64;
+
+      uint32_t : 24;
+      uint32_t completion_code : 8;
+
+      uint32_t cycle_bit : 1;
+      uint32_t : 9;
+      uint32_t trb_type : 6;
+      uint32_t : 16;
+    } __attribute__((packed)) bits;
+
+    HostControllerEventTRB() {
+      bits.trb_type = Type;
+    }
+  };
+
   /** @brief TRBDynamicCast casts a trb pointer to other type of TRB.
    *
    * @param trb  source pointer
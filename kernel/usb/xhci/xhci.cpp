@@ -1,12 +1,22 @@
 #include "usb/xhci/xhci.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
+#include "clock.hpp"
+#include "job.hpp"
 #include "logger.hpp"
+#include "message.hpp"
 #include "pci.hpp"
+#include "smp.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+#include "usb/hashmap.hpp"
 #include "interrupt.hpp"
 #include "usb/setupdata.hpp"
 #include "usb/device.hpp"
 #include "usb/descriptor.hpp"
+#include "usb/classdriver/hub.hpp"
 #include "usb/xhci/speed.hpp"
 
 namespace {
@@ -32,18 +42,76 @@ namespace {
     kConfiguringEndpoints,
     kConfigured,
   };
-  /* root hub port はリセット処理をしてからアドレスを割り当てるまでは
+  /* ポートはリセット処理をしてからアドレスを割り当てるまでは
    * 他の処理を挟まず，そのポートについての処理だけをしなければならない．
    * kWaitingAddressed はリセット（kResettingPort）からアドレス割り当て
    * （kAddressingDevice）までの一連の処理の実行を待っている状態．
+   *
+   * デフォルトアドレス（0）のデバイスは 1 つのバスに 1 つしか置けないので，この直列化は
+   * ルートハブ（USB2 のポート群と USB3 のポート群）ごとに行えばよい．
+   * ハブの下流ポートは，そのハブがつながったルートハブで順番を待つ．
+   * アドレスを割り当てた後のディスクリプタの取得やエンドポイントの設定は
+   * スロットごとに独立して進める．
    */
 
+  /** @brief ルートハブのポートの状態．アドレスを割り当てた後は slot_config_phase と同じ */
   std::array<volatile ConfigPhase, 256> port_config_phase{};  // index: port number
+  /** @brief アドレスを割り当てたデバイスの状態 */
+  std::array<volatile ConfigPhase, 256> slot_config_phase{};  // index: slot id
+
+  /** @brief ルートハブの数．USB2 と USB3 */
+  const int kNumRootHubs = 2;
+
+  /** @brief リセットからアドレス割り当てまでの処理を実行中のポート */
+  struct AddressingPort {
+    /** @brief ルートハブのポート番号．0 ならその状態のポートがないことを示す */
+    uint8_t root_port;
+    /** @brief ハブの下流ポートならハブのスロット ID とポート番号．ルートハブのポートなら 0 */
+    uint8_t hub_slot;
+    uint8_t hub_port;
+    /** @brief ハブの下流ポートのデバイスの速度（Protocol Speed ID） */
+    int speed;
+  };
+  std::array<AddressingPort, kNumRootHubs> addressing_port{};
+
+  /** @brief ハブの下流ポートのうち，アドレス割り当ての順番を待っているもの．ビット番号がポート番号 */
+  std::array<uint16_t, 256> hub_ports_waiting{};  // index: hub slot id
+
+  /** @brief 完了を待っている Enable Slot Command の TRB と，そのスロットを使うルートハブ */
+  usb::HashMap<const void*, uint8_t, 32> enabling_slot_hub{};
+
+  /** @brief ポートの接続を見つけたときの TSC．構成を終えるまでの時間を測る */
+  std::array<uint64_t, 256> port_connect_counter{};  // index: port number
+  usb::HashMap<uint16_t, uint64_t, 32> hub_port_connect_counter{};  // key: HubPortKey
+  std::array<uint64_t, 256> slot_connect_counter{};  // index: slot id
+
+  uint16_t HubPortKey(uint8_t hub_slot, uint8_t port) {
+    return static_cast<uint16_t>(hub_slot) << 8 | port;
+  }
+
+  int RootHubIndex(const Controller& xhc, uint8_t port_num) {
+    return xhc.PortMajorRevision(port_num) == 3 ? 1 : 0;
+  }
+
+  /** @brief route string で使われている段数 */
+  int RouteTiers(uint32_t route_string) {
+    int tiers = 0;
+    while (tiers < 5 && ((route_string >> (4 * tiers)) & 0xfu) != 0) {
+      ++tiers;
+    }
+    return tiers;
+  }
 
-  /** kResettingPort から kAddressingDevice までの処理を実行中のポート番号．
-   * 0 ならその状態のポートがないことを示す．
+  /** @brief アドレスを割り当てたデバイスの状態を更新する．
+   * ルートハブのポートに直接つながっていれば，ポートの状態も合わせる．
    */
-  uint8_t addressing_port{0};
+  void SetConfigPhase(Device& dev, ConfigPhase phase) {
+    const auto& slot_ctx = dev.DeviceContext()->Slot();
+    slot_config_phase[dev.SlotID()] = phase;
+    if (slot_ctx.bits.route_string == 0) {
+      port_config_phase[slot_ctx.bits.root_hub_port_num] = phase;
+    }
+  }
 
   void InitializeSlotContext(SlotContext& ctx, Port& port) {
     ctx.bits.route_string = 0;
@@ -52,6 +120,33 @@ namespace {
     ctx.bits.speed = port.Speed();
   }
 
+  /** @brief ハブの下流ポートにつながったデバイスのスロットコンテキストを設定する */
+  void InitializeSlotContext(SlotContext& ctx, Device& hub, uint8_t hub_port, int speed) {
+    const auto& hub_ctx = hub.DeviceContext()->Slot();
+    const int tier = RouteTiers(hub_ctx.bits.route_string);
+    ctx.bits.route_string = hub_ctx.bits.route_string | (hub_port << (4 * tier));
+    ctx.bits.root_hub_port_num = hub_ctx.bits.root_hub_port_num;
+    ctx.bits.context_entries = 1;
+    ctx.bits.speed = speed;
+
+    ctx.bits.tt_hub_slot_id = 0;
+    ctx.bits.tt_port_num = 0;
+    ctx.bits.mtt = 0;
+    if (speed == kFullSpeed || speed == kLowSpeed) {
+      if (hub_ctx.bits.speed == kHighSpeed) {
+        // HS のハブの TT が LS/FS のトランザクションに変換する
+        ctx.bits.tt_hub_slot_id = hub.SlotID();
+        ctx.bits.tt_port_num = hub_port;
+        ctx.bits.mtt = hub_ctx.bits.mtt;
+      } else {
+        // LS/FS のハブの下では，そのハブが使う TT をそのまま使う
+        ctx.bits.tt_hub_slot_id = hub_ctx.bits.tt_hub_slot_id;
+        ctx.bits.tt_port_num = hub_ctx.bits.tt_port_num;
+        ctx.bits.mtt = hub_ctx.bits.mtt;
+      }
+    }
+  }
+
   unsigned int DetermineMaxPacketSizeForControlPipe(unsigned int slot_speed) {
     switch (slot_speed) {
     case 4: // Super Speed
@@ -97,7 +192,12 @@ namespace {
       return MAKE_ERROR(Error::kSuccess);
     }
 
-    if (addressing_port != 0) {
+    if (port_config_phase[port.Number()] == ConfigPhase::kNotConnected) {
+      port_connect_counter[port.Number()] = Clock::ReadCounter();
+    }
+
+    auto& addressing = addressing_port[RootHubIndex(xhc, port.Number())];
+    if (addressing.root_port != 0) {
       port_config_phase[port.Number()] = ConfigPhase::kWaitingAddressed;
     } else {
       const auto port_phase = port_config_phase[port.Number()];
@@ -105,13 +205,51 @@ namespace {
           port_phase != ConfigPhase::kWaitingAddressed) {
         return MAKE_ERROR(Error::kInvalidPhase);
       }
-      addressing_port = port.Number();
+      addressing = AddressingPort{port.Number()};
       port_config_phase[port.Number()] = ConfigPhase::kResettingPort;
       port.Reset();
     }
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  struct TransferRingSize {
+    /** @brief 1 セグメントの TRB 数（Link TRB を含む） */
+    size_t segment_size;
+    /** @brief 空きが足りないときに広げてよいセグメント数 */
+    size_t max_segments;
+  };
+
+  /** @brief エンドポイントの種類と最大パケットサイズから転送リングの大きさを決める．
+   *
+   * コントロールとインタラプトは TD が小さく，同時に積むのも数個なので小さくてよい．
+   * バルクは 1 つの TD が 64 KiB ごとに TRB を使い，TD を続けて積むので大きくする．
+   * 1 パケットが大きい（SuperSpeed の 1024 バイト）エンドポイントは転送量も多いので更に大きくする．
+   */
+  TransferRingSize TransferRingSizeFor(usb::EndpointType type, int max_packet_size = 0) {
+    switch (type) {
+    case usb::EndpointType::kControl:
+    case usb::EndpointType::kInterrupt:
+      return {32, 2};
+    case usb::EndpointType::kBulk:
+    case usb::EndpointType::kIsochronous:
+      return {max_packet_size >= 1024 ? 256u : 128u, 4};
+    }
+    return {32, 1};
+  }
+
+  Error PushEnableSlotCommand(Controller& xhc, int root_hub) {
+    EnableSlotCommandTRB cmd{};
+    auto cmd_trb = xhc.CommandRing()->Push(cmd);
+    if (cmd_trb == nullptr) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    if (auto err = enabling_slot_hub.Put(cmd_trb, root_hub)) {
+      return err;
+    }
+    xhc.RingCommandDoorbell();
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
   Error EnableSlot(Controller& xhc, Port& port) {
     const bool is_enabled = port.IsEnabled();
     const bool reset_completed = port.IsPortResetChanged();
@@ -123,16 +261,22 @@ namespace {
       port.ClearPortResetChange();
 
       port_config_phase[port.Number()] = ConfigPhase::kEnablingSlot;
-
-      EnableSlotCommandTRB cmd{};
-      xhc.CommandRing()->Push(cmd);
-      xhc.DoorbellRegisterAt(0)->Ring(0);
+      return PushEnableSlotCommand(xhc, RootHubIndex(xhc, port.Number()));
     }
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error AddressDevice(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
-    Log(kDebug, "AddressDevice: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  Error AddressDevice(Controller& xhc, const AddressingPort& addressing, uint8_t slot_id) {
+    Log(kDebug, "AddressDevice: port_id = %d, hub_slot = %d, hub_port = %d, slot_id = %d\n",
+        addressing.root_port, addressing.hub_slot, addressing.hub_port, slot_id);
+
+    Device* hub = nullptr;
+    if (addressing.hub_slot != 0) {
+      hub = xhc.DeviceManager()->FindBySlot(addressing.hub_slot);
+      if (hub == nullptr) {
+        return MAKE_ERROR(Error::kInvalidSlotID);
+      }
+    }
 
     xhc.DeviceManager()->AllocDevice(slot_id, xhc.DoorbellRegisterAt(slot_id));
 
@@ -141,56 +285,103 @@ namespace {
       return MAKE_ERROR(Error::kInvalidSlotID);
     }
 
-    memset(&dev->InputContext()->input_control_context, 0,
+    memset(&dev->InputContext()->Control(), 0,
            sizeof(InputControlContext));
 
     const auto ep0_dci = DeviceContextIndex(0, false);
     auto slot_ctx = dev->InputContext()->EnableSlotContext();
     auto ep0_ctx = dev->InputContext()->EnableEndpoint(ep0_dci);
 
-    auto port = xhc.PortAt(port_id);
-    InitializeSlotContext(*slot_ctx, port);
+    if (hub) {
+      InitializeSlotContext(*slot_ctx, *hub, addressing.hub_port, addressing.speed);
+      const auto key = HubPortKey(addressing.hub_slot, addressing.hub_port);
+      slot_connect_counter[slot_id] = hub_port_connect_counter.Get(key).value_or(0);
+      hub_port_connect_counter.Delete(key);
+    } else {
+      auto port = xhc.PortAt(addressing.root_port);
+      InitializeSlotContext(*slot_ctx, port);
+      slot_connect_counter[slot_id] = port_connect_counter[addressing.root_port];
+      port_config_phase[addressing.root_port] = ConfigPhase::kAddressingDevice;
+    }
 
+    const auto ep0_ring_size = TransferRingSizeFor(usb::EndpointType::kControl);
+    auto ep0_ring = dev->AllocTransferRing(
+        ep0_dci, ep0_ring_size.segment_size, ep0_ring_size.max_segments);
+    if (ep0_ring == nullptr) {
+      return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
     InitializeEP0Context(
-        *ep0_ctx, dev->AllocTransferRing(ep0_dci, 32),
+        *ep0_ctx, ep0_ring,
         DetermineMaxPacketSizeForControlPipe(slot_ctx->bits.speed));
 
     xhc.DeviceManager()->LoadDCBAA(slot_id);
 
-    port_config_phase[port_id] = ConfigPhase::kAddressingDevice;
+    slot_config_phase[slot_id] = ConfigPhase::kAddressingDevice;
 
-    AddressDeviceCommandTRB addr_dev_cmd{dev->InputContext(), slot_id};
-    xhc.CommandRing()->Push(addr_dev_cmd);
-    xhc.DoorbellRegisterAt(0)->Ring(0);
+    AddressDeviceCommandTRB addr_dev_cmd{*dev->InputContext(), slot_id};
+    if (xhc.CommandRing()->Push(addr_dev_cmd) == nullptr) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    xhc.RingCommandDoorbell();
 
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error InitializeDevice(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
-    Log(kDebug, "InitializeDevice: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  /** @brief ルートハブ root_hub で順番を待っているポートのうち 1 つの処理を始める．
+   *
+   * ルートハブのポートを先に，次にハブの下流ポートを調べる．
+   */
+  Error StartNextAddressing(Controller& xhc, int root_hub) {
+    for (int i = 1; i <= xhc.MaxPorts(); ++i) {
+      if (port_config_phase[i] == ConfigPhase::kWaitingAddressed &&
+          RootHubIndex(xhc, i) == root_hub) {
+        auto port = xhc.PortAt(i);
+        return ResetPort(xhc, port);
+      }
+    }
 
-    auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
-    if (dev == nullptr) {
-      return MAKE_ERROR(Error::kInvalidSlotID);
+    for (size_t slot = 1; slot < hub_ports_waiting.size(); ++slot) {
+      if (hub_ports_waiting[slot] == 0) {
+        continue;
+      }
+      auto hub = xhc.DeviceManager()->FindBySlot(slot);
+      if (hub == nullptr) {
+        hub_ports_waiting[slot] = 0;
+        continue;
+      }
+      const auto root_port = hub->DeviceContext()->Slot().bits.root_hub_port_num;
+      if (RootHubIndex(xhc, root_port) != root_hub) {
+        continue;
+      }
+      const int port = __builtin_ctz(hub_ports_waiting[slot]);
+      hub_ports_waiting[slot] &= ~(1u << port);
+      return ResetHubPort(xhc, *hub, port);
     }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error InitializeDevice(Controller& xhc, Device& dev) {
+    Log(kDebug, "InitializeDevice: slot_id = %d\n", dev.SlotID());
 
-    port_config_phase[port_id] = ConfigPhase::kInitializingDevice;
-    dev->StartInitialize();
+    SetConfigPhase(dev, ConfigPhase::kInitializingDevice);
+    dev.StartInitialize();
 
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error CompleteConfiguration(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
-    Log(kDebug, "CompleteConfiguration: port_id = %d, slot_id = %d\n", port_id, slot_id);
-
-    auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
-    if (dev == nullptr) {
-      return MAKE_ERROR(Error::kInvalidSlotID);
-    }
+  Error CompleteConfiguration(Controller& xhc, Device& dev) {
+    Log(kDebug, "CompleteConfiguration: slot_id = %d\n", dev.SlotID());
 
-    dev->OnEndpointsConfigured();
+    dev.OnEndpointsConfigured();
 
-    port_config_phase[port_id] = ConfigPhase::kConfigured;
+    SetConfigPhase(dev, ConfigPhase::kConfigured);
+    const auto& slot_ctx = dev.DeviceContext()->Slot();
+    Log(kInfo, "slot %d (port %d, USB%d, route 0x%05x) configured in %lu us\n",
+        dev.SlotID(), slot_ctx.bits.root_hub_port_num,
+        xhc.PortMajorRevision(slot_ctx.bits.root_hub_port_num),
+        slot_ctx.bits.route_string,
+        Clock::CounterToNanoseconds(
+          Clock::ReadCounter() - slot_connect_counter[dev.SlotID()]) / 1000);
     return MAKE_ERROR(Error::kSuccess);
   }
 
@@ -219,70 +410,122 @@ namespace {
       return err;
     }
 
-    const auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
     if (dev->IsInitialized() &&
-        port_config_phase[port_id] == ConfigPhase::kInitializingDevice) {
+        slot_config_phase[slot_id] == ConfigPhase::kInitializingDevice) {
       return ConfigureEndpoints(xhc, *dev);
     }
     return MAKE_ERROR(Error::kSuccess);
   }
 
   Error OnEvent(Controller& xhc, CommandCompletionEventTRB& trb) {
+    xhc.CommandRing()->UpdateDequeue(trb.Pointer());
     const auto issuer_type = trb.Pointer()->bits.trb_type;
     const auto slot_id = trb.bits.slot_id;
     Log(kDebug, "CommandCompletionEvent: slot_id = %d, issuer = %s\n",
         trb.bits.slot_id, kTRBTypeToName[issuer_type]);
 
     if (issuer_type == EnableSlotCommandTRB::Type) {
-      if (port_config_phase[addressing_port] != ConfigPhase::kEnablingSlot) {
+      const auto root_hub = enabling_slot_hub.Get(trb.Pointer());
+      if (!root_hub) {
         return MAKE_ERROR(Error::kInvalidPhase);
       }
+      enabling_slot_hub.Delete(trb.Pointer());
 
-      return AddressDevice(xhc, addressing_port, slot_id);
+      const auto& addressing = addressing_port[*root_hub];
+      if (addressing.root_port == 0 ||
+          (addressing.hub_slot == 0 &&
+           port_config_phase[addressing.root_port] != ConfigPhase::kEnablingSlot)) {
+        return MAKE_ERROR(Error::kInvalidPhase);
+      }
+
+      return AddressDevice(xhc, addressing, slot_id);
     } else if (issuer_type == AddressDeviceCommandTRB::Type) {
       auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
       if (dev == nullptr) {
         return MAKE_ERROR(Error::kInvalidSlotID);
       }
 
-      auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
+      auto port_id = dev->DeviceContext()->Slot().bits.root_hub_port_num;
 
-      if (port_id != addressing_port) {
+      const int root_hub = RootHubIndex(xhc, port_id);
+      if (port_id != addressing_port[root_hub].root_port) {
         return MAKE_ERROR(Error::kInvalidPhase);
       }
-      if (port_config_phase[port_id] != ConfigPhase::kAddressingDevice) {
+      if (slot_config_phase[slot_id] != ConfigPhase::kAddressingDevice) {
         return MAKE_ERROR(Error::kInvalidPhase);
       }
 
-      addressing_port = 0;
-      for (int i = 0; i < port_config_phase.size(); ++i) {
-        if (port_config_phase[i] == ConfigPhase::kWaitingAddressed) {
-          auto port = xhc.PortAt(i);
-          if (auto err = ResetPort(xhc, port); err) {
-            return err;
-          }
-          break;
-        }
+      // 同じルートハブで待っているポートの処理を始める
+      addressing_port[root_hub] = AddressingPort{};
+      if (auto err = StartNextAddressing(xhc, root_hub)) {
+        return err;
       }
 
-      return InitializeDevice(xhc, port_id, slot_id);
+      return InitializeDevice(xhc, *dev);
     } else if (issuer_type == ConfigureEndpointCommandTRB::Type) {
       auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
       if (dev == nullptr) {
         return MAKE_ERROR(Error::kInvalidSlotID);
       }
 
-      auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-      if (port_config_phase[port_id] != ConfigPhase::kConfiguringEndpoints) {
+      if (dev->IsReconfiguringEndpoint()) {
+        return dev->OnEndpointReconfigured(trb.bits.completion_code);
+      }
+      if (slot_config_phase[slot_id] == ConfigPhase::kConfigured) {
+        // ConfigureHubSlot で設定したハブの情報が反映された
+        Log(kDebug, "slot %d: hub with %d ports configured\n",
+            slot_id, dev->DeviceContext()->Slot().bits.num_ports);
+        return MAKE_ERROR(Error::kSuccess);
+      }
+      if (slot_config_phase[slot_id] != ConfigPhase::kConfiguringEndpoints) {
         return MAKE_ERROR(Error::kInvalidPhase);
       }
 
-      return CompleteConfiguration(xhc, port_id, slot_id);
+      return CompleteConfiguration(xhc, *dev);
+    } else if (issuer_type == DisableSlotCommandTRB::Type) {
+      slot_config_phase[slot_id] = ConfigPhase::kNotConnected;
+      hub_ports_waiting[slot_id] = 0;
+      return xhc.DeviceManager()->Remove(slot_id);
+    } else if (issuer_type == ResetEndpointCommandTRB::Type ||
+               issuer_type == StopEndpointCommandTRB::Type ||
+               issuer_type == SetTRDequeuePointerCommandTRB::Type) {
+      auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
+      if (dev == nullptr) {
+        return MAKE_ERROR(Error::kInvalidSlotID);
+      }
+      // 3 つのコマンドはどれも Endpoint ID を control の下位 5 ビットに持つ
+      const DeviceContextIndex dci{static_cast<int>(trb.Pointer()->bits.control & 0x1fu)};
+      return dev->OnEndpointCommandCompleted(issuer_type, dci, trb.bits.completion_code);
     }
 
     return MAKE_ERROR(Error::kInvalidPhase);
   }
 
+  void LogHashMapStats(const char* name, const usb::HashMapStats& stats) {
+    Log(kWarn, "  %s: size %lu (peak %lu), max probe %lu, full %lu times\n",
+        name, stats.size, stats.peak_size, stats.max_probe, stats.full);
+  }
+
+  Error OnEvent(const EventRing& er, HostControllerEventTRB& trb) {
+    const auto& stats = er.Stats();
+    Log(kWarn, "HostControllerEvent: %s (ring full %lu times, max batch %lu)\n",
+        kTRBCompletionCodeToName[trb.bits.completion_code],
+        stats.ring_full, stats.max_batch);
+
+    // 表が溢れて TRB の対応を失っていないか，イベントリングと合わせて見る
+    LogHashMapStats("enabling_slot_hub", enabling_slot_hub.Stats());
+    LogHashMapStats("hub_port_connect_counter", hub_port_connect_counter.Stats());
+    for (size_t slot = 1; slot < slot_config_phase.size(); ++slot) {
+      if (auto dev = controller->DeviceManager()->FindBySlot(slot)) {
+        if (dev->SetupStageMapStats().full > 0) {
+          Log(kWarn, "  slot %lu:\n", slot);
+          LogHashMapStats("setup_stage_map", dev->SetupStageMapStats());
+        }
+      }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
   void RequestHCOwnership(uintptr_t mmio_base, HCCPARAMS1_Bitmap hccp) {
     ExtendedRegisterList extregs{ mmio_base, hccp };
 
@@ -312,6 +555,28 @@ namespace {
     Log(kDebug, "OS has owned xHC\n");
   }
 
+  /** @brief Supported Protocol Capability を読み，ポートごとの USB メジャーバージョンを記録する */
+  void ReadSupportedProtocols(uintptr_t mmio_base, HCCPARAMS1_Bitmap hccp,
+                              std::array<uint8_t, 256>& port_major_revision) {
+    ExtendedRegisterList extregs{ mmio_base, hccp };
+    for (auto it = extregs.begin(); it != extregs.end(); ++it) {
+      if (it->Read().bits.capability_id != SupportedProtocol_Bitmap::kCapabilityID) {
+        continue;
+      }
+
+      SupportedProtocol_Bitmap protocol;
+      auto regs = reinterpret_cast<const volatile uint32_t*>(&*it);
+      for (int i = 0; i < 3; ++i) {
+        protocol.data[i] = regs[i];
+      }
+      const int first = protocol.bits.compatible_port_offset;
+      const int last = first + protocol.bits.compatible_port_count;
+      for (int port = first; port < last && port < 256; ++port) {
+        port_major_revision[port] = protocol.bits.major_revision;
+      }
+    }
+  }
+
   void SwitchEhci2Xhci(const pci::Device& xhc_dev) {
     bool intel_ehc_exist = false;
     for (int i = 0; i < pci::num_device; ++i) {
@@ -332,6 +597,67 @@ namespace {
     Log(kDebug, "SwitchEhci2Xhci: SS = %02, xHCI = %02x\n",
         superspeed_ports, ehci2xhci_ports);
   }
+
+  PollingMode polling_mode = PollingMode::kInterrupt;
+  /** @brief インタラプタ 0 番の割り込みベクタ．i 番は first_vector + i */
+  uint8_t first_vector;
+
+  /** @brief 見張りのコアやタイマがイベントを最初に見つけた時刻．
+   *
+   * xHC がイベントを書いた時刻そのものではなく，書かれた後で見張りが最初に気付いた時刻．
+   * ProcessEvents が処理を始めるときに読み出して 0 に戻す．
+   */
+  std::array<std::atomic<uint64_t>, Controller::kMaxInterrupters> event_seen_counter{};
+  /** @brief ポーリングでイベントを見つけて通知してから，ProcessEvents が処理し終えるまで true */
+  std::array<std::atomic<bool>, Controller::kMaxInterrupters> event_notified{};
+  /** @brief ProcessEvents が処理しているイベントリングの event_seen_counter */
+  uint64_t current_event_seen_counter;
+
+  /** @brief interrupter 番のイベントリングに新しいイベントがあれば，見つけた時刻を記録する．
+   *
+   * @param notify  通知する役目なら true
+   * @return 通知すべきなら true．ProcessEvents が処理し終えるまでは 1 度だけ true を返す．
+   */
+  bool CheckEventRing(size_t interrupter, bool notify) {
+    // ProcessEvents が Pop している最中に呼ばれることがあるので，書き終えた取り出し位置だけを見る
+    if (!controller->EventRingAt(interrupter)->HasFrontSnapshot()) {
+      return false;
+    }
+    uint64_t not_seen = 0;
+    event_seen_counter[interrupter].compare_exchange_strong(
+        not_seen, Clock::ReadCounter(), std::memory_order_relaxed);
+    return notify && !event_notified[interrupter].exchange(true, std::memory_order_acq_rel);
+  }
+
+  /** @brief LAPIC タイマ割り込みから呼ばれ，イベントがあればメインタスクへ知らせる */
+  void PollOnTimer() {
+    for (size_t i = 0; i < controller->NumInterrupters(); ++i) {
+      if (CheckEventRing(i, true)) {
+        Message msg{Message::kInterruptXHCI};
+        msg.arg.xhci.interrupter = i;
+        task_manager->SendMessage(1, msg);
+      }
+    }
+  }
+
+  /** @brief イベントリングを見張り続ける．専用の AP で動かし，戻らない．
+   *
+   * kDedicatedCore なら，イベントを見つけたインタラプタの割り込みベクタを BSP に IPI で送る．
+   * BSP では MSI と同じハンドラがメインタスクへメッセージを送る．
+   */
+  void WatchEventRings(void* arg) {
+    const bool notify = polling_mode == PollingMode::kDedicatedCore;
+    while (true) {
+      for (size_t i = 0; i < controller->NumInterrupters(); ++i) {
+        if (CheckEventRing(i, notify)) {
+          SendIPIToCPU(0, first_vector + i);
+        }
+      }
+      __builtin_ia32_pause();
+    }
+  }
+
+  Job watch_event_rings_job{WatchEventRings, nullptr, nullptr};
 } // namespace
 
 namespace usb::xhci {
@@ -345,12 +671,18 @@ namespace usb::xhci {
             cap_->HCSPARAMS1.Read().bits.max_ports)} {
   }
 
-  Error Controller::Initialize() {
-    if (auto err = devmgr_.Initialize(kDeviceSize)) {
+  Error Controller::Initialize(size_t num_interrupters) {
+    const size_t max_slots = std::min<size_t>(
+        kDeviceSize, cap_->HCSPARAMS1.Read().bits.max_device_slots);
+    // Context Size が 1 なら各コンテキストは 64 バイト
+    const size_t context_size = cap_->HCCPARAMS1.Read().bits.context_size ? 64 : 32;
+    Log(kDebug, "Context size: %lu bytes\n", context_size);
+    if (auto err = devmgr_.Initialize(max_slots, context_size)) {
       return err;
     }
 
     RequestHCOwnership(mmio_base_, cap_->HCCPARAMS1.Read());
+    ReadSupportedProtocols(mmio_base_, cap_->HCCPARAMS1.Read(), port_major_revision_);
 
     auto usbcmd = op_->USBCMD.Read();
     usbcmd.bits.interrupter_enable = false;
@@ -374,7 +706,7 @@ namespace usb::xhci {
     Log(kDebug, "MaxSlots: %u\n", cap_->HCSPARAMS1.Read().bits.max_device_slots);
     // Set "Max Slots Enabled" field in CONFIG.
     auto config = op_->CONFIG.Read();
-    config.bits.max_device_slots_enabled = kDeviceSize;
+    config.bits.max_device_slots_enabled = max_slots;
     op_->CONFIG.Write(config);
 
     auto hcsparams2 = cap_->HCSPARAMS2.Read();
@@ -388,7 +720,7 @@ namespace usb::xhci {
         Log(kDebug, "scratchpad buffer array %d = %p\n",
             i, scratchpad_buf_arr[i]);
       }
-      devmgr_.DeviceContexts()[0] = reinterpret_cast<DeviceContext*>(scratchpad_buf_arr);
+      devmgr_.DeviceContexts()[0] = scratchpad_buf_arr;
       Log(kInfo, "wrote scratchpad buffer array %p to dev ctx array 0\n",
           scratchpad_buf_arr);
     }
@@ -397,21 +729,38 @@ namespace usb::xhci {
     dcbaap.SetPointer(reinterpret_cast<uint64_t>(devmgr_.DeviceContexts()));
     op_->DCBAAP.Write(dcbaap);
 
-    auto primary_interrupter = &InterrupterRegisterSets()[0];
     if (auto err = cr_.Initialize(32)) {
         return err;
     }
     if (auto err = RegisterCommandRing(&cr_, &op_->CRCR)) {
         return err; }
-    if (auto err = er_.Initialize(32, primary_interrupter)) {
-        return err;
-    }
 
-    // Enable interrupt for the primary interrupter
-    auto iman = primary_interrupter->IMAN.Read();
-    iman.bits.interrupt_pending = true;
-    iman.bits.interrupt_enable = true;
-    primary_interrupter->IMAN.Write(iman);
+    const size_t max_interrupters = cap_->HCSPARAMS1.Read().bits.max_interrupters;
+    num_interrupters_ = std::max<size_t>(
+        1, std::min({num_interrupters, max_interrupters, kMaxInterrupters}));
+    // ERST に置けるエントリ数は 2^(ERST Max) まで
+    const size_t max_event_ring_segments =
+      size_t{1} << hcsparams2.bits.event_ring_segment_table_max;
+    const size_t num_event_ring_segments =
+      std::min(kEventRingSegments, max_event_ring_segments);
+
+    for (size_t i = 0; i < num_interrupters_; ++i) {
+      auto interrupter = &InterrupterRegisterSets()[i];
+      if (auto err = ers_[i].Initialize(kEventRingSegmentSize, num_event_ring_segments,
+                                        interrupter)) {
+          return err;
+      }
+
+      SetModerationInterval(i, kInitialModerationInterval);
+
+      // Enable interrupt for the interrupter
+      auto iman = interrupter->IMAN.Read();
+      iman.bits.interrupt_pending = true;
+      iman.bits.interrupt_enable = true;
+      interrupter->IMAN.Write(iman);
+    }
+    Log(kDebug, "Event Ring: %lu interrupters, %lu segments x %lu TRBs\n",
+        num_interrupters_, num_event_ring_segments, kEventRingSegmentSize);
 
     // Enable interrupt for the controller
     usbcmd = op_->USBCMD.Read();
@@ -421,6 +770,96 @@ namespace usb::xhci {
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  void Controller::RingCommandDoorbell() {
+    if (defer_doorbells_) {
+      command_doorbell_pending_ = true;
+    } else {
+      DoorbellRegisterAt(0)->Ring(0);
+    }
+  }
+
+  void Controller::DeferDoorbells() {
+    defer_doorbells_ = true;
+    devmgr_.DeferDoorbells();
+  }
+
+  void Controller::FlushDoorbells() {
+    defer_doorbells_ = false;
+    if (command_doorbell_pending_) {
+      command_doorbell_pending_ = false;
+      DoorbellRegisterAt(0)->Ring(0);
+    }
+    devmgr_.FlushDoorbells();
+  }
+
+  void Controller::SetInterruptEnabled(bool enabled) {
+    auto usbcmd = op_->USBCMD.Read();
+    usbcmd.bits.interrupter_enable = enabled;
+    op_->USBCMD.Write(usbcmd);
+  }
+
+  void Controller::SetModerationInterval(size_t interrupter, uint16_t interval) {
+    IMOD_Bitmap imod{};
+    imod.bits.interrupt_moderation_interval = interval;
+    imod.bits.interrupt_moderation_counter = 0;
+    InterrupterRegisterSets()[interrupter].IMOD.Write(imod);
+    moderation_[interrupter].stats.interval = interval;
+  }
+
+  void Controller::AdaptModeration(size_t interrupter, uint64_t now) {
+    auto& m = moderation_[interrupter];
+    const auto& er_stats = ers_[interrupter].Stats();
+    // UpdateDequeuePointer の回数はポーリングでも増えるので，ハンドラが数えた回数を使う
+    const uint64_t interrupts = XHCIInterruptCount(interrupter);
+    if (m.window_start == 0 || now < m.window_start) {
+      m.window_start = now;
+      m.start_interrupts = interrupts;
+      m.start_events = er_stats.events;
+      return;
+    }
+    if (now - m.window_start < kModerationWindow) {
+      return;
+    }
+
+    m.stats.window_ns = now - m.window_start;
+    m.stats.window_interrupts = interrupts - m.start_interrupts;
+    m.stats.window_events = er_stats.events - m.start_events;
+    m.window_start = now;
+    m.start_interrupts = interrupts;
+    m.start_events = er_stats.events;
+
+    const auto rate = m.stats.InterruptsPerSecond();
+    const auto events_x100 = m.stats.EventsPerInterruptX100();
+    uint16_t interval = m.stats.interval;
+    if (events_x100 >= kBurstEventsX100 || rate >= kHighInterruptRate) {
+      interval = std::min<uint32_t>(interval * 2, kMaxModerationInterval);
+    } else if (events_x100 <= kSparseEventsX100 && rate <= kLowInterruptRate) {
+      interval = std::max<uint16_t>(interval / 2, kMinModerationInterval);
+    }
+
+    if (interval != m.stats.interval) {
+      Log(kDebug, "xHC interrupter %lu: %lu irq/s, %lu.%02lu events/irq, IMODI %u -> %u\n",
+          interrupter, rate, events_x100 / 100, events_x100 % 100,
+          m.stats.interval, interval);
+      SetModerationInterval(interrupter, interval);
+    }
+  }
+
+  uint8_t Controller::InterrupterFor(uint8_t slot_id, EndpointType ep_type) const {
+    switch (ep_type) {
+    case EndpointType::kControl:
+      return 0;
+    case EndpointType::kInterrupt:
+      return num_interrupters_ > 1 ? 1 : 0;
+    default:
+      if (num_interrupters_ <= 2) {
+        // HID の入力を待たせないよう，インタラプタ 1 には置かない
+        return 0;
+      }
+      return 2 + slot_id % (num_interrupters_ - 2);
+    }
+  }
+
   Error Controller::Run() {
     // Run the controller
     auto usbcmd = op_->USBCMD.Read();
@@ -448,14 +887,13 @@ namespace usb::xhci {
     const auto configs = dev.EndpointConfigs();
     const auto len = dev.NumEndpointConfigs();
 
-    memset(&dev.InputContext()->input_control_context, 0, sizeof(InputControlContext));
-    memcpy(&dev.InputContext()->slot_context,
-           &dev.DeviceContext()->slot_context, sizeof(SlotContext));
+    memset(&dev.InputContext()->Control(), 0, sizeof(InputControlContext));
+    memcpy(&dev.InputContext()->Slot(),
+           &dev.DeviceContext()->Slot(), sizeof(SlotContext));
 
     auto slot_ctx = dev.InputContext()->EnableSlotContext();
     slot_ctx->bits.context_entries = 31;
-    const auto port_id{dev.DeviceContext()->slot_context.bits.root_hub_port_num};
-    const int port_speed{xhc.PortAt(port_id).Speed()};
+    const int port_speed = slot_ctx->bits.speed;
     if (port_speed == 0 || port_speed > kSuperSpeedPlus) {
       return MAKE_ERROR(Error::kUnknownXHCISpeedID);
     }
@@ -487,11 +925,17 @@ namespace usb::xhci {
         ep_ctx->bits.ep_type = configs[i].ep_id.IsIn() ? 7 : 3;
         break;
       }
+      dev.SetInterrupterTarget(ep_dci, xhc.InterrupterFor(dev.SlotID(), configs[i].ep_type));
       ep_ctx->bits.max_packet_size = configs[i].max_packet_size;
       ep_ctx->bits.interval = convert_interval(configs[i].ep_type, configs[i].interval);
       ep_ctx->bits.average_trb_length = 1;
 
-      auto tr = dev.AllocTransferRing(ep_dci, 32);
+      const auto ring_size =
+        TransferRingSizeFor(configs[i].ep_type, configs[i].max_packet_size);
+      auto tr = dev.AllocTransferRing(ep_dci, ring_size.segment_size, ring_size.max_segments);
+      if (tr == nullptr) {
+        return MAKE_ERROR(Error::kNoEnoughMemory);
+      }
       ep_ctx->SetTransferRingBuffer(tr->Buffer());
 
       ep_ctx->bits.dequeue_cycle_state = 1;
@@ -500,37 +944,157 @@ namespace usb::xhci {
       ep_ctx->bits.error_count = 3;
     }
 
-    port_config_phase[port_id] = ConfigPhase::kConfiguringEndpoints;
+    SetConfigPhase(dev, ConfigPhase::kConfiguringEndpoints);
+
+    ConfigureEndpointCommandTRB cmd{*dev.InputContext(), dev.SlotID()};
+    if (xhc.CommandRing()->Push(cmd) == nullptr) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    xhc.RingCommandDoorbell();
 
-    ConfigureEndpointCommandTRB cmd{dev.InputContext(), dev.SlotID()};
-    xhc.CommandRing()->Push(cmd);
-    xhc.DoorbellRegisterAt(0)->Ring(0);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error ConfigureHubSlot(Controller& xhc, Device& hub, int num_ports, int think_time) {
+    memset(&hub.InputContext()->Control(), 0, sizeof(InputControlContext));
+    memcpy(&hub.InputContext()->Slot(),
+           &hub.DeviceContext()->Slot(), sizeof(SlotContext));
+
+    // スロットコンテキストだけを更新する Configure Endpoint Command
+    auto slot_ctx = hub.InputContext()->EnableSlotContext();
+    slot_ctx->bits.hub = 1;
+    slot_ctx->bits.num_ports = num_ports;
+    slot_ctx->bits.mtt = 0;  // TT が 1 つのインターフェース設定（0）だけを使う
+    slot_ctx->bits.ttt = slot_ctx->bits.speed == kHighSpeed ? think_time : 0;
+
+    ConfigureEndpointCommandTRB cmd{*hub.InputContext(), hub.SlotID()};
+    if (xhc.CommandRing()->Push(cmd) == nullptr) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    xhc.RingCommandDoorbell();
 
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error ProcessEvent(Controller& xhc) {
-    if (!xhc.PrimaryEventRing()->HasFront()) {
+  Error ResetHubPort(Controller& xhc, Device& hub, uint8_t port) {
+    const auto& hub_ctx = hub.DeviceContext()->Slot();
+    if (hub.Hub() == nullptr) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    if (RouteTiers(hub_ctx.bits.route_string) == 5 || port > 15) {
+      Log(kWarn, "slot %d: port %d is beyond the route string limit\n", hub.SlotID(), port);
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    const auto key = HubPortKey(hub.SlotID(), port);
+    if (!hub_port_connect_counter.Get(key)) {
+      hub_port_connect_counter.Put(key, Clock::ReadCounter());
+    }
+
+    auto& addressing = addressing_port[RootHubIndex(xhc, hub_ctx.bits.root_hub_port_num)];
+    if (addressing.root_port != 0) {
+      hub_ports_waiting[hub.SlotID()] |= 1u << port;
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    addressing = AddressingPort{
+      static_cast<uint8_t>(hub_ctx.bits.root_hub_port_num), hub.SlotID(), port
+    };
+    return hub.Hub()->ResetPort(port);
+  }
+
+  Error OnHubPortResetCompleted(Controller& xhc, Device& hub, uint8_t port,
+                                bool enabled, int speed) {
+    const auto root_port = hub.DeviceContext()->Slot().bits.root_hub_port_num;
+    const int root_hub = RootHubIndex(xhc, root_port);
+    auto& addressing = addressing_port[root_hub];
+    if (addressing.hub_slot != hub.SlotID() || addressing.hub_port != port) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+
+    if (!enabled) {
+      Log(kWarn, "slot %d: port %d was not enabled by reset\n", hub.SlotID(), port);
+      hub_port_connect_counter.Delete(HubPortKey(hub.SlotID(), port));
+      addressing = AddressingPort{};
+      return StartNextAddressing(xhc, root_hub);
+    }
+
+    addressing.speed = speed;
+    return PushEnableSlotCommand(xhc, root_hub);
+  }
+
+  Error OnHubPortDisconnected(Controller& xhc, Device& hub, uint8_t port) {
+    const auto& hub_ctx = hub.DeviceContext()->Slot();
+    hub_ports_waiting[hub.SlotID()] &= ~(1u << port);
+    hub_port_connect_counter.Delete(HubPortKey(hub.SlotID(), port));
+
+    const int tier = RouteTiers(hub_ctx.bits.route_string);
+    if (tier == 5 || port > 15) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    // 外れたポートの route string を先頭に持つデバイスは，すべてそのポートの先にある
+    const uint32_t route_string = hub_ctx.bits.route_string | (port << (4 * tier));
+    const uint32_t route_mask = (1u << (4 * (tier + 1))) - 1;
+
+    bool pushed = false;
+    for (size_t slot = 1; slot < slot_config_phase.size(); ++slot) {
+      auto dev = xhc.DeviceManager()->FindBySlot(slot);
+      if (dev == nullptr) {
+        continue;
+      }
+      const auto& slot_ctx = dev->DeviceContext()->Slot();
+      if (slot_ctx.bits.root_hub_port_num != hub_ctx.bits.root_hub_port_num ||
+          (slot_ctx.bits.route_string & route_mask) != route_string) {
+        continue;
+      }
+      Log(kInfo, "slot %d (route 0x%05x) disconnected, disabling the slot\n",
+          dev->SlotID(), slot_ctx.bits.route_string);
+      if (xhc.CommandRing()->Push(DisableSlotCommandTRB{dev->SlotID()}) == nullptr) {
+        return MAKE_ERROR(Error::kFull);
+      }
+      pushed = true;
+    }
+    if (pushed) {
+      xhc.RingCommandDoorbell();
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error ProcessEvent(Controller& xhc, size_t interrupter) {
+    auto er = xhc.EventRingAt(interrupter);
+    if (!er->HasFront()) {
       return MAKE_ERROR(Error::kSuccess);
     }
 
     Error err = MAKE_ERROR(Error::kNotImplemented);
-    auto event_trb = xhc.PrimaryEventRing()->Front();
+    auto event_trb = er->Front();
     if (auto trb = TRBDynamicCast<TransferEventTRB>(event_trb)) {
       err = OnEvent(xhc, *trb);
     } else if (auto trb = TRBDynamicCast<PortStatusChangeEventTRB>(event_trb)) {
       err = OnEvent(xhc, *trb);
     } else if (auto trb = TRBDynamicCast<CommandCompletionEventTRB>(event_trb)) {
       err = OnEvent(xhc, *trb);
+    } else if (auto trb = TRBDynamicCast<HostControllerEventTRB>(event_trb)) {
+      err = OnEvent(*er, *trb);
     }
-    xhc.PrimaryEventRing()->Pop();
+    er->Pop();
 
     return err;
   }
 
+  const char* PollingModeName(PollingMode mode) {
+    switch (mode) {
+    case PollingMode::kInterrupt: return "interrupt";
+    case PollingMode::kTimer: return "timer";
+    case PollingMode::kDedicatedCore: return "dedicated core";
+    }
+    return "unknown";
+  }
+
   Controller* controller;
 
-  void Initialize() {
+  void Initialize(PollingMode mode) {
+    polling_mode = mode;
     // Intel 製を優先して xHC を探す
     pci::Device* xhc_dev = nullptr;
     for (int i = 0; i < pci::num_device; ++i) {
@@ -551,12 +1115,74 @@ namespace usb::xhci {
       exit(1);
     }
 
+    // インタラプタごとにベクタを 1 つずつ割り当てる．
+    // MSI-X があればエントリごとに，無ければ MSI の複数メッセージで届ける．
+    static_assert(Controller::kMaxInterrupters <= InterruptVector::kNumXHCIVectors);
     const uint8_t bsp_local_apic_id =
       *reinterpret_cast<const uint32_t*>(0xfee00020) >> 24;
-    pci::ConfigureMSIFixedDestination(
-        *xhc_dev, bsp_local_apic_id,
-        pci::MSITriggerMode::kLevel, pci::MSIDeliveryMode::kFixed,
-        InterruptVector::kXHCI, 0);
+    const unsigned int msix_table_size = pci::MSIXTableSize(*xhc_dev);
+    unsigned int num_vector_exponent;
+    if (msix_table_size > 0) {
+      num_vector_exponent = MostSignificantBit(std::min<unsigned int>(
+          msix_table_size, Controller::kMaxInterrupters));
+    } else {
+      num_vector_exponent = std::min(
+          pci::MSIVectorExponentCapable(*xhc_dev),
+          static_cast<unsigned int>(MostSignificantBit(Controller::kMaxInterrupters)));
+    }
+    const unsigned int num_vectors = 1u << num_vector_exponent;
+
+    const auto vectors = AllocateInterruptVectors(num_vectors);
+    if (vectors.error) {
+      Log(kError, "failed to allocate xHCI vectors: %s\n", vectors.error.Name());
+      exit(1);
+    }
+    for (unsigned int i = 0; i < num_vectors; ++i) {
+      SetInterruptHandler(vectors.value + i, XHCIInterruptHandler(i));
+    }
+
+    bool use_msix = msix_table_size > 0;
+    if (use_msix) {
+      // ハンドラはメインタスクへメッセージを送るので，どのエントリも BSP に向ける
+      Error err = MAKE_ERROR(Error::kSuccess);
+      for (unsigned int i = 0; i < num_vectors && !err; ++i) {
+        err = pci::ConfigureMSIXEntry(
+            *xhc_dev, i, bsp_local_apic_id,
+            pci::MSITriggerMode::kLevel, pci::MSIDeliveryMode::kFixed,
+            vectors.value + i);
+        if (!err) {
+          err = pci::UnmaskMSIX(*xhc_dev, i);
+        }
+      }
+      if (!err) {
+        err = pci::EnableMSIX(*xhc_dev);
+      }
+      if (err) {
+        Log(kWarn, "failed to set up MSI-X: %s, falling back to MSI\n", err.Name());
+        for (unsigned int i = 0; i < num_vectors; ++i) {
+          pci::MaskMSIX(*xhc_dev, i);
+        }
+        use_msix = false;
+        // 割り当てたベクタの先頭から，MSI で送れる数だけを使う
+        num_vector_exponent = std::min(
+            pci::MSIVectorExponentCapable(*xhc_dev), num_vector_exponent);
+      }
+    }
+    if (!use_msix) {
+      if (auto err = pci::ConfigureMSIFixedDestination(
+            *xhc_dev, bsp_local_apic_id,
+            pci::MSITriggerMode::kLevel, pci::MSIDeliveryMode::kFixed,
+            vectors.value, num_vector_exponent)) {
+        Log(kError, "failed to set up MSI: %s\n", err.Name());
+        if (polling_mode == PollingMode::kInterrupt) {
+          exit(1);
+        }
+      }
+    }
+    Log(kInfo, "xHC: %u %s vectors from 0x%02x\n", 1u << num_vector_exponent,
+        use_msix ? "MSI-X" : "MSI", vectors.value);
+    // kDedicatedCore ではこのベクタを IPI で BSP に送るので，ポーリングでも割り当てておく
+    first_vector = vectors.value;
 
     const WithError<uint64_t> xhc_bar = pci::ReadBar(*xhc_dev, 0);
     Log(kDebug, "ReadBar: %s\n", xhc_bar.error.Name());
@@ -569,12 +1195,15 @@ namespace usb::xhci {
     if (0x8086 == pci::ReadVendorId(*xhc_dev)) {
       SwitchEhci2Xhci(*xhc_dev);
     }
-    if (auto err = xhc.Initialize()) {
+    if (auto err = xhc.Initialize(size_t{1} << num_vector_exponent)) {
       Log(kError, "xhc initialize failed: %s\n", err.Name());
       exit(1);
     }
 
-    Log(kInfo, "xHC starting\n");
+    if (polling_mode != PollingMode::kInterrupt) {
+      xhc.SetInterruptEnabled(false);
+    }
+    Log(kInfo, "xHC starting (%s mode)\n", PollingModeName(polling_mode));
     xhc.Run();
 
     for (int i = 1; i <= xhc.MaxPorts(); ++i) {
@@ -591,12 +1220,61 @@ namespace usb::xhci {
     }
   }
 
-  void ProcessEvents() {
-    while (controller->PrimaryEventRing()->HasFront()) {
-      if (auto err = ProcessEvent(*controller)) {
+  void ProcessEvents(size_t interrupter) {
+    if (interrupter >= controller->NumInterrupters()) {
+      return;
+    }
+    auto er = controller->EventRingAt(interrupter);
+    // 読み出すと同時に 0 に戻す．処理中に見張りが付けた時刻は次の ProcessEvents が使う
+    current_event_seen_counter =
+      event_seen_counter[interrupter].exchange(0, std::memory_order_relaxed);
+    // イベントへの応答で積んだ TRB のドアベルは，最後にまとめて鳴らす
+    controller->DeferDoorbells();
+    while (er->HasFront()) {
+      if (auto err = ProcessEvent(*controller, interrupter)) {
         Log(kError, "Error while ProcessEvent: %s at %s:%d\n",
             err.Name(), err.File(), err.Line());
       }
     }
+    controller->FlushDoorbells();
+    er->UpdateDequeuePointer();
+    if (polling_mode == PollingMode::kInterrupt) {
+      // ポーリングでは xHC の割り込みを止めているので，間隔を変えても意味が無い
+      controller->AdaptModeration(interrupter, Clock::Now());
+    }
+
+    // これ以降に書かれたイベントは，ポーリングで見つけ直して通知し直す
+    current_event_seen_counter = 0;
+    event_notified[interrupter].store(false, std::memory_order_release);
+  }
+
+  void StartPolling() {
+    if (polling_mode == PollingMode::kDedicatedCore && num_cpus < 2) {
+      Log(kWarn, "xHC: no AP to dedicate to polling, falling back to timer mode\n");
+      polling_mode = PollingMode::kTimer;
+    }
+
+    if (polling_mode == PollingMode::kTimer) {
+      StartTimerPolling(PollOnTimer);
+    }
+
+    bool watch = polling_mode == PollingMode::kDedicatedCore;
+#ifdef ENABLE_BENCHMARK
+    // 他のモードでも，イベントが書かれた時刻を測るためだけに見張る
+    watch |= num_cpus >= 2;
+#endif
+    if (watch) {
+      DedicateCPU(num_cpus - 1, watch_event_rings_job);
+      Log(kInfo, "xHC: CPU %d watches the event rings (%s mode)\n",
+          num_cpus - 1, PollingModeName(polling_mode));
+    }
+  }
+
+  PollingMode CurrentPollingMode() {
+    return polling_mode;
+  }
+
+  uint64_t CurrentEventSeenCounter() {
+    return current_event_seen_counter;
   }
 }
@@ -15,22 +15,125 @@
 #include "usb/xhci/devmgr.hpp"
 
 namespace usb::xhci {
+  /** @brief インタラプタごとの割り込みモデレーションの状態と統計．
+   *
+   * window_* は直近に締めた窓（Controller::kModerationWindow）の値．
+   */
+  struct ModerationStats {
+    /** @brief 現在の IMODI．250 ns 単位 */
+    uint16_t interval;
+    uint64_t window_ns;
+    uint64_t window_interrupts;
+    uint64_t window_events;
+
+    uint64_t InterruptsPerSecond() const {
+      return window_ns == 0 ? 0 : window_interrupts * 1'000'000'000 / window_ns;
+    }
+
+    /** @brief 割り込み 1 回あたりのイベント数の 100 倍 */
+    uint64_t EventsPerInterruptX100() const {
+      return window_interrupts == 0 ? 0 : window_events * 100 / window_interrupts;
+    }
+  };
+
   class Controller {
    public:
+    /** @brief 使うインタラプタの最大数．MSI のベクタ数にも合わせる */
+    static const size_t kMaxInterrupters = 4;
+
     Controller(uintptr_t mmio_base);
-    Error Initialize();
+    /** @brief コントローラを初期化する．
+     *
+     * @param num_interrupters  使いたいインタラプタの数．割り当てられた MSI のベクタ数を渡す．
+     *   HCSPARAMS1 の MaxIntrs と kMaxInterrupters を超える分は使わない．
+     */
+    Error Initialize(size_t num_interrupters = 1);
     Error Run();
     Ring* CommandRing() { return &cr_; }
-    EventRing* PrimaryEventRing() { return &er_; }
+    EventRing* PrimaryEventRing() { return &ers_[0]; }
+    EventRing* EventRingAt(size_t interrupter) { return &ers_[interrupter]; }
+    size_t NumInterrupters() const { return num_interrupters_; }
+    /** @brief エンドポイントの転送イベントを受け取るインタラプタを決める．
+     *
+     * インタラプタ 0 はコマンド完了とポート状態変化も受け取るので，
+     * コントロール転送だけを置く．インタラプト転送（HID など）はインタラプタ 1 に集め，
+     * バルク転送やアイソクロナス転送を 2 以降にスロットごとに振り分ける．
+     * これで転送量の多いデバイスがあっても，HID の入力がその後ろで待たされない．
+     */
+    uint8_t InterrupterFor(uint8_t slot_id, EndpointType ep_type) const;
     DoorbellRegister* DoorbellRegisterAt(uint8_t index);
+
+    /** @brief コマンドリングのドアベルを鳴らす．DeferDoorbells の間は FlushDoorbells まで溜める */
+    void RingCommandDoorbell();
+    /** @brief コマンドリングと各デバイスのドアベルを FlushDoorbells まで溜める．
+     *
+     * イベントを処理する間に同じリングへ何度 TRB を積んでも，ドアベルの書き込みは
+     * ターゲットごとに 1 回で済む．
+     */
+    void DeferDoorbells();
+    /** @brief 溜めたドアベルを鳴らし，溜めるのをやめる． */
+    void FlushDoorbells();
+
+    /** @brief イベントを割り込み（MSI/MSI-X）で知らせるかを切り替える．
+     *
+     * 止めてもイベントはイベントリングに書かれ続けるので，ポーリングで読める．
+     */
+    void SetInterruptEnabled(bool enabled);
+
+    /** @brief interrupter 番の割り込み間隔の下限（IMODI，250 ns 単位）を設定する */
+    void SetModerationInterval(size_t interrupter, uint16_t interval);
+    /** @brief 割り込みの頻度とイベント数を見て interrupter 番の IMODI を調整する．
+     *
+     * 割り込みモードで ProcessEvents がイベントを処理し終える度に呼ぶ．割り込みの回数は
+     * ハンドラが数えた XHCIInterruptCount を使う．kModerationWindow ごとに，
+     * 割り込み 1 回あたりのイベントが少なく頻度も低ければ（まばらな入力）間隔を半分にして
+     * 遅延を縮め，1 回に多くのイベントが溜まるか頻度が高ければ（バルク転送の連続）
+     * 間隔を倍にして割り込みを減らす．
+     *
+     * @param now  現在時刻（ナノ秒）
+     */
+    void AdaptModeration(size_t interrupter, uint64_t now);
+    const ModerationStats& ModerationStatsAt(size_t interrupter) const {
+      return moderation_[interrupter].stats;
+    }
     Port PortAt(uint8_t port_num) {
       return Port{port_num, PortRegisterSets()[port_num - 1]};
     }
     uint8_t MaxPorts() const { return max_ports_; }
+    /** @brief ポートの USB メジャーバージョン（2 か 3）．分からなければ 0．
+     *
+     * Supported Protocol Capability から読む．同じバージョンのポートが 1 つのルートハブを成す．
+     */
+    uint8_t PortMajorRevision(uint8_t port_num) const { return port_major_revision_[port_num]; }
     DeviceManager* DeviceManager() { return &devmgr_; }
 
    private:
-    static const size_t kDeviceSize = 8;
+    /** @brief 使うスロットの最大数．ハブの先のデバイスもそれぞれ 1 つ使う */
+    static constexpr size_t kDeviceSize = 32;
+    /** @brief プライマリイベントリングの 1 セグメントの TRB 数（4 KiB） */
+    static const size_t kEventRingSegmentSize = 256;
+    /** @brief プライマリイベントリングのセグメント数．ERST Max が小さければそれに合わせる */
+    static const size_t kEventRingSegments = 4;
+
+    /** @brief IMODI の初期値と範囲．250 ns 単位で，40 us，10 us〜500 us */
+    static constexpr uint16_t kInitialModerationInterval = 160;
+    static constexpr uint16_t kMinModerationInterval = 40;
+    static constexpr uint16_t kMaxModerationInterval = 2000;
+    /** @brief 割り込みの頻度を測る窓の長さ（ナノ秒） */
+    static constexpr uint64_t kModerationWindow = 10'000'000;
+    /** @brief 割り込み 1 回あたりのイベント数（100 倍）と毎秒の割り込み回数の閾値 */
+    static constexpr uint64_t kBurstEventsX100 = 800;
+    static constexpr uint64_t kSparseEventsX100 = 150;
+    static constexpr uint64_t kHighInterruptRate = 8000;
+    static constexpr uint64_t kLowInterruptRate = 1000;
+
+    struct ModerationState {
+      ModerationStats stats;
+      /** @brief 今の窓が始まった時刻と，その時点での割り込み回数（XHCIInterruptCount）とイベント数 */
+      uint64_t window_start;
+      uint64_t start_interrupts;
+      uint64_t start_events;
+    };
 
     const uintptr_t mmio_base_;
     CapabilityRegisters* const cap_;
@@ -39,7 +142,12 @@ namespace usb::xhci {
 
     class DeviceManager devmgr_;
     Ring cr_;
-    EventRing er_;
+    std::array<EventRing, kMaxInterrupters> ers_;
+    size_t num_interrupters_{1};
+    std::array<ModerationState, kMaxInterrupters> moderation_{};
+    bool defer_doorbells_ = false;
+    std::array<uint8_t, 256> port_major_revision_{};  // index: port number
+    bool command_doorbell_pending_ = false;
 
     InterrupterRegisterSetArray InterrupterRegisterSets() const {
       return {mmio_base_ + cap_->RTSOFF.Read().Offset() + 0x20u, 1024};
@@ -57,17 +165,78 @@ namespace usb::xhci {
   Error ConfigurePort(Controller& xhc, Port& port);
   Error ConfigureEndpoints(Controller& xhc, Device& dev);
 
+  /** @brief ハブのスロットコンテキストにポート数と TT の think time を設定する．
+   *
+   * 子デバイスの Enable Slot より先にコマンドリングへ積まれるので，
+   * 子デバイスを列挙するときには設定が済んでいる．
+   */
+  Error ConfigureHubSlot(Controller& xhc, Device& hub, int num_ports, int think_time);
+  /** @brief ハブの下流ポート port のデバイスの列挙を始める．
+   *
+   * 同じルートハブで別のポートがリセットからアドレス割り当てまでの途中なら，
+   * それが終わるまで待ってから HubDriver::ResetPort を呼ぶ．
+   */
+  Error ResetHubPort(Controller& xhc, Device& hub, uint8_t port);
+  /** @brief ハブの下流ポート port のリセットが終わった．有効ならスロットを割り当てる．
+   *
+   * @param speed  デバイスの速度（Protocol Speed ID）
+   */
+  Error OnHubPortResetCompleted(Controller& xhc, Device& hub, uint8_t port,
+                                bool enabled, int speed);
+  /** @brief ハブの下流ポート port からデバイスが外れた．
+   *
+   * そのデバイスと，その先につながっていたデバイスのスロットを Disable Slot で解放する．
+   * 列挙の順番を待っていたならその待ちを取り消す．
+   */
+  Error OnHubPortDisconnected(Controller& xhc, Device& hub, uint8_t port);
+
   /** @brief イベントリングに登録されたイベントを高々1つ処理する．
    *
-   * xhc のプライマリイベントリングの先頭のイベントを処理する．
+   * xhc の interrupter 番のイベントリングの先頭のイベントを処理する．
    * イベントが無ければ即座に Error::kSuccess を返す．
+   * 取り出した位置はまだ ERDP に書き戻さないので，処理し終えたら
+   * EventRing::UpdateDequeuePointer を呼ぶ（ProcessEvents は自分で呼ぶ）．
    *
    * @return イベントを正常に処理できたら Error::kSuccess
    */
-  Error ProcessEvent(Controller& xhc);
+  Error ProcessEvent(Controller& xhc, size_t interrupter = 0);
+
 
+  /** @brief イベントリングに新しいイベントが書かれたことをどう知るか */
+  enum class PollingMode {
+    /** @brief MSI/MSI-X の割り込み．IMODI の分だけ遅れることがある */
+    kInterrupt,
+    /** @brief LAPIC タイマ割り込み（kPollTimerPeriod ごと）で cycle bit を調べる */
+    kTimer,
+    /** @brief 専用の AP が cycle bit を調べ続け，見つけたら BSP に IPI を送る */
+    kDedicatedCore,
+  };
+
+  const char* PollingModeName(PollingMode mode);
 
   extern Controller* controller;
-  void Initialize();
-  void ProcessEvents();
+  /** @brief xHC を探して初期化する．
+   *
+   * kInterrupt 以外ではコントローラの割り込みを止める．ポーリングは StartPolling で始める．
+   * どのモードでもイベントはメインタスクへの kInterruptXHCI メッセージで届き，
+   * メインタスクが ProcessEvents で処理する．
+   */
+  void Initialize(PollingMode mode = PollingMode::kInterrupt);
+  /** @brief Initialize で選んだモードのポーリングを始める．
+   *
+   * InitializeLAPICTimer と InitializeSMP の後に呼ぶ．kDedicatedCore で AP が無ければ kTimer にする．
+   * ENABLE_BENCHMARK なら，他のモードでも AP があれば最後の AP でイベントリングを見張り，
+   * イベントが書かれた時刻を記録する（CurrentEventSeenCounter）．
+   */
+  void StartPolling();
+  PollingMode CurrentPollingMode();
+  /** @brief interrupter 番のイベントリングのイベントをすべて処理し，ERDP を 1 回だけ書き戻す． */
+  void ProcessEvents(size_t interrupter = 0);
+  /** @brief ProcessEvents が処理しているイベントを見張りのコアやタイマが最初に見つけた時刻．
+   *
+   * xHC がイベントを書いた時刻より，見張りがリングを調べる間隔の分だけ遅れることがある．
+   * Clock::ReadCounter の値．見張るコアが無いなどで分からなければ 0．
+   * クラスドライバのオブザーバなど，イベントへの応答の中から呼ぶ．
+   */
+  uint64_t CurrentEventSeenCounter();
 }
@@ -33,12 +33,13 @@ void Window::DrawTo(FrameBuffer& dst, Vector2D<int> pos, const Rectangle<int>& a
 
   const auto tc = transparent_color_.value();
   auto& writer = dst.Writer();
-  for (int y = std::max(0, 0 - pos.y);
-       y < std::min(Height(), writer.Height() - pos.y);
-       ++y) {
-    for (int x = std::max(0, 0 - pos.x);
-         x < std::min(Width(), writer.Width() - pos.x);
-         ++x) {
+  // area の外には書かない．タイルごとに並列に合成するとき，隣のタイルを壊さないため
+  const Rectangle<int> window_area{pos, Size()};
+  const Rectangle<int> writer_area{{0, 0}, {writer.Width(), writer.Height()}};
+  const auto draw_area = area & window_area & writer_area;
+  const auto draw_end = draw_area.pos + draw_area.size - pos;
+  for (int y = draw_area.pos.y - pos.y; y < draw_end.y; ++y) {
+    for (int x = draw_area.pos.x - pos.x; x < draw_end.x; ++x) {
       const auto c = At(Vector2D<int>{x, y});
       if (c != tc) {
         writer.Write(pos + Vector2D<int>{x, y}, c);